@@ -0,0 +1,41 @@
+# Measures resize throughput for each filter.
+#
+#     mix run bench/resize.exs
+#
+defmodule ResizeBench do
+  @filters [:point, :box, :triangle, :cubic_bspline, :catmull_rom, :mitchell]
+  @cases [
+    {"4K -> 1/8", {2160, 3840, 3}, {270, 480}},
+    {"4K -> 1/2", {2160, 3840, 3}, {1080, 1920}},
+    {"qHD -> 2x", {540, 960, 3}, {1080, 1920}}
+  ]
+
+  def run do
+    for {name, {h, w, c} = shape, {out_h, out_w}} <- @cases do
+      img = StbImage.new(:crypto.strong_rand_bytes(h * w * c), shape)
+      IO.puts("#{name}: #{w}x#{h} -> #{out_w}x#{out_h}")
+
+      for filter <- @filters do
+        seconds = measure(fn -> StbImage.resize(img, out_h, out_w, filter: filter) end)
+        mpix = h * w / seconds / 1_000_000
+
+        IO.puts(
+          "  #{String.pad_trailing(inspect(filter), 16)}" <>
+            "#{:erlang.float_to_binary(seconds * 1000, decimals: 2)} ms  " <>
+            "#{:erlang.float_to_binary(mpix, decimals: 1)} Mpix/s"
+        )
+      end
+    end
+  end
+
+  # Average seconds per call over at least one second of runs
+  defp measure(fun, runs \\ 0, elapsed \\ 0) do
+    {time, _} = :timer.tc(fun)
+    runs = runs + 1
+    elapsed = elapsed + time
+
+    if elapsed < 1_000_000, do: measure(fun, runs, elapsed), else: elapsed / runs / 1_000_000
+  end
+end
+
+ResizeBench.run()
@@ -0,0 +1,363 @@
+#pragma once
+
+// Box downscale by integer ratios.
+//
+// When every output pixel covers exactly fx * fy input pixels, the box
+// filter reduces to a plain average of those pixels and none of the
+// polyphase machinery of stbir_resize_extended is needed. Each output row
+// sums its fy input rows into a row of accumulators (a loop compilers turn
+// into wide vector adds), then sums fx accumulators per output pixel.
+//
+// The result is the one of STBIR_FILTER_BOX up to float rounding,
+// including the alpha weighting stb_image_resize2 applies to 4-channel
+// (non-premultiplied RGBA) images. Premultiplied images are plain
+// averages.
+//
+// Must be included after the stb_image_resize2.h implementation.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "erl_nif.h"
+#include "parallel.h"
+
+// Largest number of input pixels per output pixel, so that 8-bit sums
+// weighted by alpha still fit in 32 bits.
+#define BOX_MAX_AREA 65536
+
+typedef struct {
+    const unsigned char *input;
+    unsigned char *output;
+    size_t input_stride;
+    size_t output_stride;
+    int output_w;
+    int output_h;
+    int fx;
+    int fy;
+    int channels;
+    // Non-premultiplied alpha in the last channel
+    bool alpha;
+    bool is_float;
+    int bands;
+    char *failed;
+} BoxJob;
+
+// floor(s / n) for s < 2^24 as a multiplication, see Granlund and
+// Montgomery, "Division by invariant integers using multiplication".
+static inline uint32_t box_div(uint32_t s, uint64_t m) {
+    return (uint32_t)(((uint64_t)s * m) >> 40);
+}
+
+// Sums fx accumulated pixels into each output pixel. Inlined with
+// constant `c` and `fx` for the common ratios so the loops are unrolled.
+static inline void box_reduce_u8(const uint16_t *acc, unsigned char *out, int output_w, int c, int fx, uint32_t n, uint64_t m, int shift) {
+    for (int ox = 0; ox < output_w; ++ox) {
+        const uint16_t *p = acc + (size_t)ox * fx * c;
+        for (int ch = 0; ch < c; ++ch) {
+            uint32_t s = n / 2;
+            for (int j = 0; j < fx; ++j) {
+                s += p[j * c + ch];
+            }
+            out[ox * c + ch] = (unsigned char)(shift >= 0 ? s >> shift : box_div(s, m));
+        }
+    }
+}
+
+#define BOX_REDUCE_CASE(C, FX) \
+    if (c == C && fx == FX) { \
+        if (shift >= 0) { \
+            box_reduce_u8(acc, out, output_w, C, FX, n, m, shift); \
+        } else { \
+            box_reduce_u8(acc, out, output_w, C, FX, n, m, -1); \
+        } \
+        return; \
+    }
+
+static void box_reduce_u8_dispatch(const uint16_t *acc, unsigned char *out, int output_w, int c, int fx, uint32_t n, uint64_t m, int shift) {
+    BOX_REDUCE_CASE(1, 2) BOX_REDUCE_CASE(1, 4) BOX_REDUCE_CASE(1, 8)
+    BOX_REDUCE_CASE(2, 2) BOX_REDUCE_CASE(2, 4) BOX_REDUCE_CASE(2, 8)
+    BOX_REDUCE_CASE(3, 2) BOX_REDUCE_CASE(3, 4) BOX_REDUCE_CASE(3, 8)
+    BOX_REDUCE_CASE(4, 2) BOX_REDUCE_CASE(4, 4) BOX_REDUCE_CASE(4, 8)
+    box_reduce_u8(acc, out, output_w, c, fx, n, m, shift);
+}
+
+#undef BOX_REDUCE_CASE
+
+static void box_rows_u8(const BoxJob *job, int y0, int y1, void *scratch) {
+    int c = job->channels, fx = job->fx, fy = job->fy;
+    size_t row_len = (size_t)job->output_w * fx * c;
+    uint32_t n = (uint32_t)(fx * fy);
+    uint64_t m = ((1ull << 40) + n - 1) / n;
+    int shift = -1;
+    if ((n & (n - 1)) == 0) {
+        for (shift = 0; (1u << shift) != n; ++shift);
+    }
+
+    for (int oy = y0; oy < y1; ++oy) {
+        const unsigned char *rows = job->input + (size_t)oy * fy * job->input_stride;
+        unsigned char *out = job->output + (size_t)oy * job->output_stride;
+
+        if (!job->alpha && fy <= 257) {
+            // 16-bit column sums hold up to 257 rows and halve the memory traffic
+            uint16_t *acc = (uint16_t *)scratch;
+            for (size_t i = 0; i < row_len; ++i) {
+                acc[i] = rows[i];
+            }
+            for (int k = 1; k < fy; ++k) {
+                const unsigned char *row = rows + k * job->input_stride;
+                for (size_t i = 0; i < row_len; ++i) {
+                    acc[i] += row[i];
+                }
+            }
+            box_reduce_u8_dispatch(acc, out, job->output_w, c, fx, n, m, shift);
+        } else if (!job->alpha) {
+            uint32_t *acc = (uint32_t *)scratch;
+            memset(acc, 0, row_len * sizeof(uint32_t));
+            for (int k = 0; k < fy; ++k) {
+                const unsigned char *row = rows + k * job->input_stride;
+                for (size_t i = 0; i < row_len; ++i) {
+                    acc[i] += row[i];
+                }
+            }
+
+            for (int ox = 0; ox < job->output_w; ++ox) {
+                const uint32_t *p = acc + (size_t)ox * fx * c;
+                for (int ch = 0; ch < c; ++ch) {
+                    uint32_t s = n / 2;
+                    for (int j = 0; j < fx; ++j) {
+                        s += p[j * c + ch];
+                    }
+                    out[ox * c + ch] = (unsigned char)box_div(s, m);
+                }
+            }
+        } else {
+            // Colour is weighted by alpha, as stb_image_resize2 does for RGBA
+            uint32_t *acc = (uint32_t *)scratch;
+            memset(acc, 0, row_len * sizeof(uint32_t));
+            for (int k = 0; k < fy; ++k) {
+                const unsigned char *row = rows + k * job->input_stride;
+                for (size_t i = 0; i < row_len; i += 4) {
+                    uint32_t a = row[i + 3];
+                    acc[i] += row[i] * a;
+                    acc[i + 1] += row[i + 1] * a;
+                    acc[i + 2] += row[i + 2] * a;
+                    acc[i + 3] += a;
+                }
+            }
+
+            for (int ox = 0; ox < job->output_w; ++ox) {
+                const uint32_t *p = acc + (size_t)ox * fx * 4;
+                uint32_t s[4] = {0, 0, 0, 0};
+                for (int j = 0; j < fx; ++j) {
+                    s[0] += p[j * 4];
+                    s[1] += p[j * 4 + 1];
+                    s[2] += p[j * 4 + 2];
+                    s[3] += p[j * 4 + 3];
+                }
+
+                unsigned char *o = out + ox * 4;
+                if (s[3] == 0) {
+                    // Fully transparent, fall back to the unweighted average
+                    for (int ch = 0; ch < 3; ++ch) {
+                        uint32_t raw = n / 2;
+                        for (int k = 0; k < fy; ++k) {
+                            const unsigned char *q = rows + k * job->input_stride + (size_t)ox * fx * 4;
+                            for (int j = 0; j < fx; ++j) {
+                                raw += q[j * 4 + ch];
+                            }
+                        }
+                        o[ch] = (unsigned char)box_div(raw, m);
+                    }
+                } else {
+                    o[0] = (unsigned char)((s[0] + s[3] / 2) / s[3]);
+                    o[1] = (unsigned char)((s[1] + s[3] / 2) / s[3]);
+                    o[2] = (unsigned char)((s[2] + s[3] / 2) / s[3]);
+                }
+                o[3] = (unsigned char)box_div(s[3] + n / 2, m);
+            }
+        }
+    }
+}
+
+static void box_rows_f32(const BoxJob *job, int y0, int y1, void *scratch) {
+    int c = job->channels, fx = job->fx, fy = job->fy;
+    size_t row_len = (size_t)job->output_w * fx * c;
+    float inv_n = 1.0f / (float)(fx * fy);
+    float *acc = (float *)scratch;
+
+    for (int oy = y0; oy < y1; ++oy) {
+        const unsigned char *rows = job->input + (size_t)oy * fy * job->input_stride;
+        float *out = (float *)(job->output + (size_t)oy * job->output_stride);
+
+        memset(acc, 0, row_len * sizeof(float));
+        for (int k = 0; k < fy; ++k) {
+            const float *row = (const float *)(rows + k * job->input_stride);
+            if (job->alpha) {
+                for (size_t i = 0; i < row_len; i += 4) {
+                    float a = row[i + 3];
+                    acc[i] += row[i] * a;
+                    acc[i + 1] += row[i + 1] * a;
+                    acc[i + 2] += row[i + 2] * a;
+                    acc[i + 3] += a;
+                }
+            } else {
+                for (size_t i = 0; i < row_len; ++i) {
+                    acc[i] += row[i];
+                }
+            }
+        }
+
+        for (int ox = 0; ox < job->output_w; ++ox) {
+            const float *p = acc + (size_t)ox * fx * c;
+            float *o = out + ox * c;
+            for (int ch = 0; ch < c; ++ch) {
+                float s = 0;
+                for (int j = 0; j < fx; ++j) {
+                    s += p[j * c + ch];
+                }
+                o[ch] = s * inv_n;
+            }
+
+            if (job->alpha) {
+                float a = o[3];
+                if (a < stbir__small_float) {
+                    for (int ch = 0; ch < 3; ++ch) {
+                        float raw = 0;
+                        for (int k = 0; k < fy; ++k) {
+                            const float *q = (const float *)(rows + k * job->input_stride) + (size_t)ox * fx * 4;
+                            for (int j = 0; j < fx; ++j) {
+                                raw += q[j * 4 + ch];
+                            }
+                        }
+                        o[ch] = raw * inv_n;
+                    }
+                } else {
+                    float inv_a = 1.0f / a;
+                    o[0] *= inv_a;
+                    o[1] *= inv_a;
+                    o[2] *= inv_a;
+                }
+            }
+        }
+    }
+}
+
+static void box_task(void *context, int index) {
+    BoxJob *job = (BoxJob *)context;
+    int y0 = (int)((int64_t)job->output_h * index / job->bands);
+    int y1 = (int)((int64_t)job->output_h * (index + 1) / job->bands);
+    size_t row_len = (size_t)job->output_w * job->fx * job->channels;
+
+    void *scratch = enif_alloc(row_len * 4);
+    if (scratch == NULL) {
+        job->failed[index] = 1;
+        return;
+    }
+
+    if (job->is_float) {
+        box_rows_f32(job, y0, y1, scratch);
+    } else {
+        box_rows_u8(job, y0, y1, scratch);
+    }
+    enif_free(scratch);
+}
+
+// Fills `job` for `resize` if it is an integer-ratio box downscale of
+// whole images the kernels handle, returning false otherwise. The input
+// and output of `job` are those of `resize`, which may be missing when
+// rows come from callbacks.
+static bool box_job_init(const STBIR_RESIZE *resize, BoxJob *job) {
+    int channels;
+    bool alpha = false;
+
+    switch (resize->input_pixel_layout_public) {
+        case STBIR_1CHANNEL: channels = 1; break;
+        case STBIR_2CHANNEL: channels = 2; break;
+        case STBIR_RA_PM: channels = 2; break;
+        case STBIR_RGB: channels = 3; break;
+        case STBIR_4CHANNEL: channels = 4; break;
+        case STBIR_RGBA_PM: channels = 4; break;
+        case STBIR_RGBA: channels = 4; alpha = true; break;
+        default: return false;
+    }
+
+    if (resize->horizontal_filter != STBIR_FILTER_BOX || resize->vertical_filter != STBIR_FILTER_BOX ||
+        resize->input_pixel_layout_public != resize->output_pixel_layout_public ||
+        resize->input_data_type != resize->output_data_type ||
+        (resize->input_data_type != STBIR_TYPE_UINT8 && resize->input_data_type != STBIR_TYPE_FLOAT) ||
+        resize->input_s0 != 0.0 || resize->input_t0 != 0.0 || resize->input_s1 != 1.0 || resize->input_t1 != 1.0 ||
+        resize->output_subx != 0 || resize->output_suby != 0 ||
+        resize->output_subw != resize->output_w || resize->output_subh != resize->output_h ||
+        resize->output_w <= 0 || resize->output_h <= 0 ||
+        resize->input_w % resize->output_w != 0 || resize->input_h % resize->output_h != 0) {
+        return false;
+    }
+
+    job->fx = resize->input_w / resize->output_w;
+    job->fy = resize->input_h / resize->output_h;
+    if ((int64_t)job->fx * job->fy > BOX_MAX_AREA) {
+        return false;
+    }
+
+    size_t type_size = resize->input_data_type == STBIR_TYPE_FLOAT ? sizeof(float) : 1;
+    job->input = (const unsigned char *)resize->input_pixels;
+    job->output = (unsigned char *)resize->output_pixels;
+    job->input_stride = resize->input_stride_in_bytes ? (size_t)resize->input_stride_in_bytes : (size_t)resize->input_w * channels * type_size;
+    job->output_stride = resize->output_stride_in_bytes ? (size_t)resize->output_stride_in_bytes : (size_t)resize->output_w * channels * type_size;
+    job->output_w = resize->output_w;
+    job->output_h = resize->output_h;
+    job->channels = channels;
+    job->alpha = alpha;
+    job->is_float = type_size == sizeof(float);
+    return true;
+}
+
+// Bytes of scratch box_row needs
+static size_t box_scratch_size(const BoxJob *job) {
+    return (size_t)job->output_w * job->fx * job->channels * 4;
+}
+
+// Computes output row `oy` of `job` from its fy input rows, which start
+// at `rows` and are `stride` bytes apart, for callers that decode the
+// input as they go
+static void box_row(const BoxJob *job, int oy, const unsigned char *rows, size_t stride, void *scratch) {
+    BoxJob row = *job;
+    row.input = rows;
+    row.input_stride = stride;
+    row.output = job->output + (size_t)oy * job->output_stride;
+
+    if (job->is_float) {
+        box_rows_f32(&row, 0, 1, scratch);
+    } else {
+        box_rows_u8(&row, 0, 1, scratch);
+    }
+}
+
+// Runs `resize` with the box kernels if it is an integer-ratio box
+// downscale of whole images, returning false otherwise. `*ok` is set to
+// whether the resize succeeded.
+static bool box_resize_try(STBIR_RESIZE *resize, int threads, bool *ok) {
+    BoxJob job;
+
+    if (resize->input_cb != NULL || resize->output_cb != NULL ||
+        resize->input_pixels == NULL || resize->output_pixels == NULL || !box_job_init(resize, &job)) {
+        return false;
+    }
+
+    job.bands = threads < 1 ? 1 : (threads > job.output_h ? job.output_h : threads);
+    job.failed = (char *)enif_alloc(job.bands);
+    if (job.failed == NULL) {
+        *ok = false;
+        return true;
+    }
+    memset(job.failed, 0, job.bands);
+
+    parallel_for(job.bands, job.bands, box_task, &job);
+
+    *ok = true;
+    for (int i = 0; i < job.bands; ++i) {
+        *ok = *ok && !job.failed[i];
+    }
+    enif_free(job.failed);
+    return true;
+}
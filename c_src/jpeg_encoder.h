@@ -0,0 +1,955 @@
+#pragma once
+
+// Baseline JPEG encoder.
+//
+// This is a rework of stbi_write_jpg_core from stb_image_write.h (itself
+// based on Jon Olick's jo_jpeg) that keeps the same quantization tables,
+// colour transform and entropy coder, but lets the caller choose chroma
+// subsampling independently from quality and runs the forward DCT, colour
+// conversion and quantization on 4-lane vectors (see simd.h).
+//
+// When restart markers are requested the scan is split into independent
+// segments of whole MCU rows. Each segment starts with fresh DC predictors
+// and ends byte aligned, so segments are entropy coded in parallel and
+// then joined with RSTn markers.
+//
+// Optionally, a first pass over the image gathers symbol statistics and
+// the standard Annex K Huffman tables are replaced with optimal ones
+// built with the procedure from Annex K.2.
+//
+// Both passes can run a few MCU rows at a time, see JpegStream.
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "parallel.h"
+#include "simd.h"
+
+#define JPEG_SUBSAMPLING_AUTO 0
+#define JPEG_SUBSAMPLING_444 1
+#define JPEG_SUBSAMPLING_420 2
+
+// Worst case for a single 8x8 block: 64 codes of up to 16 + 11 bits,
+// each byte possibly followed by a stuffed zero.
+#define JPEG_MAX_BLOCK_BYTES 512
+
+typedef struct {
+    int quality;
+    int subsampling;
+    // MCU rows per restart interval, 0 disables restart markers
+    int restart_rows;
+    int threads;
+    bool optimize_huffman;
+} JpegOptions;
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    bool out_of_memory;
+} JpegBuffer;
+
+typedef struct {
+    JpegBuffer *out;
+    int bit_buf;
+    int bit_cnt;
+} JpegBitWriter;
+
+// Index of each Huffman table, in the order they are written to DHT.
+#define JPEG_HT_Y_DC 0
+#define JPEG_HT_Y_AC 1
+#define JPEG_HT_UV_DC 2
+#define JPEG_HT_UV_AC 3
+
+// A Huffman table as stored in a DHT segment: the number of codes of each
+// length (indices 1 to 16) followed by the symbols in code order.
+typedef struct {
+    unsigned char bits[17];
+    unsigned char values[256];
+} JpegHuffmanSpec;
+
+// Symbol frequencies for each of the four Huffman tables.
+typedef struct {
+    uint32_t freq[4][256];
+} JpegStatistics;
+
+typedef struct {
+    int width;
+    int height;
+    int comp;
+    const unsigned char *data;
+    bool subsample;
+    int mcu_size;
+    int mcu_rows;
+    int restart_rows;
+    unsigned char y_table[64];
+    unsigned char uv_table[64];
+    float fdtbl_y[64];
+    float fdtbl_uv[64];
+    JpegHuffmanSpec huffman[4];
+    unsigned short ht[4][256][2];
+} JpegEncoder;
+
+static const unsigned char jpeg_zigzag[] = {
+    0, 1, 5, 6, 14, 15, 27, 28, 2, 4, 7, 13, 16, 26, 29, 42, 3, 8, 12, 17, 25, 30, 41, 43, 9, 11, 18,
+    24, 31, 40, 44, 53, 10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60, 21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63};
+
+static const unsigned char jpeg_std_dc_luminance_nrcodes[] = {0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const unsigned char jpeg_std_dc_luminance_values[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const unsigned char jpeg_std_ac_luminance_nrcodes[] = {0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const unsigned char jpeg_std_ac_luminance_values[] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+static const unsigned char jpeg_std_dc_chrominance_nrcodes[] = {0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+static const unsigned char jpeg_std_dc_chrominance_values[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const unsigned char jpeg_std_ac_chrominance_nrcodes[] = {0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+static const unsigned char jpeg_std_ac_chrominance_values[] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+static const int jpeg_std_y_qt[] = {16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55, 14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62, 18, 22,
+                                    37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92, 49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+static const int jpeg_std_uv_qt[] = {17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99, 24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+                                     99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+static const float jpeg_aasf[] = {1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+                                  1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f};
+
+static bool jpeg_buffer_reserve(JpegBuffer *buffer, size_t extra) {
+    if (buffer->out_of_memory) {
+        return false;
+    }
+    if (buffer->size + extra <= buffer->capacity) {
+        return true;
+    }
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->size + extra) {
+        capacity *= 2;
+    }
+
+    unsigned char *data = enif_realloc(buffer->data, capacity);
+    if (data == NULL) {
+        buffer->out_of_memory = true;
+        return false;
+    }
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+static void jpeg_buffer_write(JpegBuffer *buffer, const void *data, size_t size) {
+    if (jpeg_buffer_reserve(buffer, size)) {
+        memcpy(buffer->data + buffer->size, data, size);
+        buffer->size += size;
+    }
+}
+
+static void jpeg_buffer_putc(JpegBuffer *buffer, unsigned char c) {
+    jpeg_buffer_write(buffer, &c, 1);
+}
+
+static void jpeg_buffer_free(JpegBuffer *buffer) {
+    enif_free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = buffer->capacity = 0;
+}
+
+// Callers reserve JPEG_MAX_BLOCK_BYTES before each block, so the bit writer
+// itself never needs to check for space.
+static inline void jpeg_write_bits(JpegBitWriter *bw, const unsigned short *bs) {
+    int bit_buf = bw->bit_buf, bit_cnt = bw->bit_cnt;
+    JpegBuffer *out = bw->out;
+
+    bit_cnt += bs[1];
+    bit_buf |= bs[0] << (24 - bit_cnt);
+    while (bit_cnt >= 8) {
+        unsigned char c = (bit_buf >> 16) & 255;
+        out->data[out->size++] = c;
+        if (c == 255) {
+            out->data[out->size++] = 0;
+        }
+        bit_buf <<= 8;
+        bit_cnt -= 8;
+    }
+
+    bw->bit_buf = bit_buf;
+    bw->bit_cnt = bit_cnt;
+}
+
+static void jpeg_set_huffman_spec(JpegHuffmanSpec *spec, const unsigned char *nrcodes, const unsigned char *values, size_t num_values) {
+    memcpy(spec->bits, nrcodes, sizeof(spec->bits));
+    memset(spec->values, 0, sizeof(spec->values));
+    memcpy(spec->values, values, num_values);
+}
+
+static int jpeg_huffman_spec_size(const JpegHuffmanSpec *spec) {
+    int count = 0;
+    for (int len = 1; len <= 16; ++len) {
+        count += spec->bits[len];
+    }
+    return count;
+}
+
+static void jpeg_build_huffman_table(const JpegHuffmanSpec *spec, unsigned short table[256][2]) {
+    int code = 0, k = 0;
+
+    memset(table, 0, sizeof(unsigned short) * 256 * 2);
+    for (int len = 1; len <= 16; ++len) {
+        for (int i = 0; i < spec->bits[len]; ++i, ++k) {
+            table[spec->values[k]][0] = (unsigned short)code++;
+            table[spec->values[k]][1] = (unsigned short)len;
+        }
+        code <<= 1;
+    }
+}
+
+// Builds an optimal length-limited Huffman table for the given symbol
+// frequencies, following Annex K.2 of the JPEG specification (and libjpeg's
+// jpeg_gen_optimal_table).
+static void jpeg_build_optimal_huffman_spec(const uint32_t counts[256], JpegHuffmanSpec *spec) {
+    uint32_t freq[257];
+    int codesize[257];
+    int others[257];
+    int bits[33];
+
+    memcpy(freq, counts, sizeof(uint32_t) * 256);
+    // Reserve one code point so that no real symbol gets an all-ones code
+    freq[256] = 1;
+    for (int i = 0; i < 257; ++i) {
+        codesize[i] = 0;
+        others[i] = -1;
+    }
+
+    for (;;) {
+        // Find the two smallest nonzero frequencies, preferring the larger
+        // symbol on ties
+        int c1 = -1, c2 = -1;
+        uint32_t v = UINT32_MAX;
+        for (int i = 0; i <= 256; ++i) {
+            if (freq[i] && freq[i] <= v) {
+                v = freq[i];
+                c1 = i;
+            }
+        }
+        v = UINT32_MAX;
+        for (int i = 0; i <= 256; ++i) {
+            if (freq[i] && freq[i] <= v && i != c1) {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0) {
+            break;
+        }
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        ++codesize[c1];
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            ++codesize[c1];
+        }
+        others[c1] = c2;
+
+        ++codesize[c2];
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            ++codesize[c2];
+        }
+    }
+
+    memset(bits, 0, sizeof(bits));
+    for (int i = 0; i <= 256; ++i) {
+        if (codesize[i]) {
+            ++bits[codesize[i] > 32 ? 32 : codesize[i]];
+        }
+    }
+
+    // Limit code lengths to 16 bits
+    for (int i = 32; i > 16; --i) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) {
+                --j;
+            }
+            bits[i] -= 2;
+            ++bits[i - 1];
+            bits[j + 1] += 2;
+            --bits[j];
+        }
+    }
+
+    // Drop the reserved code point, which has the longest code
+    int longest = 16;
+    while (bits[longest] == 0) {
+        --longest;
+    }
+    --bits[longest];
+
+    spec->bits[0] = 0;
+    for (int i = 1; i <= 16; ++i) {
+        spec->bits[i] = (unsigned char)bits[i];
+    }
+
+    int k = 0;
+    memset(spec->values, 0, sizeof(spec->values));
+    for (int len = 1; len <= 32; ++len) {
+        for (int symbol = 0; symbol < 256; ++symbol) {
+            if (codesize[symbol] == len) {
+                spec->values[k++] = (unsigned char)symbol;
+            }
+        }
+    }
+}
+
+// One-dimensional AAN forward DCT over eight vectors, i.e. four
+// independent 8-point transforms at once.
+static inline void jpeg_dct_1d(vec4f *d) {
+    const vec4f c4 = vec4f_set1(0.707106781f);
+    const vec4f c6 = vec4f_set1(0.382683433f);
+    const vec4f c2_minus_c6 = vec4f_set1(0.541196100f);
+    const vec4f c2_plus_c6 = vec4f_set1(1.306562965f);
+
+    vec4f tmp0 = vec4f_add(d[0], d[7]);
+    vec4f tmp7 = vec4f_sub(d[0], d[7]);
+    vec4f tmp1 = vec4f_add(d[1], d[6]);
+    vec4f tmp6 = vec4f_sub(d[1], d[6]);
+    vec4f tmp2 = vec4f_add(d[2], d[5]);
+    vec4f tmp5 = vec4f_sub(d[2], d[5]);
+    vec4f tmp3 = vec4f_add(d[3], d[4]);
+    vec4f tmp4 = vec4f_sub(d[3], d[4]);
+
+    // Even part
+    vec4f tmp10 = vec4f_add(tmp0, tmp3);
+    vec4f tmp13 = vec4f_sub(tmp0, tmp3);
+    vec4f tmp11 = vec4f_add(tmp1, tmp2);
+    vec4f tmp12 = vec4f_sub(tmp1, tmp2);
+
+    d[0] = vec4f_add(tmp10, tmp11);
+    d[4] = vec4f_sub(tmp10, tmp11);
+
+    vec4f z1 = vec4f_mul(vec4f_add(tmp12, tmp13), c4);
+    d[2] = vec4f_add(tmp13, z1);
+    d[6] = vec4f_sub(tmp13, z1);
+
+    // Odd part
+    tmp10 = vec4f_add(tmp4, tmp5);
+    tmp11 = vec4f_add(tmp5, tmp6);
+    tmp12 = vec4f_add(tmp6, tmp7);
+
+    vec4f z5 = vec4f_mul(vec4f_sub(tmp10, tmp12), c6);
+    vec4f z2 = vec4f_add(vec4f_mul(tmp10, c2_minus_c6), z5);
+    vec4f z4 = vec4f_add(vec4f_mul(tmp12, c2_plus_c6), z5);
+    vec4f z3 = vec4f_mul(tmp11, c4);
+
+    vec4f z11 = vec4f_add(tmp7, z3);
+    vec4f z13 = vec4f_sub(tmp7, z3);
+
+    d[5] = vec4f_add(z13, z2);
+    d[3] = vec4f_sub(z13, z2);
+    d[1] = vec4f_add(z11, z4);
+    d[7] = vec4f_sub(z11, z4);
+}
+
+// Two-dimensional forward DCT of the 8x8 block at `in` (rows `stride`
+// floats apart). Each half of the block is transposed so that the 1D
+// transform runs across vector lanes; the result is written to `out` in
+// natural row-major order.
+static void jpeg_fdct(const float *in, int stride, float out[64]) {
+    vec4f lo[8], hi[8], top[8], bottom[8];
+
+    for (int r = 0; r < 8; ++r) {
+        lo[r] = vec4f_load(in + r * stride);
+        hi[r] = vec4f_load(in + r * stride + 4);
+    }
+
+    // Rows: top[k] / bottom[k] hold column k of rows 0-3 / 4-7.
+    top[0] = lo[0]; top[1] = lo[1]; top[2] = lo[2]; top[3] = lo[3];
+    top[4] = hi[0]; top[5] = hi[1]; top[6] = hi[2]; top[7] = hi[3];
+    bottom[0] = lo[4]; bottom[1] = lo[5]; bottom[2] = lo[6]; bottom[3] = lo[7];
+    bottom[4] = hi[4]; bottom[5] = hi[5]; bottom[6] = hi[6]; bottom[7] = hi[7];
+    vec4f_transpose(&top[0], &top[1], &top[2], &top[3]);
+    vec4f_transpose(&top[4], &top[5], &top[6], &top[7]);
+    vec4f_transpose(&bottom[0], &bottom[1], &bottom[2], &bottom[3]);
+    vec4f_transpose(&bottom[4], &bottom[5], &bottom[6], &bottom[7]);
+    jpeg_dct_1d(top);
+    jpeg_dct_1d(bottom);
+
+    // Columns: transpose back so that lo[r] / hi[r] hold row r again.
+    lo[0] = top[0]; lo[1] = top[1]; lo[2] = top[2]; lo[3] = top[3];
+    hi[0] = top[4]; hi[1] = top[5]; hi[2] = top[6]; hi[3] = top[7];
+    lo[4] = bottom[0]; lo[5] = bottom[1]; lo[6] = bottom[2]; lo[7] = bottom[3];
+    hi[4] = bottom[4]; hi[5] = bottom[5]; hi[6] = bottom[6]; hi[7] = bottom[7];
+    vec4f_transpose(&lo[0], &lo[1], &lo[2], &lo[3]);
+    vec4f_transpose(&hi[0], &hi[1], &hi[2], &hi[3]);
+    vec4f_transpose(&lo[4], &lo[5], &lo[6], &lo[7]);
+    vec4f_transpose(&hi[4], &hi[5], &hi[6], &hi[7]);
+    jpeg_dct_1d(lo);
+    jpeg_dct_1d(hi);
+
+    for (int r = 0; r < 8; ++r) {
+        vec4f_store(out + r * 8, lo[r]);
+        vec4f_store(out + r * 8 + 4, hi[r]);
+    }
+}
+
+static inline void jpeg_calc_bits(int val, unsigned short bits[2]) {
+    int tmp1 = val < 0 ? -val : val;
+    val = val < 0 ? val - 1 : val;
+    bits[1] = 1;
+    while (tmp1 >>= 1) {
+        ++bits[1];
+    }
+    bits[0] = val & ((1 << bits[1]) - 1);
+}
+
+static void jpeg_quantize_du(const float *cdu, int du_stride, const float *fdtbl, int du[64]) {
+    float coefficients[64];
+    int quantized[64];
+
+    jpeg_fdct(cdu, du_stride, coefficients);
+
+    for (int j = 0; j < 64; j += 4) {
+        vec4f v = vec4f_mul(vec4f_load(coefficients + j), vec4f_load(fdtbl + j));
+        vec4f_store_rounded(quantized + j, v);
+    }
+    for (int j = 0; j < 64; ++j) {
+        du[jpeg_zigzag[j]] = quantized[j];
+    }
+}
+
+static inline int jpeg_bit_length(int val) {
+    int length = 0;
+    val = val < 0 ? -val : val;
+    while (val) {
+        ++length;
+        val >>= 1;
+    }
+    return length;
+}
+
+// Counts the Huffman symbols that jpeg_write_du would emit.
+static void jpeg_count_du(const int du[64], int dc, uint32_t dc_freq[256], uint32_t ac_freq[256]) {
+    ++dc_freq[jpeg_bit_length(du[0] - dc)];
+
+    int end0pos = 63;
+    while (end0pos > 0 && du[end0pos] == 0) {
+        --end0pos;
+    }
+    for (int i = 1; i <= end0pos; ++i) {
+        int startpos = i;
+        while (du[i] == 0 && i <= end0pos) {
+            ++i;
+        }
+        int nrzeroes = i - startpos;
+        ac_freq[0xF0] += nrzeroes >> 4;
+        ac_freq[((nrzeroes & 15) << 4) + jpeg_bit_length(du[i])]++;
+    }
+    if (end0pos != 63) {
+        ++ac_freq[0x00];
+    }
+}
+
+static void jpeg_write_du(JpegBitWriter *bw, const int du[64], int dc, const unsigned short htdc[256][2], const unsigned short htac[256][2]) {
+    const unsigned short eob[2] = {htac[0x00][0], htac[0x00][1]};
+    const unsigned short m16zeroes[2] = {htac[0xF0][0], htac[0xF0][1]};
+
+    if (!jpeg_buffer_reserve(bw->out, JPEG_MAX_BLOCK_BYTES)) {
+        return;
+    }
+
+    // Encode DC
+    int diff = du[0] - dc;
+    if (diff == 0) {
+        jpeg_write_bits(bw, htdc[0]);
+    } else {
+        unsigned short bits[2];
+        jpeg_calc_bits(diff, bits);
+        jpeg_write_bits(bw, htdc[bits[1]]);
+        jpeg_write_bits(bw, bits);
+    }
+
+    // Encode ACs
+    int end0pos = 63;
+    while (end0pos > 0 && du[end0pos] == 0) {
+        --end0pos;
+    }
+    if (end0pos == 0) {
+        jpeg_write_bits(bw, eob);
+        return;
+    }
+    for (int i = 1; i <= end0pos; ++i) {
+        int startpos = i;
+        unsigned short bits[2];
+        while (du[i] == 0 && i <= end0pos) {
+            ++i;
+        }
+        int nrzeroes = i - startpos;
+        if (nrzeroes >= 16) {
+            int lng = nrzeroes >> 4;
+            for (int nrmarker = 1; nrmarker <= lng; ++nrmarker) {
+                jpeg_write_bits(bw, m16zeroes);
+            }
+            nrzeroes &= 15;
+        }
+        jpeg_calc_bits(du[i], bits);
+        jpeg_write_bits(bw, htac[(nrzeroes << 4) + bits[1]]);
+        jpeg_write_bits(bw, bits);
+    }
+    if (end0pos != 63) {
+        jpeg_write_bits(bw, eob);
+    }
+}
+
+// Transforms and quantizes one 8x8 data unit, then either entropy codes it
+// into `bw` or, when `stats` is given, only counts its symbols. Returns
+// the DC value for the next prediction.
+static int jpeg_process_du(const JpegEncoder *enc, JpegBitWriter *bw, JpegStatistics *stats, const float *cdu, int du_stride, bool chroma, int dc) {
+    int dc_table = chroma ? JPEG_HT_UV_DC : JPEG_HT_Y_DC;
+    int ac_table = chroma ? JPEG_HT_UV_AC : JPEG_HT_Y_AC;
+    int du[64];
+
+    jpeg_quantize_du(cdu, du_stride, chroma ? enc->fdtbl_uv : enc->fdtbl_y, du);
+
+    if (stats != NULL) {
+        jpeg_count_du(du, dc, stats->freq[dc_table], stats->freq[ac_table]);
+    } else {
+        jpeg_write_du(bw, du, dc, enc->ht[dc_table], enc->ht[ac_table]);
+    }
+
+    return du[0];
+}
+
+// Converts a `size` x `size` block (8 or 16) at (x, y) to level-shifted
+// YCbCr. Pixels outside the image repeat the last row/column.
+static void jpeg_load_block(const JpegEncoder *enc, int x, int y, int size, float *Y, float *U, float *V) {
+    const vec4f ry = vec4f_set1(0.29900f), gy = vec4f_set1(0.58700f), by = vec4f_set1(0.11400f);
+    const vec4f ru = vec4f_set1(-0.16874f), gu = vec4f_set1(0.33126f), bu = vec4f_set1(0.50000f);
+    const vec4f rv = vec4f_set1(0.50000f), gv = vec4f_set1(0.41869f), bv = vec4f_set1(0.08131f);
+    const vec4f level = vec4f_set1(128.0f);
+    // comp == 2 is grey+alpha (alpha is ignored)
+    int comp = enc->comp;
+    int ofs_g = comp > 2 ? 1 : 0, ofs_b = comp > 2 ? 2 : 0;
+    float r[16], g[16], b[16];
+
+    for (int row = 0; row < size; ++row) {
+        int clamped_row = (y + row < enc->height) ? y + row : enc->height - 1;
+        const unsigned char *line = enc->data + (size_t)clamped_row * enc->width * comp;
+
+        if (x + size <= enc->width) {
+            const unsigned char *p = line + (size_t)x * comp;
+            for (int col = 0; col < size; ++col, p += comp) {
+                r[col] = p[0];
+                g[col] = p[ofs_g];
+                b[col] = p[ofs_b];
+            }
+        } else {
+            for (int col = 0; col < size; ++col) {
+                const unsigned char *p = line + (size_t)((x + col < enc->width) ? x + col : enc->width - 1) * comp;
+                r[col] = p[0];
+                g[col] = p[ofs_g];
+                b[col] = p[ofs_b];
+            }
+        }
+
+        for (int col = 0; col < size; col += 4) {
+            vec4f vr = vec4f_load(r + col), vg = vec4f_load(g + col), vb = vec4f_load(b + col);
+            int pos = row * size + col;
+            vec4f_store(Y + pos, vec4f_sub(vec4f_add(vec4f_add(vec4f_mul(ry, vr), vec4f_mul(gy, vg)), vec4f_mul(by, vb)), level));
+            vec4f_store(U + pos, vec4f_add(vec4f_sub(vec4f_mul(ru, vr), vec4f_mul(gu, vg)), vec4f_mul(bu, vb)));
+            vec4f_store(V + pos, vec4f_sub(vec4f_sub(vec4f_mul(rv, vr), vec4f_mul(gv, vg)), vec4f_mul(bv, vb)));
+        }
+    }
+}
+
+// Averages each 2x2 group of a 16x16 chroma block into an 8x8 block.
+static void jpeg_subsample_block(const float *in, float *out) {
+    const vec4f quarter = vec4f_set1(0.25f);
+
+    for (int yy = 0; yy < 8; ++yy) {
+        const float *r0 = in + yy * 32;
+        const float *r1 = r0 + 16;
+        for (int xx = 0; xx < 16; xx += 8) {
+            vec4f a = vec4f_add(vec4f_load(r0 + xx), vec4f_load(r1 + xx));
+            vec4f b = vec4f_add(vec4f_load(r0 + xx + 4), vec4f_load(r1 + xx + 4));
+            vec4f_store(out + yy * 8 + xx / 2, vec4f_mul(vec4f_pairwise_add(a, b), quarter));
+        }
+    }
+}
+
+static void jpeg_encoder_init(JpegEncoder *enc, int width, int height, int comp, const unsigned char *data, const JpegOptions *options) {
+    int quality = options->quality ? options->quality : 90;
+
+    enc->width = width;
+    enc->height = height;
+    enc->comp = comp;
+    enc->data = data;
+
+    switch (options->subsampling) {
+        case JPEG_SUBSAMPLING_444: enc->subsample = false; break;
+        case JPEG_SUBSAMPLING_420: enc->subsample = true; break;
+        default: enc->subsample = quality <= 90; break;
+    }
+
+    enc->mcu_size = enc->subsample ? 16 : 8;
+    enc->mcu_rows = (height + enc->mcu_size - 1) / enc->mcu_size;
+
+    // Without explicit restart markers, multiple threads still need
+    // segments to work on, so aim for a few of them per thread.
+    enc->restart_rows = options->restart_rows;
+    if (enc->restart_rows <= 0 && options->threads > 1) {
+        int segments = options->threads * 4;
+        enc->restart_rows = (enc->mcu_rows + segments - 1) / segments;
+    }
+    if (enc->restart_rows > 0) {
+        // The DRI marker stores the interval in MCUs as a 16-bit value
+        int mcus_per_row = (width + enc->mcu_size - 1) / enc->mcu_size;
+        int max_rows = 0xFFFF / mcus_per_row;
+        if (enc->restart_rows > max_rows) {
+            enc->restart_rows = max_rows;
+        }
+        if (enc->restart_rows >= enc->mcu_rows) {
+            enc->restart_rows = 0;
+        }
+    }
+
+    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+    for (int i = 0; i < 64; ++i) {
+        int yti = (jpeg_std_y_qt[i] * quality + 50) / 100;
+        int uvti = (jpeg_std_uv_qt[i] * quality + 50) / 100;
+        enc->y_table[jpeg_zigzag[i]] = (unsigned char)(yti < 1 ? 1 : yti > 255 ? 255 : yti);
+        enc->uv_table[jpeg_zigzag[i]] = (unsigned char)(uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
+    }
+
+    for (int row = 0, k = 0; row < 8; ++row) {
+        for (int col = 0; col < 8; ++col, ++k) {
+            enc->fdtbl_y[k] = 1 / (enc->y_table[jpeg_zigzag[k]] * jpeg_aasf[row] * jpeg_aasf[col]);
+            enc->fdtbl_uv[k] = 1 / (enc->uv_table[jpeg_zigzag[k]] * jpeg_aasf[row] * jpeg_aasf[col]);
+        }
+    }
+
+    jpeg_set_huffman_spec(&enc->huffman[JPEG_HT_Y_DC], jpeg_std_dc_luminance_nrcodes, jpeg_std_dc_luminance_values, sizeof(jpeg_std_dc_luminance_values));
+    jpeg_set_huffman_spec(&enc->huffman[JPEG_HT_Y_AC], jpeg_std_ac_luminance_nrcodes, jpeg_std_ac_luminance_values, sizeof(jpeg_std_ac_luminance_values));
+    jpeg_set_huffman_spec(&enc->huffman[JPEG_HT_UV_DC], jpeg_std_dc_chrominance_nrcodes, jpeg_std_dc_chrominance_values, sizeof(jpeg_std_dc_chrominance_values));
+    jpeg_set_huffman_spec(&enc->huffman[JPEG_HT_UV_AC], jpeg_std_ac_chrominance_nrcodes, jpeg_std_ac_chrominance_values, sizeof(jpeg_std_ac_chrominance_values));
+    for (int i = 0; i < 4; ++i) {
+        jpeg_build_huffman_table(&enc->huffman[i], enc->ht[i]);
+    }
+}
+
+static void jpeg_write_headers(const JpegEncoder *enc, JpegBuffer *out) {
+    static const unsigned char head0[] = {0xFF, 0xD8, 0xFF, 0xE0, 0, 0x10, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0, 0xFF, 0xDB, 0, 0x84, 0};
+    static const unsigned char head2[] = {0xFF, 0xDA, 0, 0xC, 3, 1, 0, 2, 0x11, 3, 0x11, 0, 0x3F, 0};
+    // Table class and destination of each Huffman table
+    static const unsigned char table_ids[4] = {0x00, 0x10, 0x01, 0x11};
+    const unsigned char head1[] = {0xFF, 0xC0, 0, 0x11, 8, (unsigned char)(enc->height >> 8), (unsigned char)(enc->height & 0xFF),
+                                   (unsigned char)(enc->width >> 8), (unsigned char)(enc->width & 0xFF),
+                                   3, 1, (unsigned char)(enc->subsample ? 0x22 : 0x11), 0, 2, 0x11, 1, 3, 0x11, 1};
+
+    jpeg_buffer_write(out, head0, sizeof(head0));
+    jpeg_buffer_write(out, enc->y_table, sizeof(enc->y_table));
+    jpeg_buffer_putc(out, 1);
+    jpeg_buffer_write(out, enc->uv_table, sizeof(enc->uv_table));
+    jpeg_buffer_write(out, head1, sizeof(head1));
+
+    int dht_length = 2;
+    for (int i = 0; i < 4; ++i) {
+        dht_length += 17 + jpeg_huffman_spec_size(&enc->huffman[i]);
+    }
+    const unsigned char dht[] = {0xFF, 0xC4, (unsigned char)(dht_length >> 8), (unsigned char)(dht_length & 0xFF)};
+    jpeg_buffer_write(out, dht, sizeof(dht));
+    for (int i = 0; i < 4; ++i) {
+        jpeg_buffer_putc(out, table_ids[i]);
+        jpeg_buffer_write(out, enc->huffman[i].bits + 1, 16);
+        jpeg_buffer_write(out, enc->huffman[i].values, jpeg_huffman_spec_size(&enc->huffman[i]));
+    }
+
+    if (enc->restart_rows > 0) {
+        int interval = enc->restart_rows * ((enc->width + enc->mcu_size - 1) / enc->mcu_size);
+        const unsigned char dri[] = {0xFF, 0xDD, 0, 4, (unsigned char)(interval >> 8), (unsigned char)(interval & 0xFF)};
+        jpeg_buffer_write(out, dri, sizeof(dri));
+    }
+
+    jpeg_buffer_write(out, head2, sizeof(head2));
+}
+
+// Encodes one row of MCUs (8 or 16 pixel rows, depending on subsampling),
+// or only counts its symbols when `stats` is given.
+static void jpeg_encode_mcu_row(const JpegEncoder *enc, JpegBitWriter *bw, JpegStatistics *stats, int y, int dc[3]) {
+    if (enc->subsample) {
+        for (int x = 0; x < enc->width; x += 16) {
+            float Y[256], U[256], V[256], sub_u[64], sub_v[64];
+            jpeg_load_block(enc, x, y, 16, Y, U, V);
+            dc[0] = jpeg_process_du(enc, bw, stats, Y + 0, 16, false, dc[0]);
+            dc[0] = jpeg_process_du(enc, bw, stats, Y + 8, 16, false, dc[0]);
+            dc[0] = jpeg_process_du(enc, bw, stats, Y + 128, 16, false, dc[0]);
+            dc[0] = jpeg_process_du(enc, bw, stats, Y + 136, 16, false, dc[0]);
+            jpeg_subsample_block(U, sub_u);
+            jpeg_subsample_block(V, sub_v);
+            dc[1] = jpeg_process_du(enc, bw, stats, sub_u, 8, true, dc[1]);
+            dc[2] = jpeg_process_du(enc, bw, stats, sub_v, 8, true, dc[2]);
+        }
+    } else {
+        for (int x = 0; x < enc->width; x += 8) {
+            float Y[64], U[64], V[64];
+            jpeg_load_block(enc, x, y, 8, Y, U, V);
+            dc[0] = jpeg_process_du(enc, bw, stats, Y, 8, false, dc[0]);
+            dc[1] = jpeg_process_du(enc, bw, stats, U, 8, true, dc[1]);
+            dc[2] = jpeg_process_du(enc, bw, stats, V, 8, true, dc[2]);
+        }
+    }
+}
+
+// Entropy codes MCU rows [first_row, last_row), carrying the DC
+// predictors in `dc` and the bits of the last unfinished byte in `bw`.
+static void jpeg_encode_rows(const JpegEncoder *enc, JpegBitWriter *bw, int first_row, int last_row, int dc[3]) {
+    for (int row = first_row; row < last_row && !bw->out->out_of_memory; ++row) {
+        jpeg_encode_mcu_row(enc, bw, NULL, row * enc->mcu_size, dc);
+    }
+}
+
+// Pads the last byte with ones
+static void jpeg_flush_bits(JpegBitWriter *bw) {
+    static const unsigned short fill_bits[] = {0x7F, 7};
+
+    if (jpeg_buffer_reserve(bw->out, 2)) {
+        jpeg_write_bits(bw, fill_bits);
+    }
+}
+
+// Entropy codes MCU rows [first_row, last_row) with fresh DC predictors
+// and pads the result to a byte boundary.
+static void jpeg_encode_segment(const JpegEncoder *enc, JpegBuffer *out, int first_row, int last_row) {
+    int dc[3] = {0, 0, 0};
+    JpegBitWriter bw = {.out = out, .bit_buf = 0, .bit_cnt = 0};
+
+    jpeg_encode_rows(enc, &bw, first_row, last_row, dc);
+    jpeg_flush_bits(&bw);
+}
+
+static void jpeg_count_rows(const JpegEncoder *enc, JpegStatistics *stats, int first_row, int last_row, int dc[3]) {
+    for (int row = first_row; row < last_row; ++row) {
+        jpeg_encode_mcu_row(enc, NULL, stats, row * enc->mcu_size, dc);
+    }
+}
+
+static int jpeg_segment_count(const JpegEncoder *enc) {
+    return enc->restart_rows > 0 ? (enc->mcu_rows + enc->restart_rows - 1) / enc->restart_rows : 1;
+}
+
+typedef struct {
+    const JpegEncoder *enc;
+    // Index of the first segment of the job
+    int first;
+    JpegBuffer *segments;
+    JpegStatistics *stats;
+} JpegSegmentJob;
+
+static void jpeg_segment_task(void *context, int index) {
+    JpegSegmentJob *job = (JpegSegmentJob *)context;
+    const JpegEncoder *enc = job->enc;
+    int rows = enc->restart_rows > 0 ? enc->restart_rows : enc->mcu_rows;
+    int first_row = (job->first + index) * rows;
+    int last_row = first_row + rows < enc->mcu_rows ? first_row + rows : enc->mcu_rows;
+
+    if (job->stats != NULL) {
+        int dc[3] = {0, 0, 0};
+        jpeg_count_rows(enc, &job->stats[index], first_row, last_row, dc);
+    } else {
+        jpeg_encode_segment(enc, &job->segments[index], first_row, last_row);
+    }
+}
+
+// Adds the symbol counts of segments [first, first + count) to `total`.
+// Returns false when running out of memory.
+static bool jpeg_count_segments(const JpegEncoder *enc, JpegStatistics *total, int first, int count, int threads) {
+    JpegStatistics *stats = (JpegStatistics *)enif_alloc(sizeof(JpegStatistics) * count);
+
+    if (stats == NULL) {
+        return false;
+    }
+    memset(stats, 0, sizeof(JpegStatistics) * count);
+
+    JpegSegmentJob job = {.enc = enc, .first = first, .segments = NULL, .stats = stats};
+    parallel_for(count, threads, jpeg_segment_task, &job);
+
+    for (int i = 0; i < count; ++i) {
+        for (int t = 0; t < 4; ++t) {
+            for (int symbol = 0; symbol < 256; ++symbol) {
+                total->freq[t][symbol] += stats[i].freq[t][symbol];
+            }
+        }
+    }
+
+    enif_free(stats);
+    return true;
+}
+
+// Replaces the standard tables with optimal ones for the symbols counted
+// over the same segments that will be encoded (DC prediction restarts
+// with each of them).
+static void jpeg_use_optimal_tables(JpegEncoder *enc, const JpegStatistics *stats) {
+    for (int t = 0; t < 4; ++t) {
+        jpeg_build_optimal_huffman_spec(stats->freq[t], &enc->huffman[t]);
+        jpeg_build_huffman_table(&enc->huffman[t], enc->ht[t]);
+    }
+}
+
+// Encodes segments [first, first + count) in parallel and appends them to
+// `out`, each but the first of the image after its RSTn marker
+static void jpeg_encode_restart_segments(const JpegEncoder *enc, JpegBuffer *out, int first, int count, int threads) {
+    JpegBuffer *segments = (JpegBuffer *)enif_alloc(sizeof(JpegBuffer) * count);
+
+    if (segments == NULL) {
+        out->out_of_memory = true;
+        return;
+    }
+    memset(segments, 0, sizeof(JpegBuffer) * count);
+
+    JpegSegmentJob job = {.enc = enc, .first = first, .segments = segments, .stats = NULL};
+    parallel_for(count, threads, jpeg_segment_task, &job);
+
+    for (int i = 0; i < count; ++i) {
+        int segment = first + i;
+        if (segments[i].out_of_memory) {
+            out->out_of_memory = true;
+        }
+        if (segment > 0) {
+            jpeg_buffer_putc(out, 0xFF);
+            jpeg_buffer_putc(out, (unsigned char)(0xD0 + ((segment - 1) & 7)));
+        }
+        jpeg_buffer_write(out, segments[i].data, segments[i].size);
+        jpeg_buffer_free(&segments[i]);
+    }
+    enif_free(segments);
+}
+
+// An encode run a few MCU rows at a time, so that large images don't hold
+// a scheduler until they are done. With optimize_huffman, the statistics
+// pass over all rows runs first. The output is the same however many rows
+// each step runs.
+typedef struct {
+    JpegEncoder enc;
+    JpegStatistics stats;
+    int threads;
+    bool counting;
+    bool headers_written;
+    bool done;
+    // Next MCU row of the current pass
+    int next_row;
+    // State of the entropy coder between steps without restart markers
+    int dc[3];
+    int bit_buf;
+    int bit_cnt;
+} JpegStream;
+
+// Returns false on invalid arguments
+static bool jpeg_stream_init(JpegStream *stream, int width, int height, int comp, const unsigned char *data, const JpegOptions *options) {
+    if (!data || width <= 0 || height <= 0 || width > 0xFFFF || height > 0xFFFF || comp > 4 || comp < 1) {
+        return false;
+    }
+
+    memset(stream, 0, sizeof(JpegStream));
+    jpeg_encoder_init(&stream->enc, width, height, comp, data, options);
+    stream->threads = options->threads;
+    stream->counting = options->optimize_huffman;
+    return true;
+}
+
+// Runs the current pass over about `rows` more MCU rows, rounded up to
+// whole restart segments and to one segment per thread, writing to `out`.
+// Returns false when running out of memory.
+static bool jpeg_stream_step(JpegStream *stream, JpegBuffer *out, int rows) {
+    JpegEncoder *enc = &stream->enc;
+    int first_row = stream->next_row;
+    int last_row = rows < enc->mcu_rows - first_row ? first_row + (rows < 1 ? 1 : rows) : enc->mcu_rows;
+    int first_segment = 0, segments = 0;
+
+    if (enc->restart_rows > 0) {
+        first_segment = first_row / enc->restart_rows;
+        segments = (last_row - first_row + enc->restart_rows - 1) / enc->restart_rows;
+        segments = segments < stream->threads ? stream->threads : segments;
+        if (segments > jpeg_segment_count(enc) - first_segment) {
+            segments = jpeg_segment_count(enc) - first_segment;
+        }
+        int end = (first_segment + segments) * enc->restart_rows;
+        last_row = end < enc->mcu_rows ? end : enc->mcu_rows;
+    }
+
+    if (stream->counting) {
+        if (enc->restart_rows > 0) {
+            if (!jpeg_count_segments(enc, &stream->stats, first_segment, segments, stream->threads)) {
+                out->out_of_memory = true;
+                return false;
+            }
+        } else {
+            jpeg_count_rows(enc, &stream->stats, first_row, last_row, stream->dc);
+        }
+
+        stream->next_row = last_row;
+        if (last_row == enc->mcu_rows) {
+            jpeg_use_optimal_tables(enc, &stream->stats);
+            stream->counting = false;
+            stream->next_row = 0;
+            memset(stream->dc, 0, sizeof(stream->dc));
+        }
+        return true;
+    }
+
+    if (!stream->headers_written) {
+        jpeg_write_headers(enc, out);
+        stream->headers_written = true;
+    }
+
+    if (enc->restart_rows > 0) {
+        jpeg_encode_restart_segments(enc, out, first_segment, segments, stream->threads);
+    } else {
+        JpegBitWriter bw = {.out = out, .bit_buf = stream->bit_buf, .bit_cnt = stream->bit_cnt};
+        jpeg_encode_rows(enc, &bw, first_row, last_row, stream->dc);
+        if (last_row == enc->mcu_rows) {
+            jpeg_flush_bits(&bw);
+        }
+        stream->bit_buf = bw.bit_buf;
+        stream->bit_cnt = bw.bit_cnt;
+    }
+
+    stream->next_row = last_row;
+    if (last_row == enc->mcu_rows) {
+        // EOI
+        jpeg_buffer_putc(out, 0xFF);
+        jpeg_buffer_putc(out, 0xD9);
+        stream->done = true;
+    }
+    return !out->out_of_memory;
+}
+
+// Encodes `data` (HWC, 1 to 4 channels of u8) into `out`. Returns false on
+// invalid arguments or when running out of memory.
+static bool jpeg_encode(JpegBuffer *out, int width, int height, int comp, const unsigned char *data, const JpegOptions *options) {
+    JpegStream stream;
+
+    if (!jpeg_stream_init(&stream, width, height, comp, data, options)) {
+        return false;
+    }
+    while (!stream.done) {
+        if (!jpeg_stream_step(&stream, out, INT_MAX)) {
+            return false;
+        }
+    }
+    return true;
+}
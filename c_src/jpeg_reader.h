@@ -0,0 +1,384 @@
+#pragma once
+
+// JPEG decoder handing out one row at a time.
+//
+// stbi_load decodes every component of a JPEG into a plane as large as
+// the image before upsampling and converting the colors a row at a time.
+// For baseline JPEGs with a single scan, which is how cameras and scanners
+// write them, this decoder keeps two MCU rows of each component instead:
+// it decodes the next MCU row once the upsampling reaches it and converts
+// the colors of each row as it is read. Memory use is bounded by the MCU
+// rows, regardless of the image height.
+//
+// The entropy decoding, the IDCT, the upsampling and the color conversion
+// are stb_image's, so rows come out the way stbi_load returns them.
+// Progressive JPEGs and the rare baseline ones with a scan per component
+// need the whole image and are left to stbi_load.
+//
+// Must be included after the stb_image.h implementation.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "memory.h"
+
+typedef struct {
+    stbi__jpeg *z;
+    // Channels of the rows, and components upsampled for them
+    int channels;
+    int decode_n;
+    bool is_rgb;
+    bool failed;
+    // The entropy-coded data ended early: stbi_load keeps what it decoded
+    bool stopped;
+
+    // MCU rows, or rows of blocks when the scan has a single component
+    int units;
+    int units_decoded;
+    // Component rows in a unit, and two units of them in a ring
+    int unit_rows[4];
+    stbi_uc *raw_rings[4];
+    stbi_uc *rings[4];
+
+    // Upsampling state of stbi__resample, with component rows in place of
+    // the line pointers
+    resample_row_func resample[4];
+    int hs[4], vs[4];
+    int w_lores[4];
+    int ystep[4];
+    int ypos[4];
+    int line0[4], line1[4];
+} JpegReader;
+
+static void jpeg_reader_close(JpegReader *reader) {
+    if (reader->z != NULL) {
+        for (int k = 0; k < 4; ++k) {
+            STBI_FREE(reader->raw_rings[k]);
+            STBI_FREE(reader->z->img_comp[k].linebuf);
+        }
+        STBI_FREE(reader->z);
+    }
+    memset(reader, 0, sizeof(*reader));
+}
+
+// The part of stbi__process_frame_header that comes after the component
+// table, without the planes
+static bool jpeg_reader_layout(stbi__jpeg *z) {
+    stbi__context *s = z->s;
+    int h_max = 1, v_max = 1;
+
+    if (!stbi__mad3sizes_valid(s->img_x, s->img_y, s->img_n, 0)) {
+        return false;
+    }
+    for (int i = 0; i < s->img_n; ++i) {
+        h_max = z->img_comp[i].h > h_max ? z->img_comp[i].h : h_max;
+        v_max = z->img_comp[i].v > v_max ? z->img_comp[i].v : v_max;
+    }
+    for (int i = 0; i < s->img_n; ++i) {
+        if (h_max % z->img_comp[i].h != 0 || v_max % z->img_comp[i].v != 0) {
+            return false;
+        }
+    }
+
+    z->img_h_max = h_max;
+    z->img_v_max = v_max;
+    z->img_mcu_w = h_max * 8;
+    z->img_mcu_h = v_max * 8;
+    z->img_mcu_x = (s->img_x + z->img_mcu_w - 1) / z->img_mcu_w;
+    z->img_mcu_y = (s->img_y + z->img_mcu_h - 1) / z->img_mcu_h;
+    for (int i = 0; i < s->img_n; ++i) {
+        z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max - 1) / h_max;
+        z->img_comp[i].y = (s->img_y * z->img_comp[i].v + v_max - 1) / v_max;
+        z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
+        z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+    }
+    return true;
+}
+
+// Reads the JPEG in `s` up to its first scan and gets ready to decode its
+// rows into `req_comp` channels, or as many as stbi_load would. Returns
+// false, with nothing to close, for images that can't be decoded this way.
+static bool jpeg_reader_open(JpegReader *reader, stbi__context *s, int req_comp) {
+    memset(reader, 0, sizeof(*reader));
+    if (req_comp < 0 || req_comp > 4) {
+        return false;
+    }
+
+    stbi__jpeg *z = (stbi__jpeg *)STBI_MALLOC(sizeof(stbi__jpeg));
+    if (z == NULL) {
+        return false;
+    }
+    memset(z, 0, sizeof(*z));
+    z->s = s;
+    stbi__setup_jpeg(z);
+    reader->z = z;
+
+    if (!stbi__decode_jpeg_header(z, STBI__SCAN_header) || z->progressive || !jpeg_reader_layout(z)) {
+        jpeg_reader_close(reader);
+        return false;
+    }
+
+    // Tables and restart interval up to the scan, as in stbi__decode_jpeg_image
+    int m = stbi__get_marker(z);
+    while (!stbi__SOS(m)) {
+        if (stbi__EOI(m) || stbi__DNL(m) || !stbi__process_marker(z, m)) {
+            jpeg_reader_close(reader);
+            return false;
+        }
+        m = stbi__get_marker(z);
+    }
+    if (!stbi__process_scan_header(z) || z->scan_n != s->img_n) {
+        jpeg_reader_close(reader);
+        return false;
+    }
+
+    if (z->scan_n == 1) {
+        int n = z->order[0];
+        reader->units = (z->img_comp[n].y + 7) >> 3;
+    } else {
+        reader->units = z->img_mcu_y;
+    }
+
+    for (int k = 0; k < s->img_n; ++k) {
+        reader->unit_rows[k] = z->scan_n == 1 ? 8 : z->img_comp[k].v * 8;
+        size_t size = (size_t)z->img_comp[k].w2 * reader->unit_rows[k] * 2;
+        reader->raw_rings[k] = (stbi_uc *)STBI_MALLOC(size + 15);
+        if (reader->raw_rings[k] == NULL) {
+            jpeg_reader_close(reader);
+            return false;
+        }
+        // Aligned for the IDCT, and zeroed like nothing decoded yet
+        reader->rings[k] = (stbi_uc *)(((size_t)reader->raw_rings[k] + 15) & ~(size_t)15);
+        memset(reader->rings[k], 0, size);
+    }
+
+    // Channels and components, as in load_jpeg_image
+    reader->channels = req_comp ? req_comp : s->img_n >= 3 ? 3 : 1;
+    reader->is_rgb = s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+    reader->decode_n = s->img_n == 3 && reader->channels < 3 && !reader->is_rgb ? 1 : s->img_n;
+
+    for (int k = 0; k < reader->decode_n; ++k) {
+        z->img_comp[k].linebuf = (stbi_uc *)STBI_MALLOC(s->img_x + 3);
+        if (z->img_comp[k].linebuf == NULL) {
+            jpeg_reader_close(reader);
+            return false;
+        }
+
+        int hs = z->img_h_max / z->img_comp[k].h;
+        int vs = z->img_v_max / z->img_comp[k].v;
+        reader->hs[k] = hs;
+        reader->vs[k] = vs;
+        reader->ystep[k] = vs >> 1;
+        reader->w_lores[k] = (s->img_x + hs - 1) / hs;
+        if (hs == 1 && vs == 1) {
+            reader->resample[k] = resample_row_1;
+        } else if (hs == 1 && vs == 2) {
+            reader->resample[k] = stbi__resample_row_v_2;
+        } else if (hs == 2 && vs == 1) {
+            reader->resample[k] = stbi__resample_row_h_2;
+        } else if (hs == 2 && vs == 2) {
+            reader->resample[k] = z->resample_row_hv_2_kernel;
+        } else {
+            reader->resample[k] = stbi__resample_row_generic;
+        }
+    }
+
+    stbi__jpeg_reset(z);
+    return true;
+}
+
+static stbi_uc *jpeg_reader_row(JpegReader *reader, int k, int row) {
+    int ring_rows = reader->unit_rows[k] * 2;
+    return reader->rings[k] + (size_t)(row % ring_rows) * reader->z->img_comp[k].w2;
+}
+
+// Handles the restart interval after an MCU, as stbi__parse_entropy_coded_data
+// does. Returns false once the data ends without a restart marker.
+static bool jpeg_reader_restart(stbi__jpeg *z) {
+    if (--z->todo <= 0) {
+        if (z->code_bits < 24) {
+            stbi__grow_buffer_unsafe(z);
+        }
+        if (!STBI__RESTART(z->marker)) {
+            return false;
+        }
+        stbi__jpeg_reset(z);
+    }
+    return true;
+}
+
+// Decodes the next unit into its half of the rings
+static bool jpeg_reader_decode_unit(JpegReader *reader) {
+    stbi__jpeg *z = reader->z;
+    int unit = reader->units_decoded++;
+    STBI_SIMD_ALIGN(short, data[64]);
+
+    if (reader->stopped) {
+        return true;
+    }
+
+    if (z->scan_n == 1) {
+        int n = z->order[0];
+        int ha = z->img_comp[n].ha;
+        int w = (z->img_comp[n].x + 7) >> 3;
+        stbi_uc *out = jpeg_reader_row(reader, n, unit * 8);
+        for (int i = 0; i < w; ++i) {
+            if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) {
+                return false;
+            }
+            z->idct_block_kernel(out + i * 8, z->img_comp[n].w2, data);
+            if (!jpeg_reader_restart(z)) {
+                reader->stopped = true;
+                return true;
+            }
+        }
+        return true;
+    }
+
+    for (int i = 0; i < z->img_mcu_x; ++i) {
+        for (int k = 0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            int ha = z->img_comp[n].ha;
+            stbi_uc *out = jpeg_reader_row(reader, n, unit * reader->unit_rows[n]);
+            for (int y = 0; y < z->img_comp[n].v; ++y) {
+                for (int x = 0; x < z->img_comp[n].h; ++x) {
+                    int x2 = (i * z->img_comp[n].h + x) * 8;
+                    if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) {
+                        return false;
+                    }
+                    z->idct_block_kernel(out + (size_t)z->img_comp[n].w2 * y * 8 + x2, z->img_comp[n].w2, data);
+                }
+            }
+        }
+        if (!jpeg_reader_restart(z)) {
+            reader->stopped = true;
+            return true;
+        }
+    }
+    return true;
+}
+
+// Decodes the next row into `out`, with `channels` channels. The color
+// conversion of stb_image writes the alpha of 3-channel pixels anyway, so
+// `out` needs room for one more byte.
+static bool jpeg_reader_read(JpegReader *reader, unsigned char *out) {
+    stbi__jpeg *z = reader->z;
+    int img_n = z->s->img_n, n = reader->channels;
+    unsigned int width = z->s->img_x;
+    stbi_uc *coutput[4] = {NULL, NULL, NULL, NULL};
+
+    if (reader->failed) {
+        return false;
+    }
+
+    // Every component row the upsampling reads next, the units before
+    // them still being in the rings
+    for (int k = 0; k < reader->decode_n; ++k) {
+        while (reader->line1[k] >= reader->units_decoded * reader->unit_rows[k] && reader->units_decoded < reader->units) {
+            if (!jpeg_reader_decode_unit(reader)) {
+                reader->failed = true;
+                return false;
+            }
+        }
+    }
+
+    for (int k = 0; k < reader->decode_n; ++k) {
+        int vs = reader->vs[k];
+        bool y_bot = reader->ystep[k] >= (vs >> 1);
+        stbi_uc *line0 = jpeg_reader_row(reader, k, reader->line0[k]);
+        stbi_uc *line1 = jpeg_reader_row(reader, k, reader->line1[k]);
+        coutput[k] = reader->resample[k](z->img_comp[k].linebuf, y_bot ? line1 : line0, y_bot ? line0 : line1,
+                                         reader->w_lores[k], reader->hs[k]);
+        if (++reader->ystep[k] >= vs) {
+            reader->ystep[k] = 0;
+            reader->line0[k] = reader->line1[k];
+            if (++reader->ypos[k] < z->img_comp[k].y) {
+                reader->line1[k]++;
+            }
+        }
+    }
+
+    // The color conversion of load_jpeg_image
+    if (n >= 3) {
+        stbi_uc *y = coutput[0];
+        if (img_n == 3) {
+            if (reader->is_rgb) {
+                for (unsigned int i = 0; i < width; ++i, out += n) {
+                    out[0] = y[i];
+                    out[1] = coutput[1][i];
+                    out[2] = coutput[2][i];
+                    if (n == 4) {
+                        out[3] = 255;
+                    }
+                }
+            } else {
+                z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], width, n);
+            }
+        } else if (img_n == 4) {
+            if (z->app14_color_transform == 0) {
+                // CMYK
+                for (unsigned int i = 0; i < width; ++i, out += n) {
+                    stbi_uc m = coutput[3][i];
+                    out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                    out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                    out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                    if (n == 4) {
+                        out[3] = 255;
+                    }
+                }
+            } else if (z->app14_color_transform == 2) {
+                // YCCK
+                z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], width, n);
+                for (unsigned int i = 0; i < width; ++i, out += n) {
+                    stbi_uc m = coutput[3][i];
+                    out[0] = stbi__blinn_8x8(255 - out[0], m);
+                    out[1] = stbi__blinn_8x8(255 - out[1], m);
+                    out[2] = stbi__blinn_8x8(255 - out[2], m);
+                }
+            } else {
+                z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], width, n);
+            }
+        } else {
+            for (unsigned int i = 0; i < width; ++i, out += n) {
+                out[0] = out[1] = out[2] = y[i];
+                if (n == 4) {
+                    out[3] = 255;
+                }
+            }
+        }
+    } else if (reader->is_rgb) {
+        for (unsigned int i = 0; i < width; ++i, out += n) {
+            out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            if (n == 2) {
+                out[1] = 255;
+            }
+        }
+    } else if (img_n == 4 && z->app14_color_transform == 0) {
+        for (unsigned int i = 0; i < width; ++i, out += n) {
+            stbi_uc m = coutput[3][i];
+            stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+            stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+            stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+            out[0] = stbi__compute_y(r, g, b);
+            if (n == 2) {
+                out[1] = 255;
+            }
+        }
+    } else if (img_n == 4 && z->app14_color_transform == 2) {
+        for (unsigned int i = 0; i < width; ++i, out += n) {
+            out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+            if (n == 2) {
+                out[1] = 255;
+            }
+        }
+    } else {
+        stbi_uc *y = coutput[0];
+        for (unsigned int i = 0; i < width; ++i, out += n) {
+            out[0] = y[i];
+            if (n == 2) {
+                out[1] = 255;
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,467 @@
+#pragma once
+
+// Counting allocators behind the STBI, STBIW and STBIR allocation macros.
+//
+// Every block carries a small header with its size, so frees and reallocs
+// can be accounted for without the sizes stb would otherwise need to pass
+// along. Counters are kept per kind of operation for the lifetime of the
+// library and, when a NIF runs inside a memory scope, per call as well.
+// They are updated with atomics, so allocating on many threads at once
+// doesn't serialize on a lock.
+//
+// Inside a memory scope, the blocks of the decoders are carved from an
+// arena owned by the calling thread (a scheduler or a pool worker), which
+// is emptied when the scope exits. Decoders allocate and free many
+// temporaries per image, such as JPEG component planes, zlib buffers, PNG
+// filter rows and GIF history, and the arena serves them from memory that
+// is already mapped, without going through enif_alloc. Arenas start empty
+// and follow what the previous call on their thread needed, up to
+// MEMORY_ARENA_MAX per thread and MEMORY_ARENA_BUDGET for all of them.
+// Blocks over MEMORY_ARENA_BLOCK_MAX, such as the decoded pixels of all
+// but small images, and blocks that don't fit come from enif_alloc.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "erl_nif.h"
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+typedef enum {
+    MEMORY_DECODE,
+    MEMORY_ENCODE,
+    MEMORY_RESIZE,
+    MEMORY_KIND_COUNT
+} MemoryKind;
+
+typedef enum {
+    MEMORY_ALLOC,
+    MEMORY_REALLOC,
+    MEMORY_FREE
+} MemoryOp;
+
+typedef struct {
+    int64_t current;
+    int64_t peak;
+    int64_t allocs;
+    int64_t reallocs;
+    int64_t frees;
+    // Bytes requested by reallocs, which are mostly buffers growing
+    int64_t realloc_bytes;
+    // Allocs and reallocs served by an arena
+    int64_t arena_allocs;
+} MemoryCounters;
+
+typedef struct MemoryArena {
+    // Every arena, so they can be freed when the library is unloaded
+    struct MemoryArena *next;
+    unsigned char *base;
+    size_t capacity;
+    size_t used;
+    // The most the calls since the last reset would have used
+    size_t wanted;
+} MemoryArena;
+
+// Bytes held by the stb allocations made for a NIF call, on the calling
+// thread and on the parallel_for helpers working for it. Blocks freed by
+// another call are subtracted from it as well, so `current` may go below
+// zero.
+typedef struct MemoryScope {
+    int64_t current;
+    int64_t peak;
+    // The arena of the calling thread, or NULL if it could not be created
+    MemoryArena *arena;
+    // The scope this one was entered in, if any
+    struct MemoryScope *previous;
+} MemoryScope;
+
+typedef struct {
+    size_t size;
+    // The arena the block was carved from, or NULL for enif_alloc blocks
+    MemoryArena *arena;
+} MemoryHeader;
+
+// Keeps the returned blocks as aligned as the ones from enif_alloc
+#define MEMORY_HEADER_SIZE 16
+
+#define MEMORY_ARENA_MAX (8 * 1024 * 1024)
+#define MEMORY_ARENA_BUDGET (32 * 1024 * 1024)
+#define MEMORY_ARENA_BLOCK_MAX (256 * 1024)
+
+static const char *const memory_kind_names[MEMORY_KIND_COUNT] = {"decode", "encode", "resize"};
+
+static ErlNifMutex *memory_lock = NULL;
+static ErlNifTSDKey memory_scope_key;
+static ErlNifTSDKey memory_arena_key;
+static MemoryCounters memory_counters[MEMORY_KIND_COUNT];
+static MemoryArena *memory_arenas = NULL;
+static size_t memory_arena_bytes = 0;
+
+// Relaxed atomic operations on 64-bit counters. Not every MSVC version
+// this builds with has C11 atomics, so both use compiler intrinsics.
+#if defined(_MSC_VER) && !defined(__clang__)
+static inline int64_t memory_atomic_load(int64_t *p) {
+    return _InterlockedCompareExchange64((volatile __int64 *)p, 0, 0);
+}
+
+static inline bool memory_atomic_cas(int64_t *p, int64_t expected, int64_t desired) {
+    return _InterlockedCompareExchange64((volatile __int64 *)p, desired, expected) == expected;
+}
+#else
+static inline int64_t memory_atomic_load(int64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static inline bool memory_atomic_cas(int64_t *p, int64_t expected, int64_t desired) {
+    return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+#endif
+
+// Adds `delta` to `*p` and returns the new value
+static inline int64_t memory_atomic_add(int64_t *p, int64_t delta) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int64_t seen = memory_atomic_load(p);
+    while (!memory_atomic_cas(p, seen, seen + delta)) {
+        seen = memory_atomic_load(p);
+    }
+    return seen + delta;
+#else
+    return __atomic_add_fetch(p, delta, __ATOMIC_RELAXED);
+#endif
+}
+
+// Raises `*p` to `value` if it is lower
+static inline void memory_atomic_max(int64_t *p, int64_t value) {
+    int64_t seen = memory_atomic_load(p);
+    while (value > seen && !memory_atomic_cas(p, seen, value)) {
+        seen = memory_atomic_load(p);
+    }
+}
+
+static bool memory_init(void) {
+    memory_lock = enif_mutex_create("stb_image_memory");
+    if (memory_lock == NULL) {
+        return false;
+    }
+    if (enif_tsd_key_create("stb_image_memory_scope", &memory_scope_key) != 0) {
+        enif_mutex_destroy(memory_lock);
+        memory_lock = NULL;
+        return false;
+    }
+    if (enif_tsd_key_create("stb_image_memory_arena", &memory_arena_key) != 0) {
+        enif_tsd_key_destroy(memory_scope_key);
+        enif_mutex_destroy(memory_lock);
+        memory_lock = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Returns the arena of the calling thread, creating it on first use
+static MemoryArena *memory_arena_get(void) {
+    MemoryArena *arena = (MemoryArena *)enif_tsd_get(memory_arena_key);
+    if (arena != NULL) {
+        return arena;
+    }
+
+    arena = (MemoryArena *)enif_alloc(sizeof(MemoryArena));
+    if (arena == NULL) {
+        return NULL;
+    }
+    memset(arena, 0, sizeof(MemoryArena));
+    enif_mutex_lock(memory_lock);
+    arena->next = memory_arenas;
+    memory_arenas = arena;
+    enif_mutex_unlock(memory_lock);
+    enif_tsd_set(memory_arena_key, arena);
+    return arena;
+}
+
+// Empties the arena, first resizing it to what the last call wanted. It
+// grows as far as the budget allows, and shrinks once a call that used it
+// wanted less than a quarter of it.
+static void memory_arena_reset(MemoryArena *arena) {
+    size_t wanted = arena->wanted < MEMORY_ARENA_MAX ? arena->wanted : MEMORY_ARENA_MAX;
+    size_t capacity = arena->capacity;
+
+    if (wanted > capacity || (wanted > 0 && wanted < capacity / 4)) {
+        enif_mutex_lock(memory_lock);
+        size_t available = MEMORY_ARENA_BUDGET - (memory_arena_bytes - arena->capacity);
+        capacity = wanted < available ? wanted : available;
+        if (capacity > arena->capacity || capacity < arena->capacity / 4) {
+            unsigned char *base = (unsigned char *)enif_alloc(capacity);
+            if (base != NULL) {
+                enif_free(arena->base);
+                memory_arena_bytes = memory_arena_bytes - arena->capacity + capacity;
+                arena->base = base;
+                arena->capacity = capacity;
+            }
+        }
+        enif_mutex_unlock(memory_lock);
+    }
+    arena->used = 0;
+    arena->wanted = 0;
+}
+
+// Frees every arena, once no NIF can run anymore
+static void memory_free_arenas(void) {
+    if (memory_lock == NULL) {
+        return;
+    }
+    while (memory_arenas != NULL) {
+        MemoryArena *next = memory_arenas->next;
+        enif_free(memory_arenas->base);
+        enif_free(memory_arenas);
+        memory_arenas = next;
+    }
+    memory_arena_bytes = 0;
+}
+
+// Makes a scope entered by an earlier call current again, for work that
+// spans several NIF calls
+static void memory_scope_resume(MemoryScope *scope) {
+    scope->arena = memory_arena_get();
+    scope->previous = (MemoryScope *)enif_tsd_get(memory_scope_key);
+    enif_tsd_set(memory_scope_key, scope);
+}
+
+static void memory_scope_enter(MemoryScope *scope) {
+    scope->current = 0;
+    scope->peak = 0;
+    memory_scope_resume(scope);
+}
+
+// Restores the scope this one was entered in, which takes over its bytes.
+// The arena is only emptied by the outermost scope, as the enclosing ones
+// may still use its blocks.
+static void memory_scope_exit(MemoryScope *scope) {
+    MemoryScope *previous = scope->previous;
+    if (previous != NULL) {
+        memory_atomic_max(&previous->peak, memory_atomic_load(&previous->current) + scope->peak);
+        memory_atomic_add(&previous->current, scope->current);
+    }
+    enif_tsd_set(memory_scope_key, previous);
+    if (scope->arena != NULL && (previous == NULL || previous->arena != scope->arena)) {
+        memory_arena_reset(scope->arena);
+    }
+}
+
+// The scope of the calling thread, if any
+static MemoryScope *memory_scope_current(void) {
+    return (MemoryScope *)enif_tsd_get(memory_scope_key);
+}
+
+// Accounts the blocks of the calling thread to `scope`, for helper threads
+// working for another call, and returns the scope it replaces
+static MemoryScope *memory_scope_swap(MemoryScope *scope) {
+    MemoryScope *previous = memory_scope_current();
+    enif_tsd_set(memory_scope_key, scope);
+    return previous;
+}
+
+// The arena blocks of `kind` are carved from, if any. Helper threads
+// working for a scope don't carve from the arena of its thread.
+static MemoryArena *memory_current_arena(MemoryKind kind) {
+    MemoryScope *scope = memory_scope_current();
+    if (kind != MEMORY_DECODE || scope == NULL || scope->arena == NULL) {
+        return NULL;
+    }
+    return scope->arena == (MemoryArena *)enif_tsd_get(memory_arena_key) ? scope->arena : NULL;
+}
+
+// The space a block of `size` bytes takes in an arena, with its header
+static size_t memory_arena_block_size(size_t size) {
+    return MEMORY_HEADER_SIZE + ((size + MEMORY_HEADER_SIZE - 1) & ~(size_t)(MEMORY_HEADER_SIZE - 1));
+}
+
+// Sets the end of the last block of `arena`, starting at `offset`, to fit
+// `size` bytes. Returns false if they don't fit.
+static bool memory_arena_fit(MemoryArena *arena, size_t offset, size_t size) {
+    if (size > MEMORY_ARENA_BLOCK_MAX) {
+        return false;
+    }
+    size_t end = offset + memory_arena_block_size(size);
+    if (end > arena->wanted) {
+        arena->wanted = end;
+    }
+    if (end > arena->capacity) {
+        return false;
+    }
+    arena->used = end;
+    return true;
+}
+
+// Whether `block` is the last one carved from `arena` on this thread, so
+// it can be grown or given back
+static bool memory_arena_is_last(MemoryArena *arena, const unsigned char *block, size_t size) {
+    return arena == memory_current_arena(MEMORY_DECODE) && block + memory_arena_block_size(size) == arena->base + arena->used;
+}
+
+static unsigned char *memory_block_alloc(MemoryKind kind, size_t size, MemoryHeader *header) {
+    header->size = size;
+    header->arena = memory_current_arena(kind);
+    if (header->arena != NULL) {
+        size_t offset = header->arena->used;
+        if (memory_arena_fit(header->arena, offset, size)) {
+            return header->arena->base + offset;
+        }
+        header->arena = NULL;
+    }
+    return (unsigned char *)enif_alloc(MEMORY_HEADER_SIZE + size);
+}
+
+// Only the last block of an arena is given back right away, the others
+// when the arena is reset
+static void memory_block_free(unsigned char *block, const MemoryHeader *header) {
+    if (header->arena == NULL) {
+        enif_free(block);
+    } else if (memory_arena_is_last(header->arena, block, header->size)) {
+        header->arena->used = block - header->arena->base;
+    }
+}
+
+static void memory_account(MemoryKind kind, MemoryOp op, size_t freed, size_t allocated, bool arena) {
+    int64_t delta = (int64_t)allocated - (int64_t)freed;
+    MemoryScope *scope = (MemoryScope *)enif_tsd_get(memory_scope_key);
+    if (scope != NULL) {
+        memory_atomic_max(&scope->peak, memory_atomic_add(&scope->current, delta));
+    }
+
+    MemoryCounters *counters = &memory_counters[kind];
+    memory_atomic_max(&counters->peak, memory_atomic_add(&counters->current, delta));
+    switch (op) {
+    case MEMORY_ALLOC:
+        memory_atomic_add(&counters->allocs, 1);
+        break;
+    case MEMORY_REALLOC:
+        memory_atomic_add(&counters->reallocs, 1);
+        memory_atomic_add(&counters->realloc_bytes, (int64_t)allocated);
+        break;
+    case MEMORY_FREE:
+        memory_atomic_add(&counters->frees, 1);
+        break;
+    }
+    if (arena) {
+        memory_atomic_add(&counters->arena_allocs, 1);
+    }
+}
+
+static void *memory_alloc(MemoryKind kind, size_t size) {
+    MemoryHeader header;
+    unsigned char *block = memory_block_alloc(kind, size, &header);
+    if (block == NULL) {
+        return NULL;
+    }
+    memcpy(block, &header, sizeof(header));
+    memory_account(kind, MEMORY_ALLOC, 0, size, header.arena != NULL);
+    return block + MEMORY_HEADER_SIZE;
+}
+
+static void memory_free(MemoryKind kind, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    unsigned char *block = (unsigned char *)ptr - MEMORY_HEADER_SIZE;
+    MemoryHeader header;
+    memcpy(&header, block, sizeof(header));
+    memory_block_free(block, &header);
+    memory_account(kind, MEMORY_FREE, header.size, 0, false);
+}
+
+static void *memory_realloc(MemoryKind kind, void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return memory_alloc(kind, size);
+    }
+    unsigned char *block = (unsigned char *)ptr - MEMORY_HEADER_SIZE;
+    MemoryHeader header;
+    memcpy(&header, block, sizeof(header));
+    size_t old_size = header.size;
+
+    if (header.arena == NULL) {
+        block = (unsigned char *)enif_realloc(block, MEMORY_HEADER_SIZE + size);
+        if (block == NULL) {
+            return NULL;
+        }
+    } else if (!memory_arena_is_last(header.arena, block, old_size) ||
+               !memory_arena_fit(header.arena, block - header.arena->base, size)) {
+        // Grown buffers, such as the zlib output, move out of the arena
+        // once it is full
+        MemoryHeader moved_header;
+        unsigned char *moved = memory_block_alloc(kind, size, &moved_header);
+        if (moved == NULL) {
+            return NULL;
+        }
+        memcpy(moved + MEMORY_HEADER_SIZE, block + MEMORY_HEADER_SIZE, old_size < size ? old_size : size);
+        memory_block_free(block, &header);
+        block = moved;
+        header = moved_header;
+    }
+
+    header.size = size;
+    memcpy(block, &header, sizeof(header));
+    memory_account(kind, MEMORY_REALLOC, old_size, size, header.arena != NULL);
+    return block + MEMORY_HEADER_SIZE;
+}
+
+// Puts the peak of the current scope into `map` under `memory`
+static ERL_NIF_TERM memory_put(ErlNifEnv *env, ERL_NIF_TERM map) {
+    MemoryScope *scope = (MemoryScope *)enif_tsd_get(memory_scope_key);
+    int64_t peak = scope != NULL ? memory_atomic_load(&scope->peak) : 0;
+    enif_make_map_put(env, map, enif_make_atom(env, "memory"), enif_make_int64(env, peak), &map);
+    return map;
+}
+
+static ERL_NIF_TERM memory_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    MemoryCounters counters[MEMORY_KIND_COUNT];
+    for (int i = 0; i < MEMORY_KIND_COUNT; ++i) {
+        int64_t *from = (int64_t *)&memory_counters[i];
+        int64_t *to = (int64_t *)&counters[i];
+        for (size_t j = 0; j < sizeof(MemoryCounters) / sizeof(int64_t); ++j) {
+            to[j] = memory_atomic_load(&from[j]);
+        }
+    }
+    enif_mutex_lock(memory_lock);
+    size_t arena_bytes = memory_arena_bytes;
+    enif_mutex_unlock(memory_lock);
+
+    ERL_NIF_TERM keys[7] = {
+        enif_make_atom(env, "current"),
+        enif_make_atom(env, "peak"),
+        enif_make_atom(env, "allocs"),
+        enif_make_atom(env, "reallocs"),
+        enif_make_atom(env, "frees"),
+        enif_make_atom(env, "realloc_bytes"),
+        enif_make_atom(env, "arena_allocs"),
+    };
+
+    ERL_NIF_TERM stats = enif_make_new_map(env);
+    for (int i = 0; i < MEMORY_KIND_COUNT; ++i) {
+        ERL_NIF_TERM values[7] = {
+            enif_make_int64(env, counters[i].current),
+            enif_make_int64(env, counters[i].peak),
+            enif_make_int64(env, counters[i].allocs),
+            enif_make_int64(env, counters[i].reallocs),
+            enif_make_int64(env, counters[i].frees),
+            enif_make_int64(env, counters[i].realloc_bytes),
+            enif_make_int64(env, counters[i].arena_allocs),
+        };
+        ERL_NIF_TERM kind;
+        enif_make_map_from_arrays(env, keys, values, 7, &kind);
+        enif_make_map_put(env, stats, enif_make_atom(env, memory_kind_names[i]), kind, &stats);
+    }
+    enif_make_map_put(env, stats, enif_make_atom(env, "arenas"), enif_make_uint64(env, arena_bytes), &stats);
+    return stats;
+}
+
+// Defines `name` as a NIF running `nif` inside a memory scope, so its
+// results can report the peak with memory_put
+#define MEMORY_SCOPED_NIF(name, nif)                                                  \
+    static ERL_NIF_TERM name(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {   \
+        MemoryScope scope;                                                            \
+        memory_scope_enter(&scope);                                                   \
+        ERL_NIF_TERM ret = nif(env, argc, argv);                                      \
+        memory_scope_exit(&scope);                                                    \
+        return ret;                                                                   \
+    }
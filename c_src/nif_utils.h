@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include "erl_nif.h"
 
 static ERL_NIF_TERM error(ErlNifEnv *env, const char *msg)
@@ -8,3 +9,36 @@ static ERL_NIF_TERM error(ErlNifEnv *env, const char *msg)
   ERL_NIF_TERM msg_term = enif_make_string(env, msg, ERL_NIF_LATIN1);
   return enif_make_tuple2(env, atom, msg_term);
 }
+
+// Reads the integer stored under the atom `key` in the `options` map.
+// `value` is left untouched when the key is missing; returns false if
+// the key is present but not an integer.
+static bool get_int_option(ErlNifEnv *env, ERL_NIF_TERM options, const char *key, int *value)
+{
+  ERL_NIF_TERM term;
+  if (!enif_get_map_value(env, options, enif_make_atom(env, key), &term)) {
+    return true;
+  }
+  return enif_get_int(env, term, value);
+}
+
+// Same as get_int_option, for non-negative 64-bit integers.
+static bool get_uint64_option(ErlNifEnv *env, ERL_NIF_TERM options, const char *key, ErlNifUInt64 *value)
+{
+  ERL_NIF_TERM term;
+  if (!enif_get_map_value(env, options, enif_make_atom(env, key), &term)) {
+    return true;
+  }
+  return enif_get_uint64(env, term, value);
+}
+
+// Reads an integer or float term as a double.
+static bool get_number(ErlNifEnv *env, ERL_NIF_TERM term, double *value)
+{
+  ErlNifSInt64 integer;
+  if (enif_get_int64(env, term, &integer)) {
+    *value = (double)integer;
+    return true;
+  }
+  return enif_get_double(env, term, value);
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+// Helper threads shared by every call of parallel_for. They are started
+// on demand, up to PARALLEL_MAX_THREADS, and live until the library is
+// unloaded, so splitting work across threads doesn't create and join
+// threads on every call. While they work for a call, their allocations
+// are accounted to its memory scope.
+
+#include <stdbool.h>
+#include "erl_nif.h"
+#include "memory.h"
+
+#define PARALLEL_MAX_THREADS 64
+
+typedef void (*ParallelTask)(void *context, int index);
+
+typedef struct ParallelJob {
+    struct ParallelJob *next;
+    ParallelTask task;
+    void *context;
+    MemoryScope *scope;
+    int count;
+    int next_index;
+    // Helpers still wanted, and helpers running tasks of the job
+    int wanted;
+    int active;
+} ParallelJob;
+
+typedef struct {
+    ErlNifMutex *lock;
+    ErlNifCond *work;
+    ErlNifCond *done;
+    // Jobs that want more helpers
+    ParallelJob *jobs;
+    ErlNifTid tids[PARALLEL_MAX_THREADS];
+    int threads;
+    bool stopping;
+} ParallelPool;
+
+static ParallelPool parallel_pool;
+
+// Runs the tasks of `job` left to take. Called with the lock held.
+static void parallel_run(ParallelJob *job) {
+    while (job->next_index < job->count) {
+        int index = job->next_index++;
+        enif_mutex_unlock(parallel_pool.lock);
+        job->task(job->context, index);
+        enif_mutex_lock(parallel_pool.lock);
+    }
+}
+
+static void parallel_unlink(ParallelJob *job) {
+    for (ParallelJob **link = &parallel_pool.jobs; *link != NULL; link = &(*link)->next) {
+        if (*link == job) {
+            *link = job->next;
+            return;
+        }
+    }
+}
+
+static void *parallel_worker(void *arg) {
+    enif_mutex_lock(parallel_pool.lock);
+    for (;;) {
+        while (parallel_pool.jobs == NULL && !parallel_pool.stopping) {
+            enif_cond_wait(parallel_pool.work, parallel_pool.lock);
+        }
+        if (parallel_pool.jobs == NULL) {
+            enif_mutex_unlock(parallel_pool.lock);
+            return NULL;
+        }
+
+        ParallelJob *job = parallel_pool.jobs;
+        if (--job->wanted == 0) {
+            parallel_unlink(job);
+        }
+        job->active++;
+        MemoryScope *previous = memory_scope_swap(job->scope);
+        parallel_run(job);
+        memory_scope_swap(previous);
+        if (--job->active == 0) {
+            enif_cond_broadcast(parallel_pool.done);
+        }
+    }
+}
+
+static bool parallel_init(void) {
+    parallel_pool.lock = enif_mutex_create("stb_image_parallel");
+    parallel_pool.work = enif_cond_create("stb_image_parallel");
+    parallel_pool.done = enif_cond_create("stb_image_parallel");
+    return parallel_pool.lock != NULL && parallel_pool.work != NULL && parallel_pool.done != NULL;
+}
+
+// Starts helpers until there are `threads` of them, or as many as can be
+// started. Called with the lock held.
+static void parallel_grow(int threads) {
+    char name[] = "stb_image_worker";
+    threads = threads > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS : threads;
+    for (; parallel_pool.threads < threads; ++parallel_pool.threads) {
+        if (enif_thread_create(name, &parallel_pool.tids[parallel_pool.threads], parallel_worker, NULL, NULL) != 0) {
+            break;
+        }
+    }
+}
+
+// Runs `task(context, i)` for every i in [0, count) using up to `threads`
+// threads, the calling one included, and returns once all of them are
+// done. Runs with fewer helpers (down to just the caller) when the others
+// are busy or cannot be started.
+static void parallel_for(int count, int threads, ParallelTask task, void *context) {
+    if (threads > count) {
+        threads = count;
+    }
+
+    if (threads <= 1 || parallel_pool.lock == NULL) {
+        for (int i = 0; i < count; ++i) {
+            task(context, i);
+        }
+        return;
+    }
+
+    ParallelJob job = {
+        .next = NULL,
+        .task = task,
+        .context = context,
+        .scope = memory_scope_current(),
+        .count = count,
+        .next_index = 0,
+        .wanted = threads - 1,
+        .active = 0,
+    };
+
+    enif_mutex_lock(parallel_pool.lock);
+    parallel_grow(threads - 1);
+    if (parallel_pool.threads > 0 && !parallel_pool.stopping) {
+        job.next = parallel_pool.jobs;
+        parallel_pool.jobs = &job;
+        enif_cond_broadcast(parallel_pool.work);
+    }
+
+    parallel_run(&job);
+    parallel_unlink(&job);
+    while (job.active > 0) {
+        enif_cond_wait(parallel_pool.done, parallel_pool.lock);
+    }
+    enif_mutex_unlock(parallel_pool.lock);
+}
+
+// Waits for the helpers to exit, so the library can be unloaded
+static void parallel_stop(void) {
+    if (parallel_pool.lock == NULL) {
+        return;
+    }
+
+    enif_mutex_lock(parallel_pool.lock);
+    parallel_pool.stopping = true;
+    enif_cond_broadcast(parallel_pool.work);
+    enif_mutex_unlock(parallel_pool.lock);
+
+    for (int i = 0; i < parallel_pool.threads; ++i) {
+        enif_thread_join(parallel_pool.tids[i], NULL);
+    }
+    enif_cond_destroy(parallel_pool.done);
+    enif_cond_destroy(parallel_pool.work);
+    enif_mutex_destroy(parallel_pool.lock);
+    parallel_pool.lock = NULL;
+}
@@ -0,0 +1,568 @@
+#pragma once
+
+// Incremental PNG decoder.
+//
+// stbi_load decodes a PNG in one go: it copies all the IDAT chunks into
+// one buffer, inflates them into another one as large as the image and
+// unfilters that into the image itself. This decoder instead hands out
+// the image a row at a time. IDAT chunks are read from a stb_image context
+// as the inflate needs them, the inflate keeps a 32KiB window of its
+// output, and each row is unfiltered against the previous one. Memory use
+// is bounded by the window and a few rows, regardless of the image height.
+//
+// Rows come out the way stbi_load returns them: palettes expanded, tRNS
+// turned into alpha, 16-bit samples in native byte order (or their high
+// byte for 8-bit output) and converted to the requested channels.
+// Interlaced images and Apple's CgBI variant are left to stbi_load.
+//
+// The Huffman decoding is stb_image's, so this must be included after the
+// stb_image.h implementation.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "memory.h"
+
+#define PNG_READER_WINDOW_SIZE 32768
+#define PNG_READER_WINDOW_MASK (PNG_READER_WINDOW_SIZE - 1)
+// Compressed bytes read ahead of the inflate
+#define PNG_READER_INPUT_SIZE 65536
+// stbi__zbuf reads past the end of its buffer as zeros, so the buffer is
+// refilled before it runs this low: a symbol with its extra bits takes at
+// most 6 bytes, the code lengths of a dynamic block less than 600
+#define PNG_READER_SYMBOL_MARGIN 32
+#define PNG_READER_HEADER_MARGIN 1024
+
+typedef struct {
+    stbi__context *s;
+    uint32_t width;
+    uint32_t height;
+    int depth;
+    // Channels as stored, 1 for palettes
+    int img_n;
+    // 3 or 4 for palettes, 0 otherwise
+    int pal_n;
+    stbi_uc palette[1024];
+    bool has_trans;
+    stbi_uc tc[3];
+    stbi__uint16 tc16[3];
+    // Channels after expanding palettes and tRNS, and once converted
+    int expanded_n;
+    int channels;
+    // Whether rows come out with 16 bits per channel
+    bool is_16;
+    bool failed;
+
+    // Inflate state. The window is a ring of the last 32KiB inflated.
+    stbi__zbuf z;
+    stbi_uc *input;
+    uint32_t chunk_left;
+    bool input_done;
+    stbi_uc *window;
+    uint64_t total_out;
+    bool final;
+    // 0 between blocks, otherwise 1 + the block type
+    int block;
+    uint32_t stored_left;
+    int match_len;
+    int match_dist;
+
+    // Filtered rows have a filter type byte followed by `row_bytes`
+    size_t row_bytes;
+    int filter_bytes;
+    stbi_uc *prior;
+    stbi_uc *current;
+    // One row with `expanded_n` channels of 8 or 16 bits, and the same
+    // row with `channels` channels of 16 bits for 8-bit output
+    stbi_uc *expanded;
+    stbi__uint16 *converted;
+} PngReader;
+
+static bool png_reader_next_idat(PngReader *reader) {
+    stbi__context *s = reader->s;
+    // CRC of the previous chunk
+    stbi__get32be(s);
+    stbi__pngchunk c = stbi__get_chunk_header(s);
+    if (stbi__at_eof(s) || c.type != STBI__PNG_TYPE('I', 'D', 'A', 'T') || c.length > (1u << 30)) {
+        return false;
+    }
+    reader->chunk_left = c.length;
+    return true;
+}
+
+// Moves the unread input to the front and reads IDAT data after it, once
+// less than `wanted` bytes are left
+static void png_reader_fill(PngReader *reader, size_t wanted) {
+    stbi__zbuf *z = &reader->z;
+    size_t size = (size_t)(z->zbuffer_end - z->zbuffer);
+    if (size >= wanted || reader->input_done) {
+        return;
+    }
+
+    if (size > 0) {
+        memmove(reader->input, z->zbuffer, size);
+    }
+    while (size < PNG_READER_INPUT_SIZE && !reader->input_done) {
+        if (reader->chunk_left == 0) {
+            reader->input_done = !png_reader_next_idat(reader);
+            continue;
+        }
+        size_t count = PNG_READER_INPUT_SIZE - size;
+        count = count < reader->chunk_left ? count : reader->chunk_left;
+        if (!stbi__getn(reader->s, reader->input + size, (int)count)) {
+            // stbi_load fails on truncated chunks too
+            reader->failed = true;
+            reader->input_done = true;
+            break;
+        }
+        size += count;
+        reader->chunk_left -= (uint32_t)count;
+    }
+    z->zbuffer = reader->input;
+    z->zbuffer_end = reader->input + size;
+}
+
+static inline void png_reader_put(PngReader *reader, stbi_uc *out, stbi_uc byte) {
+    reader->window[reader->total_out++ & PNG_READER_WINDOW_MASK] = byte;
+    *out = byte;
+}
+
+// Starts the next deflate block, the same way stbi__parse_zlib does
+static bool png_reader_start_block(PngReader *reader) {
+    stbi__zbuf *z = &reader->z;
+    if (reader->final) {
+        return false;
+    }
+
+    png_reader_fill(reader, PNG_READER_HEADER_MARGIN);
+    reader->final = stbi__zreceive(z, 1);
+    int type = stbi__zreceive(z, 2);
+    if (type == 0) {
+        stbi_uc header[4];
+        int k = 0;
+        if (z->num_bits & 7) {
+            stbi__zreceive(z, z->num_bits & 7);
+        }
+        while (z->num_bits > 0) {
+            header[k++] = (stbi_uc)(z->code_buffer & 255);
+            z->code_buffer >>= 8;
+            z->num_bits -= 8;
+        }
+        if (z->num_bits < 0) {
+            return false;
+        }
+        while (k < 4) {
+            header[k++] = stbi__zget8(z);
+        }
+        int len = header[1] * 256 + header[0];
+        int nlen = header[3] * 256 + header[2];
+        if (nlen != (len ^ 0xffff)) {
+            return false;
+        }
+        reader->stored_left = (uint32_t)len;
+        reader->block = 1;
+    } else if (type == 1) {
+        if (!stbi__zbuild_huffman(&z->z_length, stbi__zdefault_length, STBI__ZNSYMS) ||
+            !stbi__zbuild_huffman(&z->z_distance, stbi__zdefault_distance, 32)) {
+            return false;
+        }
+        reader->block = 2;
+    } else if (type == 2) {
+        if (!stbi__compute_huffman_codes(z)) {
+            return false;
+        }
+        reader->block = 3;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Inflates the next `size` bytes of the image data into `out`
+static bool png_reader_inflate(PngReader *reader, stbi_uc *out, size_t size) {
+    stbi__zbuf *z = &reader->z;
+    stbi_uc *window = reader->window;
+
+    while (size > 0) {
+        if (reader->match_len > 0) {
+            size_t count = (size_t)reader->match_len < size ? (size_t)reader->match_len : size;
+            uint64_t from = reader->total_out - (uint64_t)reader->match_dist;
+            for (size_t i = 0; i < count; ++i) {
+                png_reader_put(reader, out++, window[(from + i) & PNG_READER_WINDOW_MASK]);
+            }
+            reader->match_len -= (int)count;
+            size -= count;
+        } else if (reader->block == 1) {
+            if (reader->stored_left == 0) {
+                reader->block = 0;
+                continue;
+            }
+            if (z->zbuffer == z->zbuffer_end) {
+                png_reader_fill(reader, 1);
+                if (z->zbuffer == z->zbuffer_end) {
+                    return false;
+                }
+            }
+            size_t count = (size_t)(z->zbuffer_end - z->zbuffer);
+            count = count < reader->stored_left ? count : reader->stored_left;
+            count = count < size ? count : size;
+            for (size_t i = 0; i < count; ++i) {
+                png_reader_put(reader, out++, *z->zbuffer++);
+            }
+            reader->stored_left -= (uint32_t)count;
+            size -= count;
+        } else if (reader->block == 0) {
+            if (!png_reader_start_block(reader)) {
+                return false;
+            }
+        } else {
+            png_reader_fill(reader, PNG_READER_SYMBOL_MARGIN);
+            int symbol = stbi__zhuffman_decode(z, &z->z_length);
+            if (symbol < 0 || symbol >= 286) {
+                return false;
+            } else if (symbol < 256) {
+                png_reader_put(reader, out++, (stbi_uc)symbol);
+                size--;
+            } else if (symbol == 256) {
+                // Consuming the padding stbi__zbuf adds at the end means
+                // the data was cut short
+                if (z->hit_zeof_once && z->num_bits < 16) {
+                    return false;
+                }
+                reader->block = 0;
+            } else {
+                symbol -= 257;
+                int len = stbi__zlength_base[symbol];
+                if (stbi__zlength_extra[symbol]) {
+                    len += stbi__zreceive(z, stbi__zlength_extra[symbol]);
+                }
+                symbol = stbi__zhuffman_decode(z, &z->z_distance);
+                if (symbol < 0 || symbol >= 30) {
+                    return false;
+                }
+                int dist = stbi__zdist_base[symbol];
+                if (stbi__zdist_extra[symbol]) {
+                    dist += stbi__zreceive(z, stbi__zdist_extra[symbol]);
+                }
+                if ((uint64_t)dist > reader->total_out) {
+                    return false;
+                }
+                reader->match_len = len;
+                reader->match_dist = dist;
+            }
+        }
+    }
+    return true;
+}
+
+// Reads the chunks up to the first IDAT, with the checks of
+// stbi__parse_png_file. Returns false for the images left to stbi_load.
+static bool png_reader_read_header(PngReader *reader) {
+    stbi__context *s = reader->s;
+    uint32_t pal_len = 0;
+    bool first = true;
+    int color = 0;
+
+    if (!stbi__check_png_header(s)) {
+        return false;
+    }
+
+    for (;;) {
+        stbi__pngchunk c = stbi__get_chunk_header(s);
+        if (stbi__at_eof(s)) {
+            return false;
+        }
+        switch (c.type) {
+            case STBI__PNG_TYPE('I', 'H', 'D', 'R'): {
+                if (!first || c.length != 13) {
+                    return false;
+                }
+                first = false;
+                reader->width = stbi__get32be(s);
+                reader->height = stbi__get32be(s);
+                reader->depth = stbi__get8(s);
+                color = stbi__get8(s);
+                int comp = stbi__get8(s);
+                int filter = stbi__get8(s);
+                int interlace = stbi__get8(s);
+                if (reader->width == 0 || reader->height == 0 ||
+                    reader->width > STBI_MAX_DIMENSIONS || reader->height > STBI_MAX_DIMENSIONS ||
+                    (reader->depth != 1 && reader->depth != 2 && reader->depth != 4 && reader->depth != 8 && reader->depth != 16) ||
+                    color > 6 || (color == 3 && reader->depth == 16) || (color != 3 && (color & 1)) ||
+                    comp != 0 || filter != 0 || interlace != 0) {
+                    return false;
+                }
+                if (color == 3) {
+                    reader->pal_n = 3;
+                    reader->img_n = 1;
+                } else {
+                    reader->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
+                }
+                // stbi_load refuses images whose rows add up to 1GiB
+                if ((1 << 30) / reader->width / (reader->pal_n ? 4 : reader->img_n) < reader->height) {
+                    return false;
+                }
+                break;
+            }
+
+            case STBI__PNG_TYPE('P', 'L', 'T', 'E'):
+                if (first || c.length > 256 * 3 || c.length % 3 != 0) {
+                    return false;
+                }
+                pal_len = c.length / 3;
+                for (uint32_t i = 0; i < pal_len; ++i) {
+                    reader->palette[i * 4 + 0] = stbi__get8(s);
+                    reader->palette[i * 4 + 1] = stbi__get8(s);
+                    reader->palette[i * 4 + 2] = stbi__get8(s);
+                    reader->palette[i * 4 + 3] = 255;
+                }
+                break;
+
+            case STBI__PNG_TYPE('t', 'R', 'N', 'S'):
+                if (first) {
+                    return false;
+                }
+                if (reader->pal_n) {
+                    if (pal_len == 0 || c.length > pal_len) {
+                        return false;
+                    }
+                    reader->pal_n = 4;
+                    for (uint32_t i = 0; i < c.length; ++i) {
+                        reader->palette[i * 4 + 3] = stbi__get8(s);
+                    }
+                } else {
+                    if (!(reader->img_n & 1) || c.length != (uint32_t)reader->img_n * 2) {
+                        return false;
+                    }
+                    reader->has_trans = true;
+                    for (int k = 0; k < reader->img_n && k < 3; ++k) {
+                        if (reader->depth == 16) {
+                            reader->tc16[k] = (stbi__uint16)stbi__get16be(s);
+                        } else {
+                            reader->tc[k] = (stbi_uc)(stbi__get16be(s) & 255) * stbi__depth_scale_table[reader->depth];
+                        }
+                    }
+                }
+                break;
+
+            case STBI__PNG_TYPE('I', 'D', 'A', 'T'):
+                if (first || (reader->pal_n && pal_len == 0) || c.length > (1u << 30)) {
+                    return false;
+                }
+                reader->chunk_left = c.length;
+                return true;
+
+            default:
+                // CgBI, IEND before any IDAT and unknown critical chunks
+                if (first || (c.type & (1 << 29)) == 0) {
+                    return false;
+                }
+                stbi__skip(s, (int)c.length);
+                break;
+        }
+        // CRC
+        stbi__get32be(s);
+    }
+}
+
+static void png_reader_close(PngReader *reader) {
+    STBI_FREE(reader->input);
+    STBI_FREE(reader->window);
+    STBI_FREE(reader->prior);
+    STBI_FREE(reader->current);
+    STBI_FREE(reader->expanded);
+    STBI_FREE(reader->converted);
+    memset(reader, 0, sizeof(*reader));
+}
+
+// Reads the header of the PNG in `s` and gets ready to decode its rows
+// into `req_comp` channels, or as many as stbi_load would. 16-bit images
+// come out with 16 bits per channel if `want_16`. Returns false, with
+// nothing to close, for images that can't be decoded this way.
+static bool png_reader_open(PngReader *reader, stbi__context *s, int req_comp, bool want_16) {
+    memset(reader, 0, sizeof(*reader));
+    reader->s = s;
+    if (req_comp < 0 || req_comp > 4 || !png_reader_read_header(reader)) {
+        return false;
+    }
+
+    if (reader->pal_n) {
+        reader->expanded_n = req_comp >= 3 ? req_comp : reader->pal_n;
+    } else {
+        reader->expanded_n = reader->img_n + (reader->has_trans ? 1 : 0);
+    }
+    reader->channels = req_comp ? req_comp : reader->pal_n ? reader->pal_n : reader->expanded_n;
+    reader->is_16 = reader->depth == 16 && want_16;
+
+    int bytes = reader->depth == 16 ? 2 : 1;
+    reader->row_bytes = ((size_t)reader->width * reader->img_n * reader->depth + 7) / 8;
+    reader->filter_bytes = reader->depth < 8 ? 1 : reader->img_n * bytes;
+    reader->input = STBI_MALLOC(PNG_READER_INPUT_SIZE);
+    reader->window = STBI_MALLOC(PNG_READER_WINDOW_SIZE);
+    reader->prior = STBI_MALLOC(reader->row_bytes + 1);
+    reader->current = STBI_MALLOC(reader->row_bytes + 1);
+    reader->expanded = STBI_MALLOC((size_t)reader->width * reader->expanded_n * bytes);
+    if (reader->depth == 16 && !reader->is_16) {
+        reader->converted = STBI_MALLOC((size_t)reader->width * reader->channels * 2);
+    }
+    if (reader->input == NULL || reader->window == NULL || reader->prior == NULL || reader->current == NULL ||
+        reader->expanded == NULL || (reader->depth == 16 && !reader->is_16 && reader->converted == NULL)) {
+        png_reader_close(reader);
+        return false;
+    }
+
+    // The zlib header, which stbi__parse_zlib_header checks
+    png_reader_fill(reader, 2);
+    int cmf = stbi__zget8(&reader->z);
+    int flg = stbi__zget8(&reader->z);
+    if (reader->failed || (cmf * 256 + flg) % 31 != 0 || (flg & 32) || (cmf & 15) != 8) {
+        png_reader_close(reader);
+        return false;
+    }
+
+    // The first row is unfiltered against zeros
+    memset(reader->current, 0, reader->row_bytes + 1);
+    return true;
+}
+
+static bool png_reader_unfilter(PngReader *reader) {
+    stbi_uc *row = reader->current + 1;
+    const stbi_uc *prior = reader->prior + 1;
+    size_t size = reader->row_bytes;
+    size_t bpp = (size_t)reader->filter_bytes;
+
+    switch (reader->current[0]) {
+        case 0:
+            break;
+        case 1:
+            for (size_t i = bpp; i < size; ++i) {
+                row[i] = (stbi_uc)(row[i] + row[i - bpp]);
+            }
+            break;
+        case 2:
+            for (size_t i = 0; i < size; ++i) {
+                row[i] = (stbi_uc)(row[i] + prior[i]);
+            }
+            break;
+        case 3:
+            for (size_t i = 0; i < size; ++i) {
+                int left = i < bpp ? 0 : row[i - bpp];
+                row[i] = (stbi_uc)(row[i] + ((left + prior[i]) >> 1));
+            }
+            break;
+        case 4:
+            for (size_t i = 0; i < size; ++i) {
+                int left = i < bpp ? 0 : row[i - bpp];
+                int corner = i < bpp ? 0 : prior[i - bpp];
+                row[i] = (stbi_uc)(row[i] + stbi__paeth(left, prior[i], corner));
+            }
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// Converts between channel counts the way stbi__convert_format does
+#define PNG_READER_CONVERT(name, type, max, compute_y)                                           \
+    static void name(const type *src, int from, type *dest, int to, uint32_t width) {            \
+        for (uint32_t i = 0; i < width; ++i, src += from, dest += to) {                          \
+            switch (from * 8 + to) {                                                             \
+                case 1 * 8 + 2: dest[0] = src[0]; dest[1] = max; break;                          \
+                case 1 * 8 + 3: dest[0] = dest[1] = dest[2] = src[0]; break;                     \
+                case 1 * 8 + 4: dest[0] = dest[1] = dest[2] = src[0]; dest[3] = max; break;      \
+                case 2 * 8 + 1: dest[0] = src[0]; break;                                         \
+                case 2 * 8 + 3: dest[0] = dest[1] = dest[2] = src[0]; break;                     \
+                case 2 * 8 + 4: dest[0] = dest[1] = dest[2] = src[0]; dest[3] = src[1]; break;   \
+                case 3 * 8 + 4: memcpy(dest, src, 3 * sizeof(type)); dest[3] = max; break;       \
+                case 3 * 8 + 1: dest[0] = compute_y(src[0], src[1], src[2]); break;              \
+                case 3 * 8 + 2: dest[0] = compute_y(src[0], src[1], src[2]); dest[1] = max; break; \
+                case 4 * 8 + 1: dest[0] = compute_y(src[0], src[1], src[2]); break;              \
+                case 4 * 8 + 2: dest[0] = compute_y(src[0], src[1], src[2]); dest[1] = src[3]; break; \
+                case 4 * 8 + 3: memcpy(dest, src, 3 * sizeof(type)); break;                      \
+                default: memcpy(dest, src, (size_t)to * sizeof(type)); break;                    \
+            }                                                                                    \
+        }                                                                                        \
+    }
+
+PNG_READER_CONVERT(png_reader_convert_8, stbi_uc, 255, stbi__compute_y)
+PNG_READER_CONVERT(png_reader_convert_16, stbi__uint16, 65535, stbi__compute_y_16)
+
+// Expands the unfiltered row into 8 or 16-bit channels, adding the alpha
+// of tRNS and the colors of the palette
+static void png_reader_expand(PngReader *reader) {
+    const stbi_uc *row = reader->current + 1;
+    uint32_t width = reader->width;
+    int img_n = reader->img_n;
+    int out_n = reader->expanded_n;
+
+    if (reader->depth == 16) {
+        stbi__uint16 *out = (stbi__uint16 *)reader->expanded;
+        for (uint32_t i = 0; i < width; ++i, out += out_n) {
+            bool transparent = reader->has_trans;
+            for (int k = 0; k < img_n; ++k, row += 2) {
+                out[k] = (stbi__uint16)((row[0] << 8) | row[1]);
+                transparent = transparent && out[k] == reader->tc16[k];
+            }
+            if (reader->has_trans) {
+                out[img_n] = transparent ? 0 : 65535;
+            }
+        }
+        return;
+    }
+
+    stbi_uc *out = reader->expanded;
+    int depth = reader->depth;
+    int scale = reader->pal_n ? 1 : stbi__depth_scale_table[depth];
+    int mask = (1 << depth) - 1;
+    for (uint32_t i = 0; i < width; ++i, out += out_n) {
+        stbi_uc samples[4];
+        for (int k = 0; k < img_n; ++k) {
+            size_t bit = ((size_t)i * img_n + k) * depth;
+            samples[k] = depth == 8 ? row[bit / 8] : (stbi_uc)(((row[bit / 8] >> (8 - depth - bit % 8)) & mask) * scale);
+        }
+
+        if (reader->pal_n) {
+            memcpy(out, reader->palette + samples[0] * 4, (size_t)out_n);
+        } else {
+            bool transparent = reader->has_trans;
+            for (int k = 0; k < img_n; ++k) {
+                out[k] = samples[k];
+                transparent = transparent && samples[k] == reader->tc[k];
+            }
+            if (reader->has_trans) {
+                out[img_n] = transparent ? 0 : 255;
+            }
+        }
+    }
+}
+
+// Decodes the next row into `out`, with `channels` channels of 8 or 16
+// bits depending on `is_16`
+static bool png_reader_read(PngReader *reader, unsigned char *out) {
+    stbi_uc *prior = reader->prior;
+    reader->prior = reader->current;
+    reader->current = prior;
+
+    if (reader->failed || !png_reader_inflate(reader, reader->current, reader->row_bytes + 1) ||
+        reader->failed || !png_reader_unfilter(reader)) {
+        reader->failed = true;
+        return false;
+    }
+    png_reader_expand(reader);
+
+    uint32_t width = reader->width;
+    int from = reader->expanded_n, to = reader->channels;
+    if (reader->depth != 16) {
+        png_reader_convert_8(reader->expanded, from, out, to, width);
+    } else if (reader->is_16) {
+        png_reader_convert_16((const stbi__uint16 *)reader->expanded, from, (stbi__uint16 *)out, to, width);
+    } else {
+        // Converted, then cut to the high byte like stbi__convert_16_to_8
+        png_reader_convert_16((const stbi__uint16 *)reader->expanded, from, reader->converted, to, width);
+        for (size_t i = 0; i < (size_t)width * to; ++i) {
+            out[i] = (unsigned char)(reader->converted[i] >> 8);
+        }
+    }
+    return true;
+}
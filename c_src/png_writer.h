@@ -0,0 +1,480 @@
+#pragma once
+
+// Incremental PNG encoder.
+//
+// stbi_write_png_to_mem needs the whole image up front and keeps the
+// filtered copy and the compressed copy of it in memory at the same time.
+// This encoder instead takes the image a few rows at a time: each row is
+// filtered as it arrives (with the same per-row filter heuristic as
+// stb_image_write), fed through a streaming deflate with a 32KiB sliding
+// window, and the compressed output is handed to a sink in IDAT chunks.
+// Memory use is bounded by the window and the chunk size, regardless of
+// the image height.
+//
+// 16-bit images are taken in native byte order and stored big-endian, as
+// PNG requires. stb_image_write only writes 8-bit PNGs.
+//
+// The deflate stream mirrors stbi_zlib_compress: a single block with the
+// fixed Huffman codes, hash chains capped by stbi_write_png_compression_level
+// and one step of lazy matching.
+//
+// Must be included after the stb_image_write.h implementation.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "erl_nif.h"
+#include "memory.h"
+
+#define PNG_WINDOW_SIZE 32768
+#define PNG_WINDOW_MASK (PNG_WINDOW_SIZE - 1)
+#define PNG_HASH_SIZE 16384
+#define PNG_MIN_MATCH 3
+#define PNG_MAX_MATCH 258
+// Compressed bytes per IDAT chunk
+#define PNG_CHUNK_SIZE 65536
+
+// Receives encoded bytes, in order. Returns false to abort encoding.
+typedef bool (*PngSink)(void *context, const unsigned char *data, size_t size);
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    int channels;
+    // 8 or 16
+    int bit_depth;
+    size_t row_bytes;
+    uint32_t rows_written;
+
+    PngSink sink;
+    void *sink_context;
+    bool failed;
+
+    // Previous row, needed to filter the first row of each band, followed
+    // by room for the current row
+    unsigned char *rows;
+    signed char *line;
+
+    // Sliding window: two window sizes, the first one being history
+    unsigned char *window;
+    size_t window_len;
+    size_t pos;
+    int32_t *head;
+    int32_t *prev;
+    int max_chain;
+
+    uint64_t bit_buf;
+    int bit_cnt;
+    uint32_t adler_a;
+    uint32_t adler_b;
+
+    // [length][IDAT][data...][crc]
+    unsigned char *chunk;
+    size_t chunk_len;
+} PngWriter;
+
+static void png_write_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static void png_emit(PngWriter *w, const unsigned char *data, size_t size) {
+    if (!w->failed && !w->sink(w->sink_context, data, size)) {
+        w->failed = true;
+    }
+}
+
+static void png_flush_chunk(PngWriter *w) {
+    if (w->chunk_len == 0) {
+        return;
+    }
+
+    png_write_be32(w->chunk, (uint32_t)w->chunk_len);
+    png_write_be32(w->chunk + 8 + w->chunk_len, stbiw__crc32(w->chunk + 4, (int)w->chunk_len + 4));
+    png_emit(w, w->chunk, w->chunk_len + 12);
+    w->chunk_len = 0;
+}
+
+static inline void png_put_byte(PngWriter *w, unsigned char byte) {
+    w->chunk[8 + w->chunk_len++] = byte;
+    if (w->chunk_len == PNG_CHUNK_SIZE) {
+        png_flush_chunk(w);
+    }
+}
+
+static inline void png_put_bits(PngWriter *w, uint32_t bits, int count) {
+    w->bit_buf |= (uint64_t)bits << w->bit_cnt;
+    w->bit_cnt += count;
+    while (w->bit_cnt >= 8) {
+        png_put_byte(w, (unsigned char)w->bit_buf);
+        w->bit_buf >>= 8;
+        w->bit_cnt -= 8;
+    }
+}
+
+// Huffman codes are sent most significant bit first.
+static inline void png_put_code(PngWriter *w, uint32_t code, int count) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < count; ++i) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    png_put_bits(w, reversed, count);
+}
+
+// Fixed Huffman code of a literal/length symbol (RFC 1951, 3.2.6).
+static inline void png_put_symbol(PngWriter *w, int symbol) {
+    if (symbol <= 143) {
+        png_put_code(w, 0x30 + symbol, 8);
+    } else if (symbol <= 255) {
+        png_put_code(w, 0x190 + symbol - 144, 9);
+    } else if (symbol <= 279) {
+        png_put_code(w, symbol - 256, 7);
+    } else {
+        png_put_code(w, 0xc0 + symbol - 280, 8);
+    }
+}
+
+static void png_put_match(PngWriter *w, int length, int distance) {
+    static const unsigned short length_base[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 259};
+    static const unsigned char length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const unsigned short dist_base[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 32769};
+    static const unsigned char dist_extra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    int j;
+
+    for (j = 0; length > length_base[j + 1] - 1; ++j);
+    png_put_symbol(w, j + 257);
+    if (length_extra[j]) {
+        png_put_bits(w, length - length_base[j], length_extra[j]);
+    }
+
+    for (j = 0; distance > dist_base[j + 1] - 1; ++j);
+    png_put_code(w, j, 5);
+    if (dist_extra[j]) {
+        png_put_bits(w, distance - dist_base[j], dist_extra[j]);
+    }
+}
+
+static inline int png_match_length(const unsigned char *a, const unsigned char *b, int limit) {
+    int i = 0;
+    while (i + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y) {
+            break;
+        }
+        i += 8;
+    }
+    while (i < limit && a[i] == b[i]) {
+        ++i;
+    }
+    return i;
+}
+
+static inline uint32_t png_hash(const unsigned char *p) {
+    return stbiw__zhash((unsigned char *)p) & (PNG_HASH_SIZE - 1);
+}
+
+// Longest match for the bytes at `pos` among the chained candidates,
+// returning its length (0 if shorter than the minimum) and start.
+static int png_longest_match(PngWriter *w, size_t pos, int min_length, size_t *match) {
+    size_t available = w->window_len - pos;
+    int limit = available < PNG_MAX_MATCH ? (int)available : PNG_MAX_MATCH;
+    int best = min_length - 1;
+    int32_t candidate = w->head[png_hash(w->window + pos)];
+
+    for (int chain = 0; candidate >= 0 && chain < w->max_chain; ++chain) {
+        if ((size_t)candidate >= pos || pos - (size_t)candidate > PNG_WINDOW_SIZE - 1) {
+            break;
+        }
+        int length = png_match_length(w->window + candidate, w->window + pos, limit);
+        if (length > best) {
+            best = length;
+            *match = (size_t)candidate;
+            if (length == limit) {
+                break;
+            }
+        }
+        int32_t next = w->prev[candidate & PNG_WINDOW_MASK];
+        if (next >= candidate) {
+            break;
+        }
+        candidate = next;
+    }
+
+    return best >= min_length ? best : 0;
+}
+
+static inline void png_insert(PngWriter *w, size_t pos) {
+    uint32_t h = png_hash(w->window + pos);
+    w->prev[pos & PNG_WINDOW_MASK] = w->head[h];
+    w->head[h] = (int32_t)pos;
+}
+
+// Compresses the window up to the point where a full lookahead is still
+// available, or everything when `finish` is set.
+static void png_deflate(PngWriter *w, bool finish) {
+    size_t end = finish ? w->window_len : (w->window_len > PNG_MAX_MATCH + 1 ? w->window_len - PNG_MAX_MATCH - 1 : 0);
+    size_t hash_end = w->window_len >= PNG_MIN_MATCH + 1 ? w->window_len - PNG_MIN_MATCH : 0;
+
+    while (w->pos < end && w->pos < hash_end) {
+        size_t pos = w->pos, match = 0;
+        int length = png_longest_match(w, pos, PNG_MIN_MATCH, &match);
+        png_insert(w, pos);
+
+        // Lazy matching: prefer a literal if the next byte starts a longer match
+        if (length > 0 && pos + 1 < hash_end) {
+            size_t next_match;
+            if (png_longest_match(w, pos + 1, length + 1, &next_match) > 0) {
+                length = 0;
+            }
+        }
+
+        if (length > 0) {
+            png_put_match(w, length, (int)(pos - match));
+            for (size_t i = pos + 1; i < pos + length && i < hash_end; ++i) {
+                png_insert(w, i);
+            }
+            w->pos += length;
+        } else {
+            png_put_symbol(w, w->window[pos]);
+            w->pos += 1;
+        }
+    }
+
+    if (finish) {
+        for (; w->pos < w->window_len; ++w->pos) {
+            png_put_symbol(w, w->window[w->pos]);
+        }
+    }
+}
+
+// Drops the oldest window of history to make room for more input.
+static void png_slide_window(PngWriter *w) {
+    memmove(w->window, w->window + PNG_WINDOW_SIZE, w->window_len - PNG_WINDOW_SIZE);
+    w->window_len -= PNG_WINDOW_SIZE;
+    w->pos -= PNG_WINDOW_SIZE;
+
+    for (int i = 0; i < PNG_HASH_SIZE; ++i) {
+        w->head[i] = w->head[i] >= PNG_WINDOW_SIZE ? w->head[i] - PNG_WINDOW_SIZE : -1;
+    }
+    for (int i = 0; i < PNG_WINDOW_SIZE; ++i) {
+        w->prev[i] = w->prev[i] >= PNG_WINDOW_SIZE ? w->prev[i] - PNG_WINDOW_SIZE : -1;
+    }
+}
+
+static void png_update_adler(PngWriter *w, const unsigned char *data, size_t size) {
+    uint32_t a = w->adler_a, b = w->adler_b;
+    while (size > 0) {
+        size_t block = size < 5552 ? size : 5552;
+        for (size_t i = 0; i < block; ++i) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += block;
+        size -= block;
+    }
+    w->adler_a = a;
+    w->adler_b = b;
+}
+
+static void png_deflate_input(PngWriter *w, const unsigned char *data, size_t size) {
+    png_update_adler(w, data, size);
+
+    while (size > 0) {
+        if (w->window_len == 2 * PNG_WINDOW_SIZE) {
+            png_deflate(w, false);
+            png_slide_window(w);
+        }
+        size_t room = 2 * PNG_WINDOW_SIZE - w->window_len;
+        size_t n = size < room ? size : room;
+        memcpy(w->window + w->window_len, data, n);
+        w->window_len += n;
+        data += n;
+        size -= n;
+    }
+}
+
+// Filters the row at `z`, whose previous row (if `y` > 0) sits
+// `stride` bytes before it, and feeds it to the compressor.
+static void png_filter_row(PngWriter *w, unsigned char *z, int stride, int y) {
+    // PNG filters work on whole bytes, a 16-bit pixel is 2 * channels of them
+    int width = (int)w->width, n = w->channels * w->bit_depth / 8, row_bytes = (int)w->row_bytes;
+    int filter_type = stbi_write_force_png_filter;
+    // stbiw__encode_png_line addresses rows relative to a base and an index
+    unsigned char *base = y > 0 ? z - stride : z;
+    int index = y > 0 ? 1 : 0;
+
+    if (filter_type < 0 || filter_type >= 5) {
+        int64_t best_value = INT64_MAX;
+        for (int type = 0; type < 5; ++type) {
+            stbiw__encode_png_line(base, stride, width, 2, index, n, type, w->line);
+            int64_t estimate = 0;
+            for (int i = 0; i < row_bytes; ++i) {
+                estimate += abs(w->line[i]);
+            }
+            if (estimate < best_value) {
+                best_value = estimate;
+                filter_type = type;
+            }
+        }
+    }
+    stbiw__encode_png_line(base, stride, width, 2, index, n, filter_type, w->line);
+
+    unsigned char type_byte = (unsigned char)filter_type;
+    png_deflate_input(w, &type_byte, 1);
+    png_deflate_input(w, (unsigned char *)w->line, w->row_bytes);
+}
+
+static void png_writer_free(PngWriter *w) {
+    memory_free(MEMORY_ENCODE, w->rows);
+    memory_free(MEMORY_ENCODE, w->line);
+    memory_free(MEMORY_ENCODE, w->window);
+    memory_free(MEMORY_ENCODE, w->head);
+    memory_free(MEMORY_ENCODE, w->prev);
+    memory_free(MEMORY_ENCODE, w->chunk);
+    memset(w, 0, sizeof(*w));
+}
+
+// Sets up `w` and emits the signature and the IHDR chunk. Returns false
+// if the image is not representable or if memory is exhausted.
+static bool png_writer_init(PngWriter *w, uint32_t width, uint32_t height, int channels, int bit_depth, PngSink sink, void *sink_context) {
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    static const int color_types[5] = {-1, 0, 4, 2, 6};
+    unsigned char ihdr[25];
+
+    memset(w, 0, sizeof(*w));
+    if (width == 0 || height == 0 || width > 0x7fffffff || height > 0x7fffffff || channels < 1 || channels > 4 ||
+        (bit_depth != 8 && bit_depth != 16)) {
+        return false;
+    }
+    // Rows are handed to stbiw__encode_png_line, which works with int sizes
+    if ((uint64_t)width * channels * (bit_depth / 8) > 0x7fffffff / 2) {
+        return false;
+    }
+
+    w->width = width;
+    w->height = height;
+    w->channels = channels;
+    w->bit_depth = bit_depth;
+    w->row_bytes = (size_t)width * channels * (bit_depth / 8);
+    w->sink = sink;
+    w->sink_context = sink_context;
+    w->max_chain = 2 * (stbi_write_png_compression_level < 5 ? 5 : stbi_write_png_compression_level);
+    w->adler_a = 1;
+
+    w->rows = (unsigned char *)memory_alloc(MEMORY_ENCODE, 2 * w->row_bytes);
+    w->line = (signed char *)memory_alloc(MEMORY_ENCODE, w->row_bytes);
+    w->window = (unsigned char *)memory_alloc(MEMORY_ENCODE, 2 * PNG_WINDOW_SIZE);
+    w->head = (int32_t *)memory_alloc(MEMORY_ENCODE, PNG_HASH_SIZE * sizeof(int32_t));
+    w->prev = (int32_t *)memory_alloc(MEMORY_ENCODE, PNG_WINDOW_SIZE * sizeof(int32_t));
+    w->chunk = (unsigned char *)memory_alloc(MEMORY_ENCODE, PNG_CHUNK_SIZE + 12);
+    if (!w->rows || !w->line || !w->window || !w->head || !w->prev || !w->chunk) {
+        png_writer_free(w);
+        return false;
+    }
+    memset(w->head, 0xff, PNG_HASH_SIZE * sizeof(int32_t));
+    memset(w->prev, 0xff, PNG_WINDOW_SIZE * sizeof(int32_t));
+    memcpy(w->chunk + 4, "IDAT", 4);
+
+    png_write_be32(ihdr, 13);
+    memcpy(ihdr + 4, "IHDR", 4);
+    png_write_be32(ihdr + 8, width);
+    png_write_be32(ihdr + 12, height);
+    ihdr[16] = (unsigned char)bit_depth;
+    ihdr[17] = (unsigned char)color_types[channels];
+    ihdr[18] = 0;
+    ihdr[19] = 0;
+    ihdr[20] = 0;
+    png_write_be32(ihdr + 21, stbiw__crc32(ihdr + 4, 17));
+
+    png_emit(w, signature, sizeof(signature));
+    png_emit(w, ihdr, sizeof(ihdr));
+
+    // zlib header, then the single fixed Huffman block (BFINAL = 1, BTYPE = 1)
+    png_put_byte(w, 0x78);
+    png_put_byte(w, 0x5e);
+    png_put_bits(w, 1, 1);
+    png_put_bits(w, 1, 2);
+
+    return !w->failed;
+}
+
+// Encodes 16-bit rows, which are byte swapped one at a time into the
+// slot after the previous row.
+static bool png_writer_push_rows_16(PngWriter *w, const unsigned char *data, uint32_t count) {
+    unsigned char *row = w->rows + w->row_bytes;
+    int stride = (int)w->row_bytes;
+
+    for (uint32_t i = 0; i < count && !w->failed; ++i) {
+        const unsigned char *src = data + (size_t)i * w->row_bytes;
+        for (size_t j = 0; j < w->row_bytes; j += 2) {
+            // Binaries are not necessarily 2-byte aligned
+            uint16_t sample;
+            memcpy(&sample, src + j, 2);
+            row[j] = (unsigned char)(sample >> 8);
+            row[j + 1] = (unsigned char)sample;
+        }
+
+        uint32_t y = w->rows_written++;
+        png_filter_row(w, row, stride, y > 0 ? 1 : 0);
+        memcpy(w->rows, row, w->row_bytes);
+    }
+
+    return !w->failed;
+}
+
+// Encodes `count` rows stored contiguously at `data`.
+static bool png_writer_push_rows(PngWriter *w, const unsigned char *data, uint32_t count) {
+    unsigned char *rows = (unsigned char *)data;
+    int stride = (int)w->row_bytes;
+
+    if (w->bit_depth == 16) {
+        return png_writer_push_rows_16(w, data, count);
+    }
+
+    for (uint32_t i = 0; i < count && !w->failed; ++i) {
+        unsigned char *row = rows + (size_t)i * w->row_bytes;
+        uint32_t y = w->rows_written++;
+
+        if (i == 0 && y > 0) {
+            // The previous row belongs to an earlier band, use the saved copy
+            memcpy(w->rows + w->row_bytes, row, w->row_bytes);
+            png_filter_row(w, w->rows + w->row_bytes, stride, 1);
+        } else {
+            png_filter_row(w, row, stride, y);
+        }
+    }
+
+    if (count > 0) {
+        memcpy(w->rows, rows + (size_t)(count - 1) * w->row_bytes, w->row_bytes);
+    }
+
+    return !w->failed;
+}
+
+// Flushes the compressed stream and writes the trailing chunks. All
+// `height` rows must have been pushed.
+static bool png_writer_finish(PngWriter *w) {
+    static const unsigned char iend[12] = {0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82};
+
+    png_deflate(w, true);
+    png_put_symbol(w, 256);
+    if (w->bit_cnt > 0) {
+        png_put_bits(w, 0, 8 - w->bit_cnt);
+    }
+
+    png_put_byte(w, (unsigned char)(w->adler_b >> 8));
+    png_put_byte(w, (unsigned char)w->adler_b);
+    png_put_byte(w, (unsigned char)(w->adler_a >> 8));
+    png_put_byte(w, (unsigned char)w->adler_a);
+    png_flush_chunk(w);
+
+    png_emit(w, iend, sizeof(iend));
+    return !w->failed;
+}
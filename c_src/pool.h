@@ -0,0 +1,206 @@
+#pragma once
+
+// A pool of native threads running NIFs off the schedulers. Each job
+// copies its arguments into its own environment and, once done, sends
+// `{ref, result}` to the process that submitted it.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "erl_nif.h"
+
+#define POOL_MAX_ARGS 8
+
+typedef ERL_NIF_TERM (*PoolNif)(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+typedef struct PoolJob {
+    struct PoolJob *next;
+    PoolNif nif;
+    ErlNifEnv *env;
+    ErlNifPid pid;
+    ERL_NIF_TERM ref;
+    int argc;
+    ERL_NIF_TERM argv[POOL_MAX_ARGS];
+} PoolJob;
+
+typedef struct {
+    ErlNifMutex *lock;
+    ErlNifCond *cond;
+    PoolJob *head;
+    PoolJob *tail;
+    ErlNifTid *tids;
+    int threads;
+    int max_queue;
+    int queued;
+    int running;
+    uint64_t completed;
+    uint64_t rejected;
+    bool stopping;
+} Pool;
+
+static void *pool_worker(void *arg) {
+    Pool *pool = (Pool *)arg;
+
+    for (;;) {
+        enif_mutex_lock(pool->lock);
+        while (pool->head == NULL && !pool->stopping) {
+            enif_cond_wait(pool->cond, pool->lock);
+        }
+        if (pool->head == NULL) {
+            enif_mutex_unlock(pool->lock);
+            return NULL;
+        }
+        PoolJob *job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        pool->queued--;
+        pool->running++;
+        enif_mutex_unlock(pool->lock);
+
+        ERL_NIF_TERM result = job->nif(job->env, job->argc, job->argv);
+
+        enif_mutex_lock(pool->lock);
+        pool->running--;
+        pool->completed++;
+        enif_mutex_unlock(pool->lock);
+
+        enif_send(NULL, &job->pid, job->env, enif_make_tuple2(job->env, job->ref, result));
+        enif_free_env(job->env);
+        enif_free(job);
+    }
+}
+
+static bool pool_init(Pool *pool) {
+    memset(pool, 0, sizeof(*pool));
+    pool->lock = enif_mutex_create("stb_image_pool");
+    pool->cond = enif_cond_create("stb_image_pool");
+    return pool->lock != NULL && pool->cond != NULL;
+}
+
+// Starts `threads` workers unless the pool is already running, and
+// returns whether at least one of them is
+static bool pool_start(Pool *pool, int threads) {
+    if (pool->threads > 0) {
+        return true;
+    }
+
+    pool->tids = (ErlNifTid *)enif_alloc(sizeof(ErlNifTid) * threads);
+    if (pool->tids == NULL) {
+        return false;
+    }
+    char name[] = "stb_image_pool";
+    for (; pool->threads < threads; ++pool->threads) {
+        if (enif_thread_create(name, &pool->tids[pool->threads], pool_worker, pool, NULL) != 0) {
+            break;
+        }
+    }
+    if (pool->threads == 0) {
+        enif_free(pool->tids);
+        pool->tids = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Queues `nif` to run with copies of `argv`. Returns an error message if
+// the job was not queued.
+static const char *pool_submit(Pool *pool, ErlNifEnv *env, PoolNif nif, int threads, int max_queue,
+                               int argc, const ERL_NIF_TERM argv[], ERL_NIF_TERM ref) {
+    if (argc > POOL_MAX_ARGS) {
+        return "too many arguments";
+    }
+
+    PoolJob *job = (PoolJob *)enif_alloc(sizeof(PoolJob));
+    ErlNifEnv *job_env = enif_alloc_env();
+    if (job == NULL || job_env == NULL) {
+        enif_free(job);
+        if (job_env != NULL) {
+            enif_free_env(job_env);
+        }
+        return "out of memory";
+    }
+
+    job->next = NULL;
+    job->nif = nif;
+    job->env = job_env;
+    enif_self(env, &job->pid);
+    job->ref = enif_make_copy(job_env, ref);
+    job->argc = argc;
+    for (int i = 0; i < argc; ++i) {
+        job->argv[i] = enif_make_copy(job_env, argv[i]);
+    }
+
+    const char *reason = NULL;
+    enif_mutex_lock(pool->lock);
+    pool->max_queue = max_queue;
+    if (!pool_start(pool, threads)) {
+        reason = "could not start threads";
+    } else if (pool->queued >= pool->max_queue) {
+        pool->rejected++;
+        reason = "queue full";
+    } else {
+        if (pool->tail != NULL) {
+            pool->tail->next = job;
+        } else {
+            pool->head = job;
+        }
+        pool->tail = job;
+        pool->queued++;
+        enif_cond_signal(pool->cond);
+    }
+    enif_mutex_unlock(pool->lock);
+
+    if (reason != NULL) {
+        enif_free_env(job_env);
+        enif_free(job);
+    }
+    return reason;
+}
+
+static ERL_NIF_TERM pool_stats(ErlNifEnv *env, Pool *pool) {
+    enif_mutex_lock(pool->lock);
+    ERL_NIF_TERM keys[6] = {
+        enif_make_atom(env, "threads"),
+        enif_make_atom(env, "max_queue"),
+        enif_make_atom(env, "queued"),
+        enif_make_atom(env, "running"),
+        enif_make_atom(env, "completed"),
+        enif_make_atom(env, "rejected"),
+    };
+    ERL_NIF_TERM values[6] = {
+        enif_make_int(env, pool->threads),
+        enif_make_int(env, pool->max_queue),
+        enif_make_int(env, pool->queued),
+        enif_make_int(env, pool->running),
+        enif_make_uint64(env, pool->completed),
+        enif_make_uint64(env, pool->rejected),
+    };
+    enif_mutex_unlock(pool->lock);
+
+    ERL_NIF_TERM stats;
+    enif_make_map_from_arrays(env, keys, values, 6, &stats);
+    return stats;
+}
+
+// Lets the workers finish the queued jobs and waits for them, so the
+// library can be unloaded
+static void pool_stop(Pool *pool) {
+    if (pool->lock == NULL) {
+        return;
+    }
+
+    enif_mutex_lock(pool->lock);
+    pool->stopping = true;
+    enif_cond_broadcast(pool->cond);
+    enif_mutex_unlock(pool->lock);
+
+    for (int i = 0; i < pool->threads; ++i) {
+        enif_thread_join(pool->tids[i], NULL);
+    }
+    enif_free(pool->tids);
+    enif_cond_destroy(pool->cond);
+    enif_mutex_destroy(pool->lock);
+    pool->lock = NULL;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+// Conversions between straight and premultiplied alpha for images whose
+// last channel is alpha (RA and RGBA).
+//
+// 8-bit premultiplication rounds c * a / 255 to nearest and processes 4
+// RGBA pixels per SSE2 instruction. Unpremultiplication needs one division
+// per pixel, which is replaced by a multiplication with a table of
+// reciprocals. 16-bit images round the same way with 65535, and half
+// floats are converted to floats and back one channel at a time.
+//
+// Must be included after the stb_image_resize2.h implementation, whose
+// half float conversions are used.
+
+#include <stdint.h>
+#include <string.h>
+#include "simd.h"
+
+// round(x / 255) for x <= 255 * 255
+static inline unsigned char premultiply_div255(uint32_t x) {
+    x += 128;
+    return (unsigned char)((x + (x >> 8)) >> 8);
+}
+
+static void premultiply_u8(const unsigned char *src, unsigned char *dst, size_t pixels, int channels) {
+    size_t i = 0;
+
+#if defined(NIF_SIMD_SSE2)
+    if (channels == 4) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i round = _mm_set1_epi16(128);
+        const __m128i alpha_mask = _mm_set1_epi32((int)0xff000000);
+
+        for (; i + 4 <= pixels; i += 4) {
+            __m128i px = _mm_loadu_si128((const __m128i *)(src + i * 4));
+            __m128i lo = _mm_unpacklo_epi8(px, zero);
+            __m128i hi = _mm_unpackhi_epi8(px, zero);
+
+            // Broadcast the alpha of each pixel to its four lanes
+            __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xff), 0xff);
+            __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xff), 0xff);
+
+            lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), round);
+            hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), round);
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+            __m128i out = _mm_packus_epi16(lo, hi);
+            out = _mm_or_si128(_mm_andnot_si128(alpha_mask, out), _mm_and_si128(alpha_mask, px));
+            _mm_storeu_si128((__m128i *)(dst + i * 4), out);
+        }
+    }
+#endif
+
+    for (; i < pixels; ++i) {
+        const unsigned char *s = src + i * channels;
+        unsigned char *d = dst + i * channels;
+        uint32_t a = s[channels - 1];
+        for (int c = 0; c < channels - 1; ++c) {
+            d[c] = premultiply_div255(s[c] * a);
+        }
+        d[channels - 1] = (unsigned char)a;
+    }
+}
+
+static void unpremultiply_u8(const unsigned char *src, unsigned char *dst, size_t pixels, int channels) {
+    // round(c * 255 / a) == floor((c * 510 + a) / (2 * a)), and floor(n / d)
+    // == (n * ceil(2^40 / d)) >> 40 for n < 2^24
+    uint64_t reciprocal[256];
+    reciprocal[0] = 0;
+    for (uint64_t a = 1; a < 256; ++a) {
+        reciprocal[a] = ((1ull << 40) + 2 * a - 1) / (2 * a);
+    }
+
+    for (size_t i = 0; i < pixels; ++i) {
+        const unsigned char *s = src + i * channels;
+        unsigned char *d = dst + i * channels;
+        uint32_t a = s[channels - 1];
+        uint64_t r = reciprocal[a];
+        for (int c = 0; c < channels - 1; ++c) {
+            uint32_t v = (uint32_t)(((s[c] * 510u + a) * r) >> 40);
+            d[c] = (unsigned char)(v > 255 ? 255 : v);
+        }
+        d[channels - 1] = (unsigned char)a;
+    }
+}
+
+static void premultiply_f32(const float *src, float *dst, size_t pixels, int channels) {
+    for (size_t i = 0; i < pixels; ++i) {
+        const float *s = src + i * channels;
+        float *d = dst + i * channels;
+        float a = s[channels - 1];
+        for (int c = 0; c < channels - 1; ++c) {
+            d[c] = s[c] * a;
+        }
+        d[channels - 1] = a;
+    }
+}
+
+static void unpremultiply_f32(const float *src, float *dst, size_t pixels, int channels) {
+    for (size_t i = 0; i < pixels; ++i) {
+        const float *s = src + i * channels;
+        float *d = dst + i * channels;
+        float a = s[channels - 1];
+        float r = a != 0.0f ? 1.0f / a : 0.0f;
+        for (int c = 0; c < channels - 1; ++c) {
+            d[c] = s[c] * r;
+        }
+        d[channels - 1] = a;
+    }
+}
+
+// round(x / 65535) for x <= 65535 * 65535
+static inline uint16_t premultiply_div65535(uint64_t x) {
+    x += 32768;
+    return (uint16_t)((x + (x >> 16)) >> 16);
+}
+
+static void premultiply_u16(const uint16_t *src, uint16_t *dst, size_t pixels, int channels) {
+    for (size_t i = 0; i < pixels; ++i) {
+        const uint16_t *s = src + i * channels;
+        uint16_t *d = dst + i * channels;
+        uint64_t a = s[channels - 1];
+        for (int c = 0; c < channels - 1; ++c) {
+            d[c] = premultiply_div65535(s[c] * a);
+        }
+        d[channels - 1] = (uint16_t)a;
+    }
+}
+
+static void unpremultiply_u16(const uint16_t *src, uint16_t *dst, size_t pixels, int channels) {
+    for (size_t i = 0; i < pixels; ++i) {
+        const uint16_t *s = src + i * channels;
+        uint16_t *d = dst + i * channels;
+        uint64_t a = s[channels - 1];
+        for (int c = 0; c < channels - 1; ++c) {
+            uint64_t v = a != 0 ? (s[c] * 131070ull + a) / (2 * a) : 0;
+            d[c] = (uint16_t)(v > 65535 ? 65535 : v);
+        }
+        d[channels - 1] = (uint16_t)a;
+    }
+}
+
+static void premultiply_f16(const stbir__FP16 *src, stbir__FP16 *dst, size_t pixels, int channels) {
+    for (size_t i = 0; i < pixels; ++i) {
+        const stbir__FP16 *s = src + i * channels;
+        stbir__FP16 *d = dst + i * channels;
+        float a = stbir__half_to_float(s[channels - 1]);
+        for (int c = 0; c < channels - 1; ++c) {
+            d[c] = stbir__float_to_half(stbir__half_to_float(s[c]) * a);
+        }
+        d[channels - 1] = s[channels - 1];
+    }
+}
+
+static void unpremultiply_f16(const stbir__FP16 *src, stbir__FP16 *dst, size_t pixels, int channels) {
+    for (size_t i = 0; i < pixels; ++i) {
+        const stbir__FP16 *s = src + i * channels;
+        stbir__FP16 *d = dst + i * channels;
+        float a = stbir__half_to_float(s[channels - 1]);
+        float r = a != 0.0f ? 1.0f / a : 0.0f;
+        for (int c = 0; c < channels - 1; ++c) {
+            d[c] = stbir__float_to_half(stbir__half_to_float(s[c]) * r);
+        }
+        d[channels - 1] = s[channels - 1];
+    }
+}
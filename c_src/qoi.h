@@ -0,0 +1,292 @@
+#pragma once
+
+// QOI ("Quite OK Image") encoder and decoder, following the format
+// specification at https://qoiformat.org/qoi-specification.pdf.
+//
+// Every QOI op depends on the previous pixel and on the 64-entry colour
+// cache, so the format cannot be vectorized across pixels. Instead, pixels
+// are handled as packed 32-bit words, runs of identical pixels (the bulk
+// of screenshots and masks) are scanned and expanded with tight word
+// loops, and all bounds checks are hoisted out of the hot loops by sizing
+// the buffers up front.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+#define QOI_MAX_RUN 62
+
+static const unsigned char qoi_padding[QOI_PADDING_SIZE] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    int channels;
+    int colorspace;
+} QoiHeader;
+
+typedef union {
+    struct {
+        unsigned char r, g, b, a;
+    } rgba;
+    uint32_t v;
+} QoiPixel;
+
+static inline int qoi_hash(QoiPixel px) {
+    return (px.rgba.r * 3 + px.rgba.g * 5 + px.rgba.b * 7 + px.rgba.a * 11) & 63;
+}
+
+static inline QoiPixel qoi_load_pixel(const unsigned char *p, int channels) {
+    QoiPixel px;
+    if (channels == 4) {
+        memcpy(&px.v, p, 4);
+    } else {
+        px.rgba.r = p[0];
+        px.rgba.g = p[1];
+        px.rgba.b = p[2];
+        px.rgba.a = 255;
+    }
+    return px;
+}
+
+static inline void qoi_write_32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static inline uint32_t qoi_read_32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static bool qoi_is_qoi(const unsigned char *data, size_t size) {
+    return size >= QOI_HEADER_SIZE && memcmp(data, "qoif", 4) == 0;
+}
+
+// Upper bound of the encoded size, or 0 on overflow.
+static size_t qoi_max_size(uint32_t width, uint32_t height, int channels) {
+    size_t pixels = (size_t)width * height;
+    if (height != 0 && pixels / height != width) {
+        return 0;
+    }
+    if (pixels > (SIZE_MAX - QOI_HEADER_SIZE - QOI_PADDING_SIZE) / (size_t)(channels + 1)) {
+        return 0;
+    }
+    return pixels * (channels + 1) + QOI_HEADER_SIZE + QOI_PADDING_SIZE;
+}
+
+// Encodes `pixels` (HWC, 3 or 4 channels) into `out`, which must hold at
+// least qoi_max_size() bytes. Returns the number of bytes written.
+static size_t qoi_encode(const unsigned char *pixels, uint32_t width, uint32_t height, int channels, unsigned char *out) {
+    QoiPixel index[64];
+    QoiPixel px_prev, px;
+    unsigned char *p = out;
+    size_t px_len = (size_t)width * height * channels;
+
+    memcpy(p, "qoif", 4);
+    qoi_write_32(p + 4, width);
+    qoi_write_32(p + 8, height);
+    p[12] = (unsigned char)channels;
+    p[13] = 0;
+    p += QOI_HEADER_SIZE;
+
+    memset(index, 0, sizeof(index));
+    px_prev.v = 0;
+    px_prev.rgba.a = 255;
+
+    size_t px_pos = 0;
+    while (px_pos < px_len) {
+        px = qoi_load_pixel(pixels + px_pos, channels);
+
+        if (px.v == px_prev.v) {
+            // Scan the whole run at once
+            size_t run = 1;
+            px_pos += channels;
+            while (px_pos < px_len && qoi_load_pixel(pixels + px_pos, channels).v == px.v) {
+                ++run;
+                px_pos += channels;
+            }
+            while (run > 0) {
+                size_t chunk = run > QOI_MAX_RUN ? QOI_MAX_RUN : run;
+                *p++ = (unsigned char)(QOI_OP_RUN | (chunk - 1));
+                run -= chunk;
+            }
+            continue;
+        }
+
+        int hash = qoi_hash(px);
+        if (index[hash].v == px.v) {
+            *p++ = (unsigned char)(QOI_OP_INDEX | hash);
+        } else {
+            index[hash] = px;
+
+            if (px.rgba.a == px_prev.rgba.a) {
+                signed char vr = (signed char)(px.rgba.r - px_prev.rgba.r);
+                signed char vg = (signed char)(px.rgba.g - px_prev.rgba.g);
+                signed char vb = (signed char)(px.rgba.b - px_prev.rgba.b);
+                signed char vg_r = (signed char)(vr - vg);
+                signed char vg_b = (signed char)(vb - vg);
+
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                    *p++ = (unsigned char)(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                    *p++ = (unsigned char)(QOI_OP_LUMA | (vg + 32));
+                    *p++ = (unsigned char)((vg_r + 8) << 4 | (vg_b + 8));
+                } else {
+                    *p++ = QOI_OP_RGB;
+                    *p++ = px.rgba.r;
+                    *p++ = px.rgba.g;
+                    *p++ = px.rgba.b;
+                }
+            } else {
+                *p++ = QOI_OP_RGBA;
+                *p++ = px.rgba.r;
+                *p++ = px.rgba.g;
+                *p++ = px.rgba.b;
+                *p++ = px.rgba.a;
+            }
+        }
+
+        px_prev = px;
+        px_pos += channels;
+    }
+
+    memcpy(p, qoi_padding, QOI_PADDING_SIZE);
+    p += QOI_PADDING_SIZE;
+
+    return (size_t)(p - out);
+}
+
+static bool qoi_read_header(const unsigned char *data, size_t size, QoiHeader *header) {
+    if (!qoi_is_qoi(data, size)) {
+        return false;
+    }
+
+    header->width = qoi_read_32(data + 4);
+    header->height = qoi_read_32(data + 8);
+    header->channels = data[12];
+    header->colorspace = data[13];
+
+    return header->width > 0 && header->height > 0 &&
+           (header->channels == 3 || header->channels == 4) && header->colorspace <= 1;
+}
+
+// Incremental decoder state, so that an image can be decoded a few rows
+// at a time.
+typedef struct {
+    const unsigned char *data;
+    size_t chunks_len;
+    size_t p;
+    QoiPixel index[64];
+    QoiPixel px;
+    // Pixels left in the run of `px`
+    size_t run;
+} QoiDecoder;
+
+static void qoi_decoder_init(QoiDecoder *dec, const unsigned char *data, size_t size) {
+    dec->data = data;
+    dec->chunks_len = size >= QOI_PADDING_SIZE ? size - QOI_PADDING_SIZE : 0;
+    dec->p = QOI_HEADER_SIZE;
+    memset(dec->index, 0, sizeof(dec->index));
+    dec->px.v = 0;
+    dec->px.rgba.a = 255;
+    dec->run = 0;
+}
+
+// Decodes the next `pixels` pixels into `out` with `channels` (3 or 4)
+// channels, which may differ from the ones stored in the file. Truncated
+// streams repeat the last pixel, as in the reference decoder.
+static void qoi_decoder_read(QoiDecoder *dec, unsigned char *out, size_t pixels, int channels) {
+    const unsigned char *data = dec->data;
+    size_t chunks_len = dec->chunks_len;
+    size_t p = dec->p;
+    size_t run = dec->run;
+    QoiPixel px = dec->px;
+    QoiPixel *index = dec->index;
+    size_t px_len = pixels * channels;
+
+    size_t px_pos = 0;
+    while (px_pos < px_len) {
+        if (run == 0) {
+            run = 1;
+
+            if (p < chunks_len) {
+                int b1 = data[p++];
+
+                if (b1 == QOI_OP_RGB) {
+                    px.rgba.r = data[p];
+                    px.rgba.g = data[p + 1];
+                    px.rgba.b = data[p + 2];
+                    p += 3;
+                } else if (b1 == QOI_OP_RGBA) {
+                    px.rgba.r = data[p];
+                    px.rgba.g = data[p + 1];
+                    px.rgba.b = data[p + 2];
+                    px.rgba.a = data[p + 3];
+                    p += 4;
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+                    px = index[b1];
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+                    px.rgba.r += ((b1 >> 4) & 0x03) - 2;
+                    px.rgba.g += ((b1 >> 2) & 0x03) - 2;
+                    px.rgba.b += (b1 & 0x03) - 2;
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+                    int b2 = data[p++];
+                    int vg = (b1 & 0x3f) - 32;
+                    px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                    px.rgba.g += vg;
+                    px.rgba.b += vg - 8 + (b2 & 0x0f);
+                } else {
+                    run = (b1 & 0x3f) + 1;
+                }
+
+                index[qoi_hash(px)] = px;
+            } else {
+                // Truncated stream, fill the rest with the last pixel
+                run = SIZE_MAX;
+            }
+        }
+
+        size_t count = (px_len - px_pos) / channels;
+        if (count > run) {
+            count = run;
+        }
+        run -= count;
+
+        if (channels == 4) {
+            for (size_t i = 0; i < count; ++i, px_pos += 4) {
+                memcpy(out + px_pos, &px.v, 4);
+            }
+        } else {
+            for (size_t i = 0; i < count; ++i, px_pos += 3) {
+                out[px_pos] = px.rgba.r;
+                out[px_pos + 1] = px.rgba.g;
+                out[px_pos + 2] = px.rgba.b;
+            }
+        }
+    }
+
+    dec->p = p;
+    dec->run = run;
+    dec->px = px;
+}
+
+// Decodes the QOI image in `data` into `out`, which must hold
+// width * height * channels bytes. `channels` (3 or 4) may differ from
+// the one stored in the file.
+static void qoi_decode(const unsigned char *data, size_t size, const QoiHeader *header, int channels, unsigned char *out) {
+    QoiDecoder dec;
+    qoi_decoder_init(&dec, data, size);
+    qoi_decoder_read(&dec, out, (size_t)header->width * header->height, channels);
+}
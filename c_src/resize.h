@@ -0,0 +1,257 @@
+#pragma once
+
+// Helpers around the stb_image_resize2 extended API.
+//
+// Must be included after the stb_image_resize2.h implementation.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "erl_nif.h"
+#include "parallel.h"
+#include "box_resize.h"
+
+typedef struct {
+    int threads;
+    // stbir_filter and stbir_edge values, applied to both axes
+    int filter;
+    int edge;
+    // Whether the alpha of 2 and 4-channel images is premultiplied
+    int premultiplied;
+    // stbir_datatype of the output, or -1 for the input one
+    int output_type;
+    // Input region {y, x, h, w} in pixels, which may be fractional
+    bool crop;
+    double crop_y, crop_x, crop_h, crop_w;
+} ResizeOptions;
+
+static bool resize_crop_is_integral(const ResizeOptions *options) {
+    return floor(options->crop_y) == options->crop_y && floor(options->crop_x) == options->crop_x &&
+           floor(options->crop_h) == options->crop_h && floor(options->crop_w) == options->crop_w;
+}
+
+// Byte offset of the first input pixel read by the resize. Crops on whole
+// pixels are applied by pointing stb_image_resize2 at the region, with
+// the stride of the full image, so no rows are copied.
+static size_t resize_input_offset(const ResizeOptions *options, int input_w, size_t pixel_bytes) {
+    if (!options->crop || !resize_crop_is_integral(options)) {
+        return 0;
+    }
+    return ((size_t)options->crop_y * input_w + (size_t)options->crop_x) * pixel_bytes;
+}
+
+// Size in bytes of a channel of the given stbir_datatype, or 0 for the
+// types images can't have (the sRGB variants).
+static int resize_type_size(int type) {
+    switch (type) {
+        case STBIR_TYPE_UINT8: return 1;
+        case STBIR_TYPE_UINT16: return 2;
+        case STBIR_TYPE_HALF_FLOAT: return 2;
+        case STBIR_TYPE_FLOAT: return 4;
+        default: return 0;
+    }
+}
+
+static int resize_output_type(int input_type, const ResizeOptions *options) {
+    return options->output_type < 0 ? input_type : options->output_type;
+}
+
+// Sets up `resize` for HWC images with `channels` channels of the
+// stbir_datatype `input_type`, reading the crop region of `input` when
+// one is given. `input` may be NULL and set later with
+// stbir_set_buffer_ptrs, offset by resize_input_offset. The output is
+// converted to the output type while it is encoded, without an
+// intermediate buffer. Returns false for unsupported types and options.
+static bool resize_setup(STBIR_RESIZE *resize, const void *input, int input_w, int input_h, void *output, int output_w, int output_h, int channels, int input_type, const ResizeOptions *options) {
+    int output_type = resize_output_type(input_type, options);
+    int bytes_per_channel = resize_type_size(input_type);
+    if (bytes_per_channel == 0 || resize_type_size(output_type) == 0) {
+        return false;
+    }
+
+    if (options->filter < STBIR_FILTER_DEFAULT || options->filter >= STBIR_FILTER_OTHER ||
+        options->edge < STBIR_EDGE_CLAMP || options->edge > STBIR_EDGE_ZERO) {
+        return false;
+    }
+
+    size_t pixel_bytes = (size_t)channels * bytes_per_channel;
+    int input_stride = input_w * (int)pixel_bytes;
+    bool subrect = false;
+
+    if (options->crop) {
+        if (options->crop_y < 0 || options->crop_x < 0 || options->crop_h <= 0 || options->crop_w <= 0 ||
+            options->crop_y + options->crop_h > input_h || options->crop_x + options->crop_w > input_w) {
+            return false;
+        }
+
+        if (resize_crop_is_integral(options)) {
+            if (input != NULL) {
+                input = (const unsigned char *)input + resize_input_offset(options, input_w, pixel_bytes);
+            }
+            input_h = (int)options->crop_h;
+            input_w = (int)options->crop_w;
+        } else {
+            subrect = true;
+        }
+    }
+
+    // 1 to 4 channels map to STBIR_1CHANNEL, STBIR_2CHANNEL, STBIR_RGB and
+    // STBIR_RGBA, whose alpha is premultiplied and unpremultiplied around
+    // the filtering; premultiplied layouts skip both passes
+    stbir_pixel_layout layout = (stbir_pixel_layout)channels;
+    if (options->premultiplied) {
+        if (channels == 2) {
+            layout = STBIR_RA_PM;
+        } else if (channels == 4) {
+            layout = STBIR_RGBA_PM;
+        } else {
+            return false;
+        }
+    }
+
+    stbir_resize_init(resize, input, input_w, input_h, input_stride, output, output_w, output_h, 0, layout, (stbir_datatype)input_type);
+    stbir_set_datatypes(resize, (stbir_datatype)input_type, (stbir_datatype)output_type);
+    if (subrect &&
+        !stbir_set_input_subrect(resize, options->crop_x / input_w, options->crop_y / input_h,
+                                 (options->crop_x + options->crop_w) / input_w, (options->crop_y + options->crop_h) / input_h)) {
+        return false;
+    }
+    stbir_set_filters(resize, (stbir_filter)options->filter, (stbir_filter)options->filter);
+    stbir_set_edgemodes(resize, (stbir_edge)options->edge, (stbir_edge)options->edge);
+    return true;
+}
+
+typedef struct {
+    STBIR_RESIZE *resize;
+    int first;
+    // One flag per split, so workers never write to the same location
+    char *failed;
+} ResizeJob;
+
+static void resize_split_task(void *context, int index) {
+    ResizeJob *job = (ResizeJob *)context;
+    job->failed[index] = !stbir_resize_extended_split(job->resize, job->first + index, 1);
+}
+
+// Runs `count` splits of the samplers, from `first`, across up to
+// `threads` native threads
+static bool resize_run_splits(STBIR_RESIZE *resize, int first, int count, int threads) {
+    if (count == 1 || threads <= 1) {
+        return stbir_resize_extended_split(resize, first, count);
+    }
+
+    ResizeJob job = { .resize = resize, .first = first, .failed = (char *)enif_alloc(count) };
+    if (job.failed == NULL) {
+        return false;
+    }
+    parallel_for(count, threads, resize_split_task, &job);
+    bool ok = true;
+    for (int i = 0; i < count; ++i) {
+        ok = ok && !job.failed[i];
+    }
+    enif_free(job.failed);
+    return ok;
+}
+
+// Points split `split` of the samplers built with
+// stbir_build_samplers_with_splits at the output rows [start, end), the
+// same way stbir__get_split_info lays out the splits of a whole image.
+// Each split holds its own scratch memory, which running it again over
+// other rows reuses, so a resize can run in many bands one after the
+// other with the scratch memory of a few.
+static void resize_set_split_rows(STBIR_RESIZE *resize, int split, int start, int end) {
+    stbir__info *info = resize->samplers;
+    stbir__per_split_info *split_info = &info->split_info[split];
+    split_info->start_output_y = start;
+    split_info->end_output_y = end;
+    split_info->start_input_y = -info->vertical.filter_pixel_margin;
+    split_info->end_input_y = info->vertical.scale_info.input_full_size + info->vertical.filter_pixel_margin;
+}
+
+// Output rows of a resize whose samplers are built
+static int resize_output_rows(const STBIR_RESIZE *resize) {
+    return resize->samplers->vertical.scale_info.output_sub_size;
+}
+
+// Runs a resize set up with stbir_resize_init and the stbir_set_* calls.
+// With more than one thread, the samplers are built once for the whole
+// image and the output rows are split across native threads. Samplers
+// built beforehand by the caller are reused as is. Integer-ratio box
+// downscales skip stb_image_resize2 entirely, see box_resize.h.
+static bool resize_run(STBIR_RESIZE *resize, int threads) {
+    bool ok = true;
+    if (box_resize_try(resize, threads, &ok)) {
+        return ok;
+    }
+
+    if (threads <= 1) {
+        return stbir_resize_extended(resize);
+    }
+
+    bool prebuilt = resize->samplers != NULL && !resize->needs_rebuild;
+    int splits = prebuilt ? resize->splits : stbir_build_samplers_with_splits(resize, threads);
+    if (splits <= 0) {
+        return false;
+    }
+
+    ok = resize_run_splits(resize, 0, splits, threads);
+
+    if (!prebuilt) {
+        stbir_free_samplers(resize);
+    }
+    return ok;
+}
+
+// Clocks spent in each stage of a resize, as measured by the profiler of
+// stb_image_resize2 when the NIF is compiled with STBIR_PROFILE. Stages
+// are summed over splits, and clocks are CPU timestamp counter ticks.
+typedef struct {
+    bool available;
+    uint64_t build, total;
+    uint64_t looping, vertical, horizontal, decode, encode, alpha, unalpha;
+} ResizeProfile;
+
+// Same as resize_run, also filling `profile` in profiling builds. The
+// box kernels don't go through stb_image_resize2 and are not profiled.
+static bool resize_run_profiled(STBIR_RESIZE *resize, int threads, ResizeProfile *profile) {
+    memset(profile, 0, sizeof(*profile));
+
+#ifdef STBIR_PROFILE
+    bool ok = true;
+    if (box_resize_try(resize, threads, &ok)) {
+        return ok;
+    }
+
+    // The samplers hold the timings, so they are kept until read
+    bool prebuilt = resize->samplers != NULL && !resize->needs_rebuild;
+    if (!prebuilt && stbir_build_samplers_with_splits(resize, threads > 1 ? threads : 1) <= 0) {
+        return false;
+    }
+
+    STBIR_PROFILE_INFO info;
+    stbir_resize_build_profile_info(&info, resize);
+    profile->build = info.total_clocks;
+
+    ok = resize_run(resize, threads);
+    if (ok) {
+        stbir_resize_extended_profile_info(&info, resize);
+        profile->available = true;
+        profile->total = info.total_clocks;
+        profile->looping = info.clocks[0];
+        profile->vertical = info.clocks[1];
+        profile->horizontal = info.clocks[2];
+        profile->decode = info.clocks[3];
+        profile->encode = info.clocks[4];
+        profile->alpha = info.clocks[5];
+        profile->unalpha = info.clocks[6];
+    }
+
+    if (!prebuilt) {
+        stbir_free_samplers(resize);
+    }
+    return ok;
+#else
+    return resize_run(resize, threads);
+#endif
+}
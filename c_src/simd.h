@@ -0,0 +1,132 @@
+#pragma once
+
+// Minimal 4-lane float vector abstraction used by the native encoders.
+//
+// SSE2 is part of the x86_64 baseline and NEON of the aarch64 one, so no
+// extra compiler flags are needed. Every other target falls back to a
+// plain struct that the compiler is free to auto-vectorize.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NIF_SIMD_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define NIF_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(NIF_SIMD_SSE2)
+
+typedef __m128 vec4f;
+
+static inline vec4f vec4f_load(const float *p) { return _mm_loadu_ps(p); }
+static inline void vec4f_store(float *p, vec4f v) { _mm_storeu_ps(p, v); }
+static inline vec4f vec4f_set1(float x) { return _mm_set1_ps(x); }
+static inline vec4f vec4f_add(vec4f a, vec4f b) { return _mm_add_ps(a, b); }
+static inline vec4f vec4f_sub(vec4f a, vec4f b) { return _mm_sub_ps(a, b); }
+static inline vec4f vec4f_mul(vec4f a, vec4f b) { return _mm_mul_ps(a, b); }
+
+// (a0 + a1, a2 + a3, b0 + b1, b2 + b3)
+static inline vec4f vec4f_pairwise_add(vec4f a, vec4f b) {
+    vec4f even = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    vec4f odd = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+    return _mm_add_ps(even, odd);
+}
+
+static inline void vec4f_transpose(vec4f *r0, vec4f *r1, vec4f *r2, vec4f *r3) {
+    _MM_TRANSPOSE4_PS(*r0, *r1, *r2, *r3);
+}
+
+// Rounds half away from zero and stores the result as 32-bit integers.
+static inline void vec4f_store_rounded(int *p, vec4f v) {
+    vec4f sign = _mm_and_ps(v, _mm_set1_ps(-0.0f));
+    vec4f half = _mm_or_ps(sign, _mm_set1_ps(0.5f));
+    _mm_storeu_si128((__m128i *)p, _mm_cvttps_epi32(_mm_add_ps(v, half)));
+}
+
+#elif defined(NIF_SIMD_NEON)
+
+typedef float32x4_t vec4f;
+
+static inline vec4f vec4f_load(const float *p) { return vld1q_f32(p); }
+static inline void vec4f_store(float *p, vec4f v) { vst1q_f32(p, v); }
+static inline vec4f vec4f_set1(float x) { return vdupq_n_f32(x); }
+static inline vec4f vec4f_add(vec4f a, vec4f b) { return vaddq_f32(a, b); }
+static inline vec4f vec4f_sub(vec4f a, vec4f b) { return vsubq_f32(a, b); }
+static inline vec4f vec4f_mul(vec4f a, vec4f b) { return vmulq_f32(a, b); }
+
+static inline vec4f vec4f_pairwise_add(vec4f a, vec4f b) {
+    float32x4x2_t u = vuzpq_f32(a, b);
+    return vaddq_f32(u.val[0], u.val[1]);
+}
+
+static inline void vec4f_transpose(vec4f *r0, vec4f *r1, vec4f *r2, vec4f *r3) {
+    float32x4x2_t t01 = vtrnq_f32(*r0, *r1);
+    float32x4x2_t t23 = vtrnq_f32(*r2, *r3);
+    *r0 = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+    *r1 = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+    *r2 = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+    *r3 = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+}
+
+static inline void vec4f_store_rounded(int *p, vec4f v) {
+    uint32x4_t sign = vandq_u32(vreinterpretq_u32_f32(v), vdupq_n_u32(0x80000000u));
+    vec4f half = vreinterpretq_f32_u32(vorrq_u32(sign, vreinterpretq_u32_f32(vdupq_n_f32(0.5f))));
+    vst1q_s32(p, vcvtq_s32_f32(vaddq_f32(v, half)));
+}
+
+#else
+
+typedef struct { float v[4]; } vec4f;
+
+static inline vec4f vec4f_load(const float *p) {
+    vec4f r = {{p[0], p[1], p[2], p[3]}};
+    return r;
+}
+
+static inline void vec4f_store(float *p, vec4f v) {
+    p[0] = v.v[0]; p[1] = v.v[1]; p[2] = v.v[2]; p[3] = v.v[3];
+}
+
+static inline vec4f vec4f_set1(float x) {
+    vec4f r = {{x, x, x, x}};
+    return r;
+}
+
+static inline vec4f vec4f_add(vec4f a, vec4f b) {
+    for (int i = 0; i < 4; ++i) a.v[i] += b.v[i];
+    return a;
+}
+
+static inline vec4f vec4f_sub(vec4f a, vec4f b) {
+    for (int i = 0; i < 4; ++i) a.v[i] -= b.v[i];
+    return a;
+}
+
+static inline vec4f vec4f_mul(vec4f a, vec4f b) {
+    for (int i = 0; i < 4; ++i) a.v[i] *= b.v[i];
+    return a;
+}
+
+static inline vec4f vec4f_pairwise_add(vec4f a, vec4f b) {
+    vec4f r = {{a.v[0] + a.v[1], a.v[2] + a.v[3], b.v[0] + b.v[1], b.v[2] + b.v[3]}};
+    return r;
+}
+
+static inline void vec4f_transpose(vec4f *r0, vec4f *r1, vec4f *r2, vec4f *r3) {
+    vec4f *rows[4] = {r0, r1, r2, r3};
+    vec4f t[4];
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            t[i].v[j] = rows[j]->v[i];
+        }
+    }
+    *r0 = t[0]; *r1 = t[1]; *r2 = t[2]; *r3 = t[3];
+}
+
+static inline void vec4f_store_rounded(int *p, vec4f v) {
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (int)(v.v[i] < 0 ? v.v[i] - 0.5f : v.v[i] + 0.5f);
+    }
+}
+
+#endif
@@ -1,24 +1,38 @@
 #include <erl_nif.h>
+#include "memory.h"
 #define STBI_NO_FAILURE_STRINGS
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
-#define STBI_MALLOC enif_alloc
-#define STBI_REALLOC enif_realloc
-#define STBI_FREE enif_free
+#define STBI_MALLOC(size) memory_alloc(MEMORY_DECODE, size)
+#define STBI_REALLOC(ptr,size) memory_realloc(MEMORY_DECODE, ptr, size)
+#define STBI_FREE(ptr) memory_free(MEMORY_DECODE, ptr)
+#define STBIW_MALLOC(size) memory_alloc(MEMORY_ENCODE, size)
+#define STBIW_REALLOC(ptr,size) memory_realloc(MEMORY_ENCODE, ptr, size)
+#define STBIW_FREE(ptr) memory_free(MEMORY_ENCODE, ptr)
 #define STBI_WINDOWS_UTF8
 #define STBIW_WINDOWS_UTF8
 #include <stb_image.h>
 #include <stb_image_write.h>
-#define STBIR_MALLOC(size,user_data) ((void)(user_data), enif_alloc(size))
-#define STBIR_FREE(ptr,user_data) ((void)(user_data), enif_free(ptr))
+#define STBIR_MALLOC(size,user_data) ((void)(user_data), memory_alloc(MEMORY_RESIZE, size))
+#define STBIR_FREE(ptr,user_data) ((void)(user_data), memory_free(MEMORY_RESIZE, ptr))
 #include <stb_image_resize2.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 
 #define MAX_EXTNAME_LENGTH 4
 
 #include "nif_utils.h"
+#include "timings.h"
+#include "jpeg_encoder.h"
+#include "jpeg_reader.h"
+#include "qoi.h"
+#include "png_reader.h"
+#include "png_writer.h"
+#include "resize.h"
+#include "premultiply.h"
+#include "pool.h"
 
 #ifdef __GNUC__
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -27,20 +41,66 @@
 #pragma GCC diagnostic ignored "-Wunused-function"
 #endif
 
-static ERL_NIF_TERM pack_data(ErlNifEnv *env, unsigned char *data, int x, int y, int n, int bytes_per_channel) {
+// What the read functions report besides the image
+typedef struct {
+    const char *format;
+    // Size of the encoded image
+    size_t bytes;
+    Timings timings;
+} ReadStats;
+
+// Name of the format of an encoded image, from its first bytes. TGA has
+// no signature, and is what stb_image tries last.
+static const char *image_format(const unsigned char *magic, size_t size) {
+    if (size >= 4 && memcmp(magic, "\x89PNG", 4) == 0) {
+        return "png";
+    } else if (size >= 3 && memcmp(magic, "\xff\xd8\xff", 3) == 0) {
+        return "jpg";
+    } else if (size >= 4 && memcmp(magic, "GIF8", 4) == 0) {
+        return "gif";
+    } else if (size >= 2 && memcmp(magic, "BM", 2) == 0) {
+        return "bmp";
+    } else if (size >= 4 && memcmp(magic, "8BPS", 4) == 0) {
+        return "psd";
+    } else if (size >= 2 && memcmp(magic, "#?", 2) == 0) {
+        return "hdr";
+    } else if (size >= 4 && memcmp(magic, "\x53\x80\xf6\x34", 4) == 0) {
+        return "pic";
+    } else if (size >= 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6')) {
+        return "pnm";
+    } else if (qoi_is_qoi(magic, size)) {
+        return "qoi";
+    } else {
+        return "tga";
+    }
+}
+
+static ERL_NIF_TERM make_image(ErlNifEnv *env, ErlNifBinary *binary, int x, int y, int n, int bytes_per_channel, const ReadStats *stats) {
+    ERL_NIF_TERM info = enif_make_new_map(env);
+    enif_make_map_put(env, info, enif_make_atom(env, "format"), enif_make_atom(env, stats->format), &info);
+    enif_make_map_put(env, info, enif_make_atom(env, "bytes"), enif_make_uint64(env, (ErlNifUInt64)stats->bytes), &info);
+
+    return enif_make_tuple5(env,
+                            enif_make_atom(env, "ok"),
+                            enif_make_binary(env, binary),
+                            enif_make_tuple3(env,
+                                             enif_make_int(env, y),
+                                             enif_make_int(env, x),
+                                             enif_make_int(env, n)),
+                            enif_make_int(env, bytes_per_channel),
+                            memory_put(env, timings_put(env, &stats->timings, info)));
+}
+
+static ERL_NIF_TERM pack_data(ErlNifEnv *env, unsigned char *data, int x, int y, int n, int bytes_per_channel, ReadStats *stats) {
     if (data != NULL) {
         ErlNifBinary result;
-        if (enif_alloc_binary(x * y * n * bytes_per_channel, &result)) {
+        ErlNifTime start = timings_now();
+        if (enif_alloc_binary((size_t)x * y * n * bytes_per_channel, &result)) {
+            timings_add(&stats->timings, PHASE_ALLOC, start);
+            start = timings_now();
             memcpy(result.data, data, result.size);
-
-            return enif_make_tuple4(env,
-                                    enif_make_atom(env, "ok"),
-                                    enif_make_binary(env, &result),
-                                    enif_make_tuple3(env,
-                                                     enif_make_int(env, y),
-                                                     enif_make_int(env, x),
-                                                     enif_make_int(env, n)),
-                                    enif_make_int(env, bytes_per_channel));
+            timings_add(&stats->timings, PHASE_COPY, start);
+            return make_image(env, &result, x, y, n, bytes_per_channel, stats);
         } else {
             return error(env, "out of memory");
         }
@@ -49,11 +109,615 @@ static ERL_NIF_TERM pack_data(ErlNifEnv *env, unsigned char *data, int x, int y,
     }
 }
 
+// Decodes the formats that stb_image does not support. Returns NULL if
+// `data` is not in one of them (with `*handled` set to false) or if it
+// cannot be decoded. The result must be released with STBI_FREE.
+static unsigned char *load_native_from_memory(const unsigned char *data, size_t size, int *x, int *y, int *n, int desired_channels, bool *handled) {
+    QoiHeader header;
+
+    *handled = qoi_is_qoi(data, size);
+    if (!*handled) {
+        return NULL;
+    }
+
+    if (desired_channels < 0 || desired_channels > 4 || !qoi_read_header(data, size, &header) ||
+        header.width > STBI_MAX_DIMENSIONS || header.height > STBI_MAX_DIMENSIONS) {
+        return NULL;
+    }
+
+    int channels = desired_channels == 4 || (desired_channels == 0 && header.channels == 4) ? 4 : 3;
+    size_t pixels = (size_t)header.width * header.height;
+    unsigned char *pixels_data = (unsigned char *)STBI_MALLOC(pixels * channels);
+    if (pixels_data == NULL) {
+        return NULL;
+    }
+    qoi_decode(data, size, &header, channels, pixels_data);
+
+    *x = (int)header.width;
+    *y = (int)header.height;
+    *n = header.channels;
+
+    // stbi__convert_format fails when the result does not fit in an int
+    if (desired_channels > 0 && desired_channels < 3) {
+        pixels_data = stbi__convert_format(pixels_data, channels, desired_channels, header.width, header.height);
+    }
+    return pixels_data;
+}
+
+// ftell and fseek take a long, which is 32-bit on Windows
+#ifdef _WIN32
+#define file_tell _ftelli64
+#define file_seek _fseeki64
+#else
+#define file_tell ftell
+#define file_seek fseek
+#endif
+
+static unsigned char *read_whole_file(FILE *f, size_t *size) {
+    if (file_seek(f, 0, SEEK_END) != 0) {
+        return NULL;
+    }
+    int64_t length = file_tell(f);
+    if (length < 0 || file_seek(f, 0, SEEK_SET) != 0) {
+        return NULL;
+    }
+
+    unsigned char *data = enif_alloc(length > 0 ? (size_t)length : 1);
+    if (data != NULL && fread(data, 1, (size_t)length, f) != (size_t)length) {
+        enif_free(data);
+        return NULL;
+    }
+
+    *size = (size_t)length;
+    return data;
+}
+
+// Reads the first bytes of `f` without moving its position
+static size_t read_magic(FILE *f, unsigned char *magic, size_t size) {
+    long pos = ftell(f);
+    size_t read = fread(magic, 1, size, f);
+
+    fseek(f, pos, SEEK_SET);
+    return read;
+}
+
+static size_t file_size(FILE *f) {
+    int64_t pos = file_tell(f);
+    int64_t size = file_seek(f, 0, SEEK_END) == 0 ? file_tell(f) : -1;
+
+    file_seek(f, pos, SEEK_SET);
+    return size > 0 ? (size_t)size : 0;
+}
+
+// stb_image takes the length of in-memory images as an int, so larger
+// binaries are read through its callbacks instead
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+} BinaryReader;
+
+static int binary_reader_read(void *user, char *out, int size) {
+    BinaryReader *reader = (BinaryReader *)user;
+    size_t count = reader->size - reader->pos < (size_t)size ? reader->size - reader->pos : (size_t)size;
+    memcpy(out, reader->data + reader->pos, count);
+    reader->pos += count;
+    return (int)count;
+}
+
+static void binary_reader_skip(void *user, int n) {
+    BinaryReader *reader = (BinaryReader *)user;
+    if (n < 0) {
+        reader->pos = (size_t)-(int64_t)n > reader->pos ? 0 : reader->pos - (size_t)-(int64_t)n;
+    } else {
+        reader->pos = reader->size - reader->pos < (size_t)n ? reader->size : reader->pos + (size_t)n;
+    }
+}
+
+static int binary_reader_eof(void *user) {
+    BinaryReader *reader = (BinaryReader *)user;
+    return reader->pos >= reader->size;
+}
+
+static const stbi_io_callbacks binary_reader_callbacks = {binary_reader_read, binary_reader_skip, binary_reader_eof};
+
+static int binary_is_hdr(const unsigned char *data, size_t size) {
+    BinaryReader reader = {data, size, 0};
+    return size <= INT_MAX ? stbi_is_hdr_from_memory(data, (int)size) : stbi_is_hdr_from_callbacks(&binary_reader_callbacks, &reader);
+}
+
+static int binary_is_16_bit(const unsigned char *data, size_t size) {
+    BinaryReader reader = {data, size, 0};
+    return size <= INT_MAX ? stbi_is_16_bit_from_memory(data, (int)size) : stbi_is_16_bit_from_callbacks(&binary_reader_callbacks, &reader);
+}
+
+static int binary_info(const unsigned char *data, size_t size, int *x, int *y, int *n) {
+    BinaryReader reader = {data, size, 0};
+    return size <= INT_MAX ? stbi_info_from_memory(data, (int)size, x, y, n) : stbi_info_from_callbacks(&binary_reader_callbacks, &reader, x, y, n);
+}
+
+static float *binary_loadf(const unsigned char *data, size_t size, int *x, int *y, int *n, int desired_channels) {
+    BinaryReader reader = {data, size, 0};
+    return size <= INT_MAX ? stbi_loadf_from_memory(data, (int)size, x, y, n, desired_channels)
+                           : stbi_loadf_from_callbacks(&binary_reader_callbacks, &reader, x, y, n, desired_channels);
+}
+
+static stbi_us *binary_load_16(const unsigned char *data, size_t size, int *x, int *y, int *n, int desired_channels) {
+    BinaryReader reader = {data, size, 0};
+    return size <= INT_MAX ? stbi_load_16_from_memory(data, (int)size, x, y, n, desired_channels)
+                           : stbi_load_16_from_callbacks(&binary_reader_callbacks, &reader, x, y, n, desired_channels);
+}
+
+static stbi_uc *binary_load(const unsigned char *data, size_t size, int *x, int *y, int *n, int desired_channels) {
+    BinaryReader reader = {data, size, 0};
+    return size <= INT_MAX ? stbi_load_from_memory(data, (int)size, x, y, n, desired_channels)
+                           : stbi_load_from_callbacks(&binary_reader_callbacks, &reader, x, y, n, desired_channels);
+}
+
+// Limits checked against the header of an image before it is decoded.
+// Zero means no limit.
+typedef struct {
+    ErlNifUInt64 max_pixels;
+    ErlNifUInt64 max_bytes;
+} ReadLimits;
+
+static bool get_read_limits(ErlNifEnv *env, ERL_NIF_TERM term, ReadLimits *limits) {
+    limits->max_pixels = 0;
+    limits->max_bytes = 0;
+    return enif_is_map(env, term) &&
+           get_uint64_option(env, term, "max_pixels", &limits->max_pixels) &&
+           get_uint64_option(env, term, "max_bytes", &limits->max_bytes);
+}
+
+// Dimensions, channels and bytes per channel of an image as stored,
+// read from its header alone
+typedef struct {
+    int x, y, n;
+    int bytes_per_channel;
+} ImageInfo;
+
+static bool qoi_info(const unsigned char *data, size_t size, ImageInfo *info) {
+    QoiHeader header;
+    if (!qoi_read_header(data, size, &header) ||
+        header.width > STBI_MAX_DIMENSIONS || header.height > STBI_MAX_DIMENSIONS) {
+        return false;
+    }
+    info->x = (int)header.width;
+    info->y = (int)header.height;
+    info->n = header.channels;
+    info->bytes_per_channel = 1;
+    return true;
+}
+
+static bool image_info_from_memory(const unsigned char *data, size_t size, ImageInfo *info) {
+    if (qoi_is_qoi(data, size)) {
+        return qoi_info(data, size, info);
+    }
+    if (!binary_info(data, size, &info->x, &info->y, &info->n)) {
+        return false;
+    }
+    info->bytes_per_channel = binary_is_hdr(data, size) ? 4 : binary_is_16_bit(data, size) ? 2 : 1;
+    return true;
+}
+
+// `magic` holds the first bytes of the file, enough for a QOI header
+static bool image_info_from_file(FILE *f, const unsigned char *magic, size_t magic_size, ImageInfo *info) {
+    if (qoi_is_qoi(magic, magic_size)) {
+        return qoi_info(magic, magic_size, info);
+    }
+    if (!stbi_info_from_file(f, &info->x, &info->y, &info->n)) {
+        return false;
+    }
+    info->bytes_per_channel = stbi_is_hdr_from_file(f) ? 4 : stbi_is_16_bit_from_file(f) ? 2 : 1;
+    return true;
+}
+
+// Rough peak memory of decoding an image and returning it as a binary.
+// stb_image decodes in the layout of the file and converts the result to
+// the requested channels and depth afterwards, holding both for a while.
+static ErlNifUInt64 estimate_decode_bytes(const char *format, const ImageInfo *info, int desired_channels, int bit_depth) {
+    int bytes_per_channel = info->bytes_per_channel == 4 ? 4 : bit_depth == 16 && info->bytes_per_channel == 2 ? 2 : 1;
+    ErlNifUInt64 pixels = (ErlNifUInt64)info->x * info->y;
+    ErlNifUInt64 output = pixels * (desired_channels > 0 ? desired_channels : info->n) * bytes_per_channel;
+    ErlNifUInt64 decoded = pixels * info->n * info->bytes_per_channel;
+    ErlNifUInt64 scratch = decoded != output ? decoded : 0;
+
+    if (strcmp(format, "png") == 0) {
+        // The inflated scanlines, with a filter byte each
+        scratch += (ErlNifUInt64)info->y * ((ErlNifUInt64)info->x * info->n * info->bytes_per_channel + 1);
+    } else if (strcmp(format, "jpg") == 0) {
+        // One plane per component, upsampled into the output row by row
+        scratch = pixels * info->n;
+    } else if (strcmp(format, "qoi") == 0) {
+        // Decoded straight into the requested channels
+        scratch = 0;
+    }
+    return scratch + 2 * output;
+}
+
+// Returns the reason decoding the image would break `limits`, or NULL
+static const char *check_read_limits(const ReadLimits *limits, const char *format, const ImageInfo *info, int desired_channels, int bit_depth) {
+    if (limits->max_pixels > 0 && (ErlNifUInt64)info->x * info->y > limits->max_pixels) {
+        return "image exceeds max_pixels";
+    }
+    if (limits->max_bytes > 0 && estimate_decode_bytes(format, info, desired_channels, bit_depth) > limits->max_bytes) {
+        return "decoding the image would exceed max_bytes";
+    }
+    return NULL;
+}
+
+static bool get_resize_options(ErlNifEnv *env, ERL_NIF_TERM options, ResizeOptions *resize_options) {
+    resize_options->threads = 1;
+    resize_options->filter = STBIR_FILTER_DEFAULT;
+    resize_options->edge = STBIR_EDGE_CLAMP;
+    resize_options->premultiplied = 0;
+    resize_options->output_type = -1;
+    resize_options->crop = false;
+
+    ERL_NIF_TERM crop;
+    if (enif_get_map_value(env, options, enif_make_atom(env, "crop"), &crop)) {
+        const ERL_NIF_TERM *values;
+        int arity;
+        if (!enif_get_tuple(env, crop, &arity, &values) || arity != 4 ||
+            !get_number(env, values[0], &resize_options->crop_y) ||
+            !get_number(env, values[1], &resize_options->crop_x) ||
+            !get_number(env, values[2], &resize_options->crop_h) ||
+            !get_number(env, values[3], &resize_options->crop_w)) {
+            return false;
+        }
+        resize_options->crop = true;
+    }
+
+    return get_int_option(env, options, "threads", &resize_options->threads) &&
+           get_int_option(env, options, "filter", &resize_options->filter) &&
+           get_int_option(env, options, "edge", &resize_options->edge) &&
+           get_int_option(env, options, "premultiplied", &resize_options->premultiplied) &&
+           get_int_option(env, options, "output_type", &resize_options->output_type);
+}
+
+// The :resize_to option of the read functions
+typedef struct {
+    bool enabled;
+    int height, width;
+    ResizeOptions options;
+} ReadResize;
+
+// Parses nil or a {height, width, options} tuple
+static bool get_read_resize(ErlNifEnv *env, ERL_NIF_TERM term, ReadResize *read_resize) {
+    const ERL_NIF_TERM *values;
+    int arity;
+
+    read_resize->enabled = false;
+    if (enif_is_identical(term, enif_make_atom(env, "nil"))) {
+        return true;
+    }
+    if (!enif_get_tuple(env, term, &arity, &values) || arity != 3 ||
+        !enif_get_int(env, values[0], &read_resize->height) || read_resize->height <= 0 ||
+        !enif_get_int(env, values[1], &read_resize->width) || read_resize->width <= 0 ||
+        !enif_is_map(env, values[2]) || !get_resize_options(env, values[2], &read_resize->options)) {
+        return false;
+    }
+    read_resize->enabled = true;
+    return true;
+}
+
+// Resizes a decoded image and returns it like pack_data
+static ERL_NIF_TERM resize_decoded(ErlNifEnv *env, const unsigned char *data, int x, int y, int n, int bytes_per_channel, const ReadResize *read_resize, ReadStats *stats) {
+    if (data == NULL) {
+        return error(env, "cannot decode image");
+    }
+
+    int input_type = bytes_per_channel == 4 ? STBIR_TYPE_FLOAT : bytes_per_channel == 2 ? STBIR_TYPE_UINT16 : STBIR_TYPE_UINT8;
+    int output_bytes = resize_type_size(resize_output_type(input_type, &read_resize->options));
+    int h = read_resize->height, w = read_resize->width;
+
+    if (output_bytes == 0) {
+        return error(env, "invalid type or options");
+    }
+
+    ErlNifBinary result;
+    ErlNifTime start = timings_now();
+    if (!enif_alloc_binary((size_t)w * h * n * output_bytes, &result)) {
+        return error(env, "out of memory");
+    }
+    timings_add(&stats->timings, PHASE_ALLOC, start);
+
+    STBIR_RESIZE resize;
+    if (!resize_setup(&resize, data, x, y, result.data, w, h, n, input_type, &read_resize->options)) {
+        enif_release_binary(&result);
+        return error(env, "invalid type or options");
+    }
+    start = timings_now();
+    if (!resize_run(&resize, read_resize->options.threads)) {
+        enif_release_binary(&result);
+        return error(env, "failed to resize");
+    }
+    timings_add(&stats->timings, PHASE_RESIZE, start);
+
+    return make_image(env, &result, w, h, n, output_bytes, stats);
+}
+
+// Input rows of a resize decoded on demand. Decoded rows go into a small
+// ring, so the full image is never held in memory.
+typedef struct {
+    void *decoder;
+    // Decodes the next row, and starts over from the first one
+    bool (*read)(void *decoder, unsigned char *row);
+    bool (*rewind)(void *decoder);
+    size_t row_bytes;
+    // Bytes between rows in the ring, with room for what the decoder
+    // writes past a row
+    size_t stride;
+    size_t pixel_bytes;
+    // Rows in the ring and the next row to decode
+    int capacity;
+    int next_row;
+    unsigned char *rows;
+    bool failed;
+} RowSource;
+
+// Decodes the next row into `row`. stb_image_resize2 can't be stopped, so
+// the rows of a broken image are zeros and the result is dropped.
+static void row_source_read(RowSource *source, unsigned char *row) {
+    if (source->failed || !source->read(source->decoder, row)) {
+        source->failed = true;
+        memset(row, 0, source->row_bytes);
+    }
+    source->next_row++;
+}
+
+static const void *row_source_callback(void *optional_output, const void *input_ptr, int num_pixels, int x, int y, void *context) {
+    RowSource *source = (RowSource *)context;
+
+    // Rows are requested in increasing order, with a window of a few rows
+    // for the vertical filter. Going back past the ring, which only edge
+    // modes should do, decodes the image again from the start.
+    if (y < source->next_row - source->capacity) {
+        source->failed = source->failed || !source->rewind(source->decoder);
+        source->next_row = 0;
+    }
+    while (source->next_row <= y) {
+        row_source_read(source, source->rows + (size_t)(source->next_row % source->capacity) * source->stride);
+    }
+
+    return source->rows + (size_t)(y % source->capacity) * source->stride + (size_t)x * source->pixel_bytes;
+}
+
+// Runs the box kernels of `job` on the rows of `source`, decoding the
+// fy input rows of each output row at the start of the ring, which holds
+// at least that many. Returns false when out of memory.
+static bool row_source_box(RowSource *source, const BoxJob *job) {
+    void *scratch = enif_alloc(box_scratch_size(job));
+    if (scratch == NULL) {
+        return false;
+    }
+
+    for (int oy = 0; oy < job->output_h && !source->failed; ++oy) {
+        for (int k = 0; k < job->fy; ++k) {
+            row_source_read(source, source->rows + (size_t)k * source->stride);
+        }
+        box_row(job, oy, source->rows, source->stride, scratch);
+    }
+
+    enif_free(scratch);
+    return true;
+}
+
+// Resizes an image of `input_w` by `input_h` pixels while its rows are
+// decoded by `source`, whose decoder, read and rewind are set. Only the
+// options resize_rows_supported accepts are handled. The time spent
+// decoding is part of the resize phase.
+static ERL_NIF_TERM resize_rows(ErlNifEnv *env, RowSource *source, int input_w, int input_h, int channels, int input_type, const ReadResize *read_resize, ReadStats *stats) {
+    const ResizeOptions *options = &read_resize->options;
+    int h = read_resize->height, w = read_resize->width;
+    int output_bytes = resize_type_size(resize_output_type(input_type, options));
+    ERL_NIF_TERM ret;
+
+    // Enough rows for the vertical filter of the cubic filters at this scale
+    int capacity = 4 * ((input_h + h - 1) / h) + 8;
+    source->capacity = capacity > input_h ? input_h : capacity;
+    source->pixel_bytes = (size_t)channels * resize_type_size(input_type);
+    source->row_bytes = (size_t)input_w * source->pixel_bytes;
+    source->stride = source->stride > source->row_bytes ? source->stride : source->row_bytes;
+    source->next_row = 0;
+    source->failed = false;
+
+    ErlNifBinary result;
+    ErlNifTime start = timings_now();
+    source->rows = memory_alloc(MEMORY_DECODE, (size_t)source->capacity * source->stride);
+    if (source->rows == NULL || !enif_alloc_binary((size_t)w * h * channels * output_bytes, &result)) {
+        memory_free(MEMORY_DECODE, source->rows);
+        return error(env, "out of memory");
+    }
+    timings_add(&stats->timings, PHASE_ALLOC, start);
+
+    STBIR_RESIZE resize;
+    BoxJob box;
+    if (!resize_setup(&resize, NULL, input_w, input_h, result.data, w, h, channels, input_type, options)) {
+        enif_release_binary(&result);
+        ret = error(env, "invalid type or options");
+    } else {
+        // Integer-ratio box downscales take the box kernels, as resize_run
+        // does for decoded images
+        bool use_box = box_job_init(&resize, &box);
+        stbir_set_pixel_callbacks(&resize, row_source_callback, NULL);
+        stbir_set_user_data(&resize, source);
+        start = timings_now();
+        if (use_box ? !row_source_box(source, &box) : !resize_run(&resize, 1)) {
+            enif_release_binary(&result);
+            ret = error(env, "failed to resize");
+        } else if (source->failed) {
+            enif_release_binary(&result);
+            ret = error(env, "cannot decode image");
+        } else {
+            timings_add(&stats->timings, PHASE_RESIZE, start);
+            ret = make_image(env, &result, w, h, channels, output_bytes, stats);
+        }
+    }
+
+    memory_free(MEMORY_DECODE, source->rows);
+    return ret;
+}
+
+// Whether resize_rows can take a resize with `options`: rows are decoded
+// in order, so they can't be shared across threads, and crops are left
+// to the full decode
+static bool resize_rows_supported(const ResizeOptions *options) {
+    return options->threads <= 1 && !options->crop;
+}
+
+typedef struct {
+    QoiDecoder decoder;
+    const unsigned char *data;
+    size_t size;
+    int width, channels;
+} QoiRows;
+
+static bool qoi_rows_read(void *decoder, unsigned char *row) {
+    QoiRows *rows = (QoiRows *)decoder;
+    qoi_decoder_read(&rows->decoder, row, (size_t)rows->width, rows->channels);
+    return true;
+}
+
+static bool qoi_rows_rewind(void *decoder) {
+    QoiRows *rows = (QoiRows *)decoder;
+    qoi_decoder_init(&rows->decoder, rows->data, rows->size);
+    return true;
+}
+
+// Resizes a QOI image while decoding it. Returns false, without touching
+// `ret`, when the image or options need the whole image in memory. The
+// decoder only produces 3 or 4 channels.
+static bool resize_qoi_rows(ErlNifEnv *env, const unsigned char *data, size_t size, int desired_channels, const ReadResize *read_resize, ReadStats *stats, ERL_NIF_TERM *ret) {
+    QoiHeader header;
+
+    if ((desired_channels != 0 && desired_channels != 3 && desired_channels != 4) ||
+        !resize_rows_supported(&read_resize->options) || !qoi_read_header(data, size, &header) ||
+        header.width > STBI_MAX_DIMENSIONS || header.height > STBI_MAX_DIMENSIONS) {
+        return false;
+    }
+
+    QoiRows rows = {0};
+    rows.data = data;
+    rows.size = size;
+    rows.width = (int)header.width;
+    rows.channels = desired_channels != 0 ? desired_channels : header.channels;
+    qoi_decoder_init(&rows.decoder, data, size);
+
+    RowSource source = {.decoder = &rows, .read = qoi_rows_read, .rewind = qoi_rows_rewind};
+    *ret = resize_rows(env, &source, rows.width, (int)header.height, rows.channels, STBIR_TYPE_UINT8, read_resize, stats);
+    return true;
+}
+
+// Where the decoders streaming rows read an encoded image from: a binary,
+// read through callbacks past 2GiB like binary_load does, or a file from
+// `start`
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    BinaryReader reader;
+    FILE *file;
+    int64_t start;
+} ImageSource;
+
+// Starts `s` at the beginning of the image
+static void image_source_start(ImageSource *image, stbi__context *s) {
+    if (image->file != NULL) {
+        file_seek(image->file, image->start, SEEK_SET);
+        stbi__start_file(s, image->file);
+    } else if (image->size <= INT_MAX) {
+        stbi__start_mem(s, image->data, (int)image->size);
+    } else {
+        image->reader = (BinaryReader){image->data, image->size, 0};
+        stbi__start_callbacks(s, (stbi_io_callbacks *)&binary_reader_callbacks, &image->reader);
+    }
+}
+
+typedef struct {
+    PngReader reader;
+    stbi__context s;
+    ImageSource *image;
+    int desired_channels;
+    bool want_16;
+} PngRows;
+
+static bool png_rows_read(void *decoder, unsigned char *row) {
+    return png_reader_read(&((PngRows *)decoder)->reader, row);
+}
+
+static bool png_rows_rewind(void *decoder) {
+    PngRows *rows = (PngRows *)decoder;
+    png_reader_close(&rows->reader);
+    image_source_start(rows->image, &rows->s);
+    return png_reader_open(&rows->reader, &rows->s, rows->desired_channels, rows->want_16);
+}
+
+typedef struct {
+    JpegReader reader;
+    stbi__context s;
+    ImageSource *image;
+    int desired_channels;
+} JpegRows;
+
+static bool jpeg_rows_read(void *decoder, unsigned char *row) {
+    return jpeg_reader_read(&((JpegRows *)decoder)->reader, row);
+}
+
+static bool jpeg_rows_rewind(void *decoder) {
+    JpegRows *rows = (JpegRows *)decoder;
+    jpeg_reader_close(&rows->reader);
+    image_source_start(rows->image, &rows->s);
+    return jpeg_reader_open(&rows->reader, &rows->s, rows->desired_channels);
+}
+
+// Resizes a PNG or JPEG image while decoding it, see png_reader.h and
+// jpeg_reader.h. Returns false, without touching `ret`, when the image or
+// options need the whole image in memory.
+static bool resize_image_rows(ErlNifEnv *env, ImageSource *image, const char *format, int desired_channels, int bit_depth, const ReadResize *read_resize, ReadStats *stats, ERL_NIF_TERM *ret) {
+    if (!resize_rows_supported(&read_resize->options)) {
+        return false;
+    }
+
+    if (strcmp(format, "png") == 0) {
+        PngRows rows = {.image = image, .desired_channels = desired_channels, .want_16 = bit_depth == 16};
+        image_source_start(image, &rows.s);
+        if (!png_reader_open(&rows.reader, &rows.s, desired_channels, rows.want_16)) {
+            return false;
+        }
+        int input_type = rows.reader.is_16 ? STBIR_TYPE_UINT16 : STBIR_TYPE_UINT8;
+        RowSource source = {.decoder = &rows, .read = png_rows_read, .rewind = png_rows_rewind};
+        *ret = resize_rows(env, &source, (int)rows.reader.width, (int)rows.reader.height, rows.reader.channels, input_type, read_resize, stats);
+        png_reader_close(&rows.reader);
+        return true;
+    }
+
+    if (strcmp(format, "jpg") == 0) {
+        JpegRows rows = {.image = image, .desired_channels = desired_channels};
+        image_source_start(image, &rows.s);
+        if (!jpeg_reader_open(&rows.reader, &rows.s, desired_channels)) {
+            return false;
+        }
+        int channels = rows.reader.channels;
+        // jpeg_reader_read writes a byte past the row
+        RowSource source = {.decoder = &rows, .read = jpeg_rows_read, .rewind = jpeg_rows_rewind,
+                            .stride = (size_t)rows.s.img_x * channels + 1};
+        *ret = resize_rows(env, &source, (int)rows.s.img_x, (int)rows.s.img_y, channels, STBIR_TYPE_UINT8, read_resize, stats);
+        jpeg_reader_close(&rows.reader);
+        return true;
+    }
+
+    return false;
+}
+
 static ERL_NIF_TERM read_file(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     char * c_path = NULL;
     ErlNifBinary path;
-    int desired_channels = 0, bytes_per_channel;
-    
+    int desired_channels = 0, bit_depth, bytes_per_channel;
+    ReadResize read_resize;
+    ReadLimits limits;
+    ReadStats stats = {0};
+    bool streamed = false;
+
     ERL_NIF_TERM ret;
 
     if (!enif_inspect_binary(env, argv[0], &path)) {
@@ -62,6 +726,15 @@ static ERL_NIF_TERM read_file(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[
     if(!enif_get_int(env, argv[1], &desired_channels)) {
         return error(env, "invalid channels");
     }
+    if(!enif_get_int(env, argv[2], &bit_depth)) {
+        return error(env, "invalid bit depth");
+    }
+    if (!get_read_resize(env, argv[3], &read_resize)) {
+        return error(env, "invalid resize");
+    }
+    if (!get_read_limits(env, argv[4], &limits)) {
+        return error(env, "invalid limits");
+    }
 
     c_path = enif_alloc(path.size + 1);
     memcpy(c_path, path.data, path.size);
@@ -76,20 +749,64 @@ static ERL_NIF_TERM read_file(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[
         goto free_c_path;
     }
 
-    if (stbi_is_hdr_from_file(f)) {
+    unsigned char magic[16];
+    size_t magic_size = read_magic(f, magic, sizeof(magic));
+    stats.format = image_format(magic, magic_size);
+    stats.bytes = file_size(f);
+
+    ImageInfo info;
+    if ((limits.max_pixels > 0 || limits.max_bytes > 0) && image_info_from_file(f, magic, magic_size, &info)) {
+        const char *reason = check_read_limits(&limits, stats.format, &info, desired_channels, bit_depth);
+        if (reason != NULL) {
+            fclose(f);
+            ret = error(env, reason);
+            goto free_c_path;
+        }
+    }
+
+    ErlNifTime start = timings_now();
+
+    if (read_resize.enabled) {
+        ImageSource image = {.file = f, .start = file_tell(f)};
+        streamed = resize_image_rows(env, &image, stats.format, desired_channels, bit_depth, &read_resize, &stats, &ret);
+        file_seek(f, image.start, SEEK_SET);
+    }
+
+    if (streamed) {
+        data = NULL;
+    } else if (strcmp(stats.format, "qoi") == 0) {
+        size_t size = 0;
+        bool handled;
+        unsigned char *contents = read_whole_file(f, &size);
+        if (contents != NULL && read_resize.enabled) {
+            streamed = resize_qoi_rows(env, contents, size, desired_channels, &read_resize, &stats, &ret);
+        }
+        data = contents && !streamed ? load_native_from_memory(contents, size, &x, &y, &n, desired_channels, &handled) : NULL;
+        bytes_per_channel = 1;
+        enif_free(contents);
+    } else if (stbi_is_hdr_from_file(f)) {
         data = (unsigned char *)stbi_loadf_from_file(f, &x, &y, &n, desired_channels);
         bytes_per_channel = 4;
+    } else if (bit_depth == 16 && stbi_is_16_bit_from_file(f)) {
+        data = (unsigned char *)stbi_load_from_file_16(f, &x, &y, &n, desired_channels);
+        bytes_per_channel = 2;
     } else {
         data = (unsigned char *)stbi_load_from_file(f, &x, &y, &n, desired_channels);
         bytes_per_channel = 1;
     }
 
+    if (!streamed) {
+        timings_add(&stats.timings, PHASE_DECODE, start);
+    }
+
     if (desired_channels > 0) {
-        if (n >= desired_channels) {
-            n = desired_channels;
-        }
+        n = desired_channels;
+    }
+    if (read_resize.enabled && !streamed) {
+        ret = resize_decoded(env, data, x, y, n, bytes_per_channel, &read_resize, &stats);
+    } else if (!streamed) {
+        ret = pack_data(env, data, x, y, n, bytes_per_channel, &stats);
     }
-    ret = pack_data(env, data, x, y, n, bytes_per_channel);
 
     fclose(f);
     STBI_FREE((void *)data);
@@ -102,9 +819,13 @@ free_c_path:
 
 static ERL_NIF_TERM read_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     ErlNifBinary binary;
-    int desired_channels, bytes_per_channel;
+    int desired_channels, bit_depth, bytes_per_channel;
     int x, y, n;
     unsigned char *data;
+    ReadResize read_resize;
+    ReadLimits limits;
+    ReadStats stats = {0};
+    ERL_NIF_TERM ret;
 
     if (!enif_inspect_binary(env, argv[0], &binary)) {
         return error(env, "invalid binary");
@@ -112,16 +833,62 @@ static ERL_NIF_TERM read_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM arg
     if(!enif_get_int(env, argv[1], &desired_channels)) {
         return error(env, "invalid channels");
     }
+    if(!enif_get_int(env, argv[2], &bit_depth)) {
+        return error(env, "invalid bit depth");
+    }
+    if (!get_read_resize(env, argv[3], &read_resize)) {
+        return error(env, "invalid resize");
+    }
+    if (!get_read_limits(env, argv[4], &limits)) {
+        return error(env, "invalid limits");
+    }
+
+    stats.format = image_format(binary.data, binary.size);
+    stats.bytes = binary.size;
+
+    ImageInfo info;
+    if ((limits.max_pixels > 0 || limits.max_bytes > 0) && image_info_from_memory(binary.data, binary.size, &info)) {
+        const char *reason = check_read_limits(&limits, stats.format, &info, desired_channels, bit_depth);
+        if (reason != NULL) {
+            return error(env, reason);
+        }
+    }
+
+    if (read_resize.enabled) {
+        ImageSource image = {.data = binary.data, .size = binary.size};
+        if ((qoi_is_qoi(binary.data, binary.size) &&
+             resize_qoi_rows(env, binary.data, binary.size, desired_channels, &read_resize, &stats, &ret)) ||
+            resize_image_rows(env, &image, stats.format, desired_channels, bit_depth, &read_resize, &stats, &ret)) {
+            return ret;
+        }
+    }
 
-    if (stbi_is_hdr_from_memory(binary.data, (int)binary.size)) {
-        data = (unsigned char *)stbi_loadf_from_memory(binary.data, (int)binary.size, &x, &y, &n, desired_channels);
+    ErlNifTime start = timings_now();
+    bool handled;
+    data = load_native_from_memory(binary.data, binary.size, &x, &y, &n, desired_channels, &handled);
+    if (handled) {
+        bytes_per_channel = 1;
+    } else if (binary_is_hdr(binary.data, binary.size)) {
+        data = (unsigned char *)binary_loadf(binary.data, binary.size, &x, &y, &n, desired_channels);
         bytes_per_channel = 4;
+    } else if (bit_depth == 16 && binary_is_16_bit(binary.data, binary.size)) {
+        data = (unsigned char *)binary_load_16(binary.data, binary.size, &x, &y, &n, desired_channels);
+        bytes_per_channel = 2;
     } else {
-        data = (unsigned char *)stbi_load_from_memory(binary.data, (int)binary.size, &x, &y, &n, desired_channels);
+        data = (unsigned char *)binary_load(binary.data, binary.size, &x, &y, &n, desired_channels);
         bytes_per_channel = 1;
     }
 
-    ERL_NIF_TERM ret = pack_data(env, data, x, y, n, bytes_per_channel);
+    timings_add(&stats.timings, PHASE_DECODE, start);
+
+    if (desired_channels > 0) {
+        n = desired_channels;
+    }
+    if (read_resize.enabled) {
+        ret = resize_decoded(env, data, x, y, n, bytes_per_channel, &read_resize, &stats);
+    } else {
+        ret = pack_data(env, data, x, y, n, bytes_per_channel, &stats);
+    }
     STBI_FREE((void *)data);
     return ret;
 }
@@ -133,18 +900,26 @@ static ERL_NIF_TERM read_gif_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM
         int x, y, z, comp;
         int *delays = NULL;
         unsigned char *data = NULL;
+        // stb_image has no callbacks for animated GIFs
+        if (binary.size > INT_MAX) {
+            return error(env, "GIF files over 2GiB are not supported");
+        }
+        Timings timings = {0};
+        ErlNifTime phase_start = timings_now();
         // the parameter req_comp (the last one) seems to be not in use, see stb_image.h:6706
         data = stbi_load_gif_from_memory(binary.data, (int)binary.size, &delays, &x, &y, &z, &comp, 0);
         if (!data) {
             return error(env, "cannot decode the given GIF file");
         }
+        timings_add(&timings, PHASE_DECODE, phase_start);
+        phase_start = timings_now();
 
         ERL_NIF_TERM *delays_term = (ERL_NIF_TERM *)enif_alloc(sizeof(ERL_NIF_TERM) * z);
         ERL_NIF_TERM *frames_term = (ERL_NIF_TERM *)enif_alloc(sizeof(ERL_NIF_TERM) * z);
         ErlNifBinary *frames_result = (ErlNifBinary *)enif_alloc(sizeof(ErlNifBinary) * z);
         bool ok = true;
         unsigned char *start = data;
-        size_t frame_size = x * y * sizeof(unsigned char) * 4;
+        size_t frame_size = (size_t)x * y * sizeof(unsigned char) * 4;
         for (int i = 0; i < z; ++i) {
             if (enif_alloc_binary(frame_size, &frames_result[i])) {
                 memcpy(frames_result[i].data, start, frames_result[i].size);
@@ -171,16 +946,22 @@ static ERL_NIF_TERM read_gif_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM
             return error(env, "out of memory");
         }
 
+        timings_add(&timings, PHASE_COPY, phase_start);
+        ERL_NIF_TERM info = enif_make_new_map(env);
+        enif_make_map_put(env, info, enif_make_atom(env, "format"), enif_make_atom(env, "gif"), &info);
+        enif_make_map_put(env, info, enif_make_atom(env, "bytes"), enif_make_uint64(env, (ErlNifUInt64)binary.size), &info);
+
         ERL_NIF_TERM frames_ret = enif_make_list_from_array(env, frames_term, z);
         ERL_NIF_TERM delays_ret = enif_make_list_from_array(env, delays_term, z);
-        ERL_NIF_TERM ret_val = enif_make_tuple4(env,
+        ERL_NIF_TERM ret_val = enif_make_tuple5(env,
                                                 enif_make_atom(env, "ok"),
                                                 frames_ret,
                                                 enif_make_tuple3(env,
                                                                  enif_make_int(env, y),
                                                                  enif_make_int(env, x),
                                                                  enif_make_int(env, 4)),
-                                                delays_ret);
+                                                delays_ret,
+                                                memory_put(env, timings_put(env, &timings, info)));
         STBI_FREE((void *)data);
         STBI_FREE((void *)delays);
         enif_free((void *)frames_term);
@@ -192,21 +973,126 @@ static ERL_NIF_TERM read_gif_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM
     }
 }
 
-static ERL_NIF_TERM write_file(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
-    char * c_path = NULL;
-    char format[MAX_EXTNAME_LENGTH];
-    ErlNifBinary path;
-    ErlNifBinary result;
-    int w, h, comp;
+static bool get_jpeg_options(ErlNifEnv *env, ERL_NIF_TERM options, JpegOptions *jpeg_options) {
+    int optimize_huffman = 0;
 
-    if (!enif_inspect_binary(env, argv[0], &path)) {
-        return error(env, "invalid path");
+    jpeg_options->quality = 100;
+    jpeg_options->subsampling = JPEG_SUBSAMPLING_AUTO;
+    jpeg_options->restart_rows = 0;
+    jpeg_options->threads = 1;
+
+    bool ok = get_int_option(env, options, "quality", &jpeg_options->quality) &&
+              get_int_option(env, options, "subsampling", &jpeg_options->subsampling) &&
+              get_int_option(env, options, "restart_interval", &jpeg_options->restart_rows) &&
+              get_int_option(env, options, "threads", &jpeg_options->threads) &&
+              get_int_option(env, options, "optimize_huffman", &optimize_huffman);
+
+    jpeg_options->optimize_huffman = optimize_huffman != 0;
+    return ok;
+}
+
+// Writes encoded chunks to a file, counting their size
+typedef struct {
+    FILE *file;
+    size_t size;
+    bool failed;
+} FileSink;
+
+static bool file_sink_open(FileSink *sink, const char *path) {
+    sink->file = stbiw__fopen(path, "wb");
+    sink->size = 0;
+    sink->failed = sink->file == NULL;
+    return !sink->failed;
+}
+
+// Writes in chunks, as some C runtimes mishandle a single fwrite over 2GiB
+static void file_sink_write_sized(FileSink *sink, const unsigned char *data, size_t size) {
+    sink->size += size;
+    while (!sink->failed && size > 0) {
+        size_t chunk = size < INT_MAX ? size : INT_MAX;
+        if (fwrite(data, 1, chunk, sink->file) != chunk) {
+            sink->failed = true;
+        }
+        data += chunk;
+        size -= chunk;
     }
-    if (!enif_get_atom(env, argv[1], format, sizeof(format), ERL_NIF_LATIN1)) {
-        return error(env, "invalid format");
+}
+
+// The callback of stb_image_write, which never writes over INT_MAX at once
+static void file_sink_write(void *context, void *data, int size) {
+    file_sink_write_sized((FileSink *)context, (const unsigned char *)data, (size_t)size);
+}
+
+// Closes the file, returning whether everything was written
+static bool file_sink_close(FileSink *sink) {
+    if (sink->file != NULL && fclose(sink->file) != 0) {
+        sink->failed = true;
     }
-    if (!enif_inspect_binary(env, argv[2], &result)) {
-        return error(env, "invalid binary data");
+    sink->file = NULL;
+    return !sink->failed;
+}
+
+static bool write_buffer_to_file(const char *path, const void *data, size_t size, FileSink *sink) {
+    if (file_sink_open(sink, path)) {
+        file_sink_write_sized(sink, (const unsigned char *)data, size);
+    }
+    return file_sink_close(sink);
+}
+
+// Encodes a whole image with the incremental PNG writer, which unlike
+// stb_image_write supports 16-bit images and images over INT_MAX samples.
+static bool png_write_image(const unsigned char *data, int w, int h, int comp, int bit_depth, PngSink sink, void *context) {
+    PngWriter writer;
+    if (w <= 0 || h <= 0 || !png_writer_init(&writer, (uint32_t)w, (uint32_t)h, comp, bit_depth, sink, context)) {
+        return false;
+    }
+    bool ok = png_writer_push_rows(&writer, data, (uint32_t)h) && png_writer_finish(&writer);
+    png_writer_free(&writer);
+    return ok;
+}
+
+static bool png_stdio_sink(void *context, const unsigned char *data, size_t size) {
+    file_sink_write_sized((FileSink *)context, data, size);
+    return !((FileSink *)context)->failed;
+}
+
+static int png_bit_depth(ErlNifEnv *env, ERL_NIF_TERM options) {
+    int bit_depth = 8;
+    return get_int_option(env, options, "bit_depth", &bit_depth) ? bit_depth : 0;
+}
+
+// stb_image_write indexes pixels with int arithmetic, so the images it
+// encodes must have fewer than INT_MAX samples
+static bool stbiw_fits(int w, int h, int comp) {
+    return ((uint64_t)w * comp + 1) * h <= INT_MAX;
+}
+
+static bool stbiw_supports_size(const char *format, int w, int h, int comp) {
+    bool stbiw = strcmp(format, "bmp") == 0 || strcmp(format, "tga") == 0 || strcmp(format, "hdr") == 0;
+    return !stbiw || stbiw_fits(w, h, comp);
+}
+
+// Encodes that run in a single call use stb_image_write for the PNGs it
+// supports, and png_write_image for the others
+static bool png_uses_stbiw(ErlNifEnv *env, ERL_NIF_TERM options, int w, int h, int comp) {
+    return png_bit_depth(env, options) == 8 && stbiw_fits(w, h, comp);
+}
+
+static ERL_NIF_TERM write_file(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    char * c_path = NULL;
+    char format[MAX_EXTNAME_LENGTH];
+    ErlNifBinary path;
+    ErlNifBinary result;
+    int w, h, comp;
+
+    if (!enif_inspect_binary(env, argv[0], &path)) {
+        return error(env, "invalid path");
+    }
+    if (!enif_get_atom(env, argv[1], format, sizeof(format), ERL_NIF_LATIN1)) {
+        return error(env, "invalid format");
+    }
+    if (!enif_inspect_binary(env, argv[2], &result)) {
+        return error(env, "invalid binary data");
     }
     if (!enif_get_int(env, argv[3], &h)) {
         return error(env, "invalid height");
@@ -217,43 +1103,86 @@ static ERL_NIF_TERM write_file(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv
     if (!enif_get_int(env, argv[5], &comp)) {
         return error(env, "invalid number of channels");
     }
+    if (!enif_is_map(env, argv[6])) {
+        return error(env, "invalid options");
+    }
+    if (!stbiw_supports_size(format, w, h, comp)) {
+        return error(env, "image too large for format");
+    }
 
     c_path = enif_alloc(path.size + 1);
     memcpy(c_path, path.data, path.size);
     c_path[path.size] = '\0';
 
+    // Encoders write straight to the file, so encoding includes writing
+    FileSink sink = { .file = NULL, .size = 0, .failed = false };
+    Timings timings = {0};
+    ErlNifTime start = timings_now();
+
     ERL_NIF_TERM ret = enif_make_atom(env, "ok");
-    if (strcmp(format, "png") == 0) {
+    if (strcmp(format, "png") == 0 && png_uses_stbiw(env, argv[6], w, h, comp)) {
         int stride_in_bytes = 0;
-        int status = stbi_write_png(c_path, w, h, comp, result.data, stride_in_bytes);
-        if (!status) {
+        int status = file_sink_open(&sink, c_path) && stbi_write_png_to_func(file_sink_write, &sink, w, h, comp, result.data, stride_in_bytes);
+        if (!file_sink_close(&sink) || !status) {
+            ret = error(env, "failed to write png");
+        }
+    } else if (strcmp(format, "png") == 0) {
+        bool ok = file_sink_open(&sink, c_path) && png_write_image(result.data, w, h, comp, png_bit_depth(env, argv[6]), png_stdio_sink, &sink);
+        if (!file_sink_close(&sink) || !ok) {
             ret = error(env, "failed to write png");
         }
     } else if (strcmp(format, "bmp") == 0) {
-        int status = stbi_write_bmp(c_path, w, h, comp, result.data);
-        if (!status) {
+        int status = file_sink_open(&sink, c_path) && stbi_write_bmp_to_func(file_sink_write, &sink, w, h, comp, result.data);
+        if (!file_sink_close(&sink) || !status) {
             ret = error(env, "failed to write bmp");
         }
     } else if (strcmp(format, "tga") == 0) {
-        int status = stbi_write_tga(c_path, w, h, comp, result.data);
-        if (!status) {
+        int status = file_sink_open(&sink, c_path) && stbi_write_tga_to_func(file_sink_write, &sink, w, h, comp, result.data);
+        if (!file_sink_close(&sink) || !status) {
             ret = error(env, "failed to write tga");
         }
     } else if (strcmp(format, "jpg") == 0) {
-        int quality = 100;
-        int status = stbi_write_jpg(c_path, w, h, comp, result.data, quality);
-        if (!status) {
+        JpegOptions jpeg_options;
+        JpegBuffer buffer = { .data = NULL, .size = 0, .capacity = 0, .out_of_memory = false };
+        if (!get_jpeg_options(env, argv[6], &jpeg_options)) {
+            ret = error(env, "invalid jpg options");
+        } else if (!jpeg_encode(&buffer, w, h, comp, result.data, &jpeg_options) ||
+                   !write_buffer_to_file(c_path, buffer.data, buffer.size, &sink)) {
             ret = error(env, "failed to write jpg");
         }
+        jpeg_buffer_free(&buffer);
     } else if (strcmp(format, "hdr") == 0) {
-        int status = stbi_write_hdr(c_path, w, h, comp, (float*)result.data);
-        if (!status) {
+        int status = file_sink_open(&sink, c_path) && stbi_write_hdr_to_func(file_sink_write, &sink, w, h, comp, (float*)result.data);
+        if (!file_sink_close(&sink) || !status) {
             ret = error(env, "failed to write hdr");
         }
+    } else if (strcmp(format, "qoi") == 0) {
+        size_t max_size = w > 0 && h > 0 ? qoi_max_size(w, h, comp) : 0;
+        unsigned char *buffer = NULL;
+        if (comp != 3 && comp != 4) {
+            ret = error(env, "qoi only supports 3 or 4 channels");
+        } else if (max_size == 0) {
+            ret = error(env, "failed to write qoi");
+        } else if ((buffer = enif_alloc(max_size)) == NULL) {
+            ret = error(env, "out of memory");
+        } else {
+            size_t size = qoi_encode(result.data, w, h, comp, buffer);
+            if (!write_buffer_to_file(c_path, buffer, size, &sink)) {
+                ret = error(env, "failed to write qoi");
+            }
+            enif_free(buffer);
+        }
     } else {
         ret = error(env, "wrong format");
     }
 
+    if (enif_is_atom(env, ret)) {
+        timings_add(&timings, PHASE_ENCODE, start);
+        ERL_NIF_TERM info = enif_make_new_map(env);
+        enif_make_map_put(env, info, enif_make_atom(env, "bytes"), enif_make_uint64(env, (ErlNifUInt64)sink.size), &info);
+        ret = enif_make_tuple2(env, ret, memory_put(env, timings_put(env, &timings, info)));
+    }
+
     enif_free((void *)c_path);
     return ret;
 }
@@ -304,7 +1233,21 @@ static void write_chunk(void *context_, void *data, int size) {
     context->size += size;
 }
 
-static void finalize_write(WriteContext *context, ErlNifEnv *env, ERL_NIF_TERM *binary) {
+static void write_context_free(WriteContext *context) {
+    WriteChunk *chunk = context->head;
+    WriteChunk *next = NULL;
+
+    while (chunk != NULL) {
+        next = chunk->next;
+        enif_free(chunk->data);
+        enif_free(chunk);
+        chunk = next;
+    }
+    context->head = context->last = NULL;
+}
+
+static void finalize_write(WriteContext *context, ErlNifEnv *env, ERL_NIF_TERM *binary, Timings *timings) {
+    ErlNifTime start = timings_now();
     if (!context->out_of_memory) {
         char *buffer = (char *)enif_make_new_binary(env, context->size, binary);
 
@@ -318,15 +1261,13 @@ static void finalize_write(WriteContext *context, ErlNifEnv *env, ERL_NIF_TERM *
         }
     }
 
-    WriteChunk *chunk = context->head;
-    WriteChunk *next = NULL;
+    write_context_free(context);
+    timings_add(timings, PHASE_COPY, start);
+}
 
-    while (chunk != NULL) {
-        next = chunk->next;
-        enif_free(chunk->data);
-        enif_free(chunk);
-        chunk = next;
-    }
+static bool png_chunk_sink(void *context, const unsigned char *data, size_t size) {
+    write_chunk(context, (void *)data, (int)size);
+    return !((WriteContext *)context)->out_of_memory;
 }
 
 static ERL_NIF_TERM to_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
@@ -349,44 +1290,96 @@ static ERL_NIF_TERM to_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[
     if (!enif_get_int(env, argv[4], &comp)) {
         return error(env, "invalid number of channels");
     }
+    if (!enif_is_map(env, argv[5])) {
+        return error(env, "invalid options");
+    }
+    if (!stbiw_supports_size(format, w, h, comp)) {
+        return error(env, "image too large for format");
+    }
 
     // The write_chunk function is called multiple times with subsequent
     // data chunks, we create a list of those and join afterwards
     WriteContext context = { .head = NULL, .last = NULL, .size = 0, .out_of_memory = false };
     ERL_NIF_TERM binary;
+    Timings timings = {0};
+    ErlNifTime start = timings_now();
 
-    if (strcmp(format, "png") == 0) {
+    if (strcmp(format, "png") == 0 && png_uses_stbiw(env, argv[5], w, h, comp)) {
         int stride_in_bytes = 0;
         int status = stbi_write_png_to_func(write_chunk, (void*) &context, w, h, comp, img.data, stride_in_bytes);
-        finalize_write(&context, env, &binary);
+        finalize_write(&context, env, &binary, &timings);
         if (!status) {
             return error(env, "failed to write png");
         }
+    } else if (strcmp(format, "png") == 0) {
+        bool ok = png_write_image(img.data, w, h, comp, png_bit_depth(env, argv[5]), png_chunk_sink, &context);
+        finalize_write(&context, env, &binary, &timings);
+        if (!ok) {
+            return error(env, "failed to write png");
+        }
     } else if (strcmp(format, "bmp") == 0) {
         int status = stbi_write_bmp_to_func(write_chunk, (void*) &context, w, h, comp, img.data);
-        finalize_write(&context, env, &binary);
+        finalize_write(&context, env, &binary, &timings);
         if (!status) {
             return error(env, "failed to write bmp");
         }
     } else if (strcmp(format, "tga") == 0) {
         int status = stbi_write_tga_to_func(write_chunk, (void*) &context, w, h, comp, img.data);
-        finalize_write(&context, env, &binary);
+        finalize_write(&context, env, &binary, &timings);
         if (!status) {
             return error(env, "failed to write tga");
         }
     } else if (strcmp(format, "jpg") == 0) {
-        int quality = 100;
-        int status = stbi_write_jpg_to_func(write_chunk, (void*) &context, w, h, comp, img.data, quality);
-        finalize_write(&context, env, &binary);
-        if (!status) {
+        JpegOptions jpeg_options;
+        JpegBuffer buffer = { .data = NULL, .size = 0, .capacity = 0, .out_of_memory = false };
+        if (!get_jpeg_options(env, argv[5], &jpeg_options)) {
+            return error(env, "invalid jpg options");
+        }
+        bool status = jpeg_encode(&buffer, w, h, comp, img.data, &jpeg_options);
+        if (status) {
+            ErlNifTime copy_start = timings_now();
+            unsigned char *data = enif_make_new_binary(env, buffer.size, &binary);
+            if (data == NULL) {
+                context.out_of_memory = true;
+            } else {
+                memcpy(data, buffer.data, buffer.size);
+            }
+            timings_add(&timings, PHASE_COPY, copy_start);
+        } else {
+            context.out_of_memory = buffer.out_of_memory;
+        }
+        jpeg_buffer_free(&buffer);
+        if (!status && !context.out_of_memory) {
             return error(env, "failed to write jpg");
         }
     } else if (strcmp(format, "hdr") == 0) {
         int status = stbi_write_hdr_to_func(write_chunk, (void*) &context, w, h, comp, (float*)img.data);
-        finalize_write(&context, env, &binary);
+        finalize_write(&context, env, &binary, &timings);
         if (!status) {
             return error(env, "failed to write hdr");
         }
+    } else if (strcmp(format, "qoi") == 0) {
+        ErlNifBinary encoded;
+        size_t max_size = w > 0 && h > 0 ? qoi_max_size(w, h, comp) : 0;
+        if (comp != 3 && comp != 4) {
+            return error(env, "qoi only supports 3 or 4 channels");
+        }
+        if (max_size == 0) {
+            return error(env, "failed to write qoi");
+        }
+        ErlNifTime alloc_start = timings_now();
+        if (!enif_alloc_binary(max_size, &encoded)) {
+            return error(env, "out of memory");
+        }
+        timings_add(&timings, PHASE_ALLOC, alloc_start);
+        size_t size = qoi_encode(img.data, w, h, comp, encoded.data);
+        alloc_start = timings_now();
+        if (!enif_realloc_binary(&encoded, size)) {
+            enif_release_binary(&encoded);
+            return error(env, "out of memory");
+        }
+        timings_add(&timings, PHASE_ALLOC, alloc_start);
+        binary = enif_make_binary(env, &encoded);
     } else {
         return error(env, "wrong format");
     }
@@ -395,79 +1388,1338 @@ static ERL_NIF_TERM to_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[
         return error(env, "out of memory");
     }
 
-    return enif_make_tuple2(env, enif_make_atom(env, "ok"), binary);
+    // Encoding is everything but copying and allocating the result
+    timings.phases[PHASE_ENCODE] = timings_now() - start - timings.phases[PHASE_COPY] - timings.phases[PHASE_ALLOC];
+    ERL_NIF_TERM stats = memory_put(env, timings_put(env, &timings, enif_make_new_map(env)));
+    return enif_make_tuple3(env, enif_make_atom(env, "ok"), binary, stats);
 }
 
-static ERL_NIF_TERM resize(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]){
-    ErlNifBinary input_pixels;
-    int input_h, input_w, output_h, output_w, num_channels, bytes_per_channel;
-    int stride_in_bytes = 0;
+// Calls of png_slice, jpeg_slice and resize_slice that did some work, and
+// the operations they stopped because the caller had exited
+static int64_t slices_run = 0;
+static int64_t slices_stopped = 0;
 
-    if (!enif_inspect_binary(env, argv[0], &input_pixels)) {
-        return error(env, "invalid image");
+static ERL_NIF_TERM slice_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ERL_NIF_TERM map = enif_make_new_map(env);
+    enif_make_map_put(env, map, enif_make_atom(env, "slices"), enif_make_int64(env, memory_atomic_load(&slices_run)), &map);
+    enif_make_map_put(env, map, enif_make_atom(env, "stopped"), enif_make_int64(env, memory_atomic_load(&slices_stopped)), &map);
+    return map;
+}
+
+// PNGs of large images are encoded PNG_SLICE_BYTES of pixels, around 50ms
+// of work, per call of png_slice
+#define PNG_SLICE_BYTES (4 * 1024 * 1024)
+
+typedef struct {
+    PngWriter writer;
+    bool open;
+    WriteContext context;
+    Timings timings;
+    MemoryScope scope;
+} PngTask;
+
+static ErlNifResourceType *png_task_type = NULL;
+
+static void png_task_release(PngTask *task) {
+    if (task->open) {
+        png_writer_free(&task->writer);
+        task->open = false;
     }
-    if(!enif_get_int(env, argv[1], &input_h)) {
-        return error(env, "invalid input height");
+    write_context_free(&task->context);
+}
+
+static void png_task_dtor(ErlNifEnv *env, void *obj) {
+    png_task_release((PngTask *)obj);
+}
+
+// Encodes the next rows, then reschedules itself until the image is done.
+// Stops early once the calling process has exited. Called with the image
+// binary and the task.
+static ERL_NIF_TERM png_slice(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary img;
+    PngTask *task;
+
+    if (!enif_inspect_binary(env, argv[0], &img) || !enif_get_resource(env, argv[1], png_task_type, (void **)&task)) {
+        return enif_make_badarg(env);
     }
-    if(!enif_get_int(env, argv[2], &input_w)) {
-        return error(env, "invalid input width");
+
+    memory_scope_resume(&task->scope);
+    ERL_NIF_TERM ret;
+
+    if (!enif_is_current_process_alive(env)) {
+        png_task_release(task);
+        memory_atomic_add(&slices_stopped, 1);
+        ret = error(env, "process exited");
+    } else {
+        memory_atomic_add(&slices_run, 1);
+        PngWriter *writer = &task->writer;
+        uint32_t rows = writer->height - writer->rows_written;
+        size_t slice_rows = PNG_SLICE_BYTES / writer->row_bytes;
+        rows = slice_rows < 1 ? 1 : slice_rows < rows ? (uint32_t)slice_rows : rows;
+
+        ErlNifTime start = timings_now();
+        bool ok = png_writer_push_rows(writer, img.data + (size_t)writer->rows_written * writer->row_bytes, rows);
+        bool done = ok && writer->rows_written == writer->height;
+        if (done) {
+            ok = png_writer_finish(writer);
+        }
+        timings_add(&task->timings, PHASE_ENCODE, start);
+
+        if (!ok) {
+            bool out_of_memory = task->context.out_of_memory;
+            png_task_release(task);
+            ret = error(env, out_of_memory ? "out of memory" : "failed to write png");
+        } else if (!done) {
+            ret = enif_schedule_nif(env, "to_binary", ERL_NIF_DIRTY_JOB_CPU_BOUND, png_slice, argc, argv);
+        } else {
+            ERL_NIF_TERM binary;
+            finalize_write(&task->context, env, &binary, &task->timings);
+            png_task_release(task);
+            if (task->context.out_of_memory) {
+                ret = error(env, "out of memory");
+            } else {
+                ERL_NIF_TERM stats = memory_put(env, timings_put(env, &task->timings, enif_make_new_map(env)));
+                ret = enif_make_tuple3(env, enif_make_atom(env, "ok"), binary, stats);
+            }
+        }
+    }
+
+    memory_scope_exit(&task->scope);
+    return ret;
+}
+
+// Same as to_binary for PNGs, but leaves encoding the rows to png_slice.
+// The incremental writer compresses differently from stb_image_write, so
+// the PNG decodes to the same pixels but has other bytes.
+static ERL_NIF_TERM png_start(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary img;
+    int w, h, comp;
+
+    if (!enif_inspect_binary(env, argv[1], &img)) {
+        return error(env, "invalid binary data");
     }
-    if(!enif_get_int(env, argv[3], &num_channels)) {
+    if (!enif_get_int(env, argv[2], &h)) {
+        return error(env, "invalid height");
+    }
+    if (!enif_get_int(env, argv[3], &w)) {
+        return error(env, "invalid width");
+    }
+    if (!enif_get_int(env, argv[4], &comp)) {
         return error(env, "invalid number of channels");
     }
-    if(!enif_get_int(env, argv[4], &output_h)) {
-        return error(env, "invalid output height");
+    if (!enif_is_map(env, argv[5])) {
+        return error(env, "invalid options");
     }
-    if(!enif_get_int(env, argv[5], &output_w)) {
-        return error(env, "invalid output width");
+
+    PngTask *task = enif_alloc_resource(png_task_type, sizeof(PngTask));
+    if (task == NULL) {
+        return error(env, "out of memory");
     }
-    if(!enif_get_int(env, argv[6], &bytes_per_channel)) {
-        return error(env, "invalid bytes per channel");
+    memset(task, 0, sizeof(PngTask));
+    memory_scope_enter(&task->scope);
+
+    ErlNifTime start = timings_now();
+    task->open = w > 0 && h > 0 &&
+                 png_writer_init(&task->writer, (uint32_t)w, (uint32_t)h, comp, png_bit_depth(env, argv[5]), png_chunk_sink, &task->context);
+    timings_add(&task->timings, PHASE_ENCODE, start);
+
+    ERL_NIF_TERM ret;
+    if (!task->open) {
+        ret = error(env, "failed to write png");
+    } else {
+        ERL_NIF_TERM slice_argv[2] = {argv[1], enif_make_resource(env, task)};
+        ret = enif_schedule_nif(env, "to_binary", ERL_NIF_DIRTY_JOB_CPU_BOUND, png_slice, 2, slice_argv);
     }
 
-    void * status;
-    ErlNifBinary result;
+    memory_scope_exit(&task->scope);
+    enif_release_resource(task);
+    return ret;
+}
+
+// JPEGs of large images are encoded about JPEG_SLICE_BYTES of pixels per
+// thread, around 50ms of work, per call of jpeg_slice
+#define JPEG_SLICE_BYTES (4 * 1024 * 1024)
+
+typedef struct {
+    JpegStream stream;
+    JpegBuffer buffer;
+    int slice_rows;
+    Timings timings;
+    MemoryScope scope;
+} JpegTask;
+
+static ErlNifResourceType *jpeg_task_type = NULL;
+
+static void jpeg_task_release(JpegTask *task) {
+    jpeg_buffer_free(&task->buffer);
+}
+
+static void jpeg_task_dtor(ErlNifEnv *env, void *obj) {
+    jpeg_task_release((JpegTask *)obj);
+}
+
+// Encodes the next MCU rows, then reschedules itself until the image is
+// done. Stops early once the calling process has exited. Called with the
+// image binary and the task.
+static ERL_NIF_TERM jpeg_slice(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary img;
+    JpegTask *task;
+
+    if (!enif_inspect_binary(env, argv[0], &img) || !enif_get_resource(env, argv[1], jpeg_task_type, (void **)&task)) {
+        return enif_make_badarg(env);
+    }
+
+    memory_scope_resume(&task->scope);
+    ERL_NIF_TERM ret;
+
+    if (!enif_is_current_process_alive(env)) {
+        jpeg_task_release(task);
+        memory_atomic_add(&slices_stopped, 1);
+        ret = error(env, "process exited");
+    } else {
+        memory_atomic_add(&slices_run, 1);
+        ErlNifTime start = timings_now();
+        task->stream.enc.data = img.data;
+        bool ok = jpeg_stream_step(&task->stream, &task->buffer, task->slice_rows);
+        timings_add(&task->timings, PHASE_ENCODE, start);
 
-    if (enif_alloc_binary(output_w * output_h * num_channels * bytes_per_channel, &result)) {
-        if (bytes_per_channel == 1) {
-            status = stbir_resize_uint8_linear(input_pixels.data, input_w, input_h, stride_in_bytes, result.data, output_w, output_h, stride_in_bytes, (stbir_pixel_layout)num_channels);
-        } else if (bytes_per_channel == 4) {
-            status = stbir_resize_float_linear((float *)input_pixels.data, input_w, input_h, stride_in_bytes, (float *)result.data, output_w, output_h, stride_in_bytes, (stbir_pixel_layout)num_channels);
+        if (!ok) {
+            jpeg_task_release(task);
+            ret = error(env, "out of memory");
+        } else if (!task->stream.done) {
+            ret = enif_schedule_nif(env, "to_binary", ERL_NIF_DIRTY_JOB_CPU_BOUND, jpeg_slice, argc, argv);
         } else {
-            return error(env, "invalid type");
+            ERL_NIF_TERM binary;
+            start = timings_now();
+            unsigned char *data = enif_make_new_binary(env, task->buffer.size, &binary);
+            if (data != NULL) {
+                memcpy(data, task->buffer.data, task->buffer.size);
+            }
+            timings_add(&task->timings, PHASE_COPY, start);
+            jpeg_task_release(task);
+            if (data == NULL) {
+                ret = error(env, "out of memory");
+            } else {
+                ERL_NIF_TERM stats = memory_put(env, timings_put(env, &task->timings, enif_make_new_map(env)));
+                ret = enif_make_tuple3(env, enif_make_atom(env, "ok"), binary, stats);
+            }
+        }
+    }
+
+    memory_scope_exit(&task->scope);
+    return ret;
+}
+
+// Same as to_binary for JPEGs, but leaves encoding the MCU rows to
+// jpeg_slice. The output is the same as encoding in a single call.
+static ERL_NIF_TERM jpeg_start(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary img;
+    JpegOptions jpeg_options;
+    int w, h, comp;
+
+    if (!enif_inspect_binary(env, argv[1], &img)) {
+        return error(env, "invalid binary data");
+    }
+    if (!enif_get_int(env, argv[2], &h)) {
+        return error(env, "invalid height");
+    }
+    if (!enif_get_int(env, argv[3], &w)) {
+        return error(env, "invalid width");
+    }
+    if (!enif_get_int(env, argv[4], &comp)) {
+        return error(env, "invalid number of channels");
+    }
+    if (!enif_is_map(env, argv[5])) {
+        return error(env, "invalid options");
+    }
+    if (!get_jpeg_options(env, argv[5], &jpeg_options)) {
+        return error(env, "invalid jpg options");
+    }
+
+    JpegTask *task = enif_alloc_resource(jpeg_task_type, sizeof(JpegTask));
+    if (task == NULL) {
+        return error(env, "out of memory");
+    }
+    memset(task, 0, sizeof(JpegTask));
+    memory_scope_enter(&task->scope);
+
+    ERL_NIF_TERM ret;
+    if (!jpeg_stream_init(&task->stream, w, h, comp, img.data, &jpeg_options)) {
+        ret = error(env, "failed to write jpg");
+    } else {
+        // MCU rows are at most 16 pixel rows of 0xFFFF pixels
+        int rows = JPEG_SLICE_BYTES / (w * comp * task->stream.enc.mcu_size);
+        int threads = jpeg_options.threads < 1 ? 1 : jpeg_options.threads;
+        task->slice_rows = (rows < 1 ? 1 : rows) * threads;
+
+        ERL_NIF_TERM slice_argv[2] = {argv[1], enif_make_resource(env, task)};
+        ret = enif_schedule_nif(env, "to_binary", ERL_NIF_DIRTY_JOB_CPU_BOUND, jpeg_slice, 2, slice_argv);
+    }
+
+    memory_scope_exit(&task->scope);
+    enif_release_resource(task);
+    return ret;
+}
+
+// A map of stage names to the clocks spent in them
+static ERL_NIF_TERM make_resize_profile(ErlNifEnv *env, const ResizeProfile *profile) {
+    const char *names[] = {"build", "total", "looping", "vertical", "horizontal", "decode", "encode", "alpha_weight", "alpha_unweight"};
+    uint64_t clocks[] = {profile->build, profile->total, profile->looping, profile->vertical, profile->horizontal,
+                         profile->decode, profile->encode, profile->alpha, profile->unalpha};
+    ERL_NIF_TERM keys[9], values[9], map;
+
+    for (int i = 0; i < 9; ++i) {
+        keys[i] = enif_make_atom(env, names[i]);
+        values[i] = enif_make_uint64(env, (ErlNifUInt64)clocks[i]);
+    }
+    enif_make_map_from_arrays(env, keys, values, 9, &map);
+    return map;
+}
+
+typedef struct {
+    ErlNifBinary input;
+    int input_h, input_w, output_h, output_w, num_channels, input_type;
+    ResizeOptions options;
+} ResizeArgs;
+
+// Reads the arguments of resize, returning the error for the first
+// invalid one
+static const char *get_resize_args(ErlNifEnv *env, const ERL_NIF_TERM argv[], ResizeArgs *args) {
+    if (!enif_inspect_binary(env, argv[0], &args->input)) {
+        return "invalid image";
+    }
+    if(!enif_get_int(env, argv[1], &args->input_h)) {
+        return "invalid input height";
+    }
+    if(!enif_get_int(env, argv[2], &args->input_w)) {
+        return "invalid input width";
+    }
+    if(!enif_get_int(env, argv[3], &args->num_channels)) {
+        return "invalid number of channels";
+    }
+    if(!enif_get_int(env, argv[4], &args->output_h)) {
+        return "invalid output height";
+    }
+    if(!enif_get_int(env, argv[5], &args->output_w)) {
+        return "invalid output width";
+    }
+    if(!enif_get_int(env, argv[6], &args->input_type)) {
+        return "invalid type";
+    }
+    if (!enif_is_map(env, argv[7]) || !get_resize_options(env, argv[7], &args->options)) {
+        return "invalid options";
+    }
+    return NULL;
+}
+
+static size_t resize_output_size(const ResizeArgs *args) {
+    int output_type = resize_output_type(args->input_type, &args->options);
+    return (size_t)args->output_w * args->output_h * args->num_channels * resize_type_size(output_type);
+}
+
+static ERL_NIF_TERM resize(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]){
+    ResizeArgs args;
+    const char *reason = get_resize_args(env, argv, &args);
+    if (reason != NULL) {
+        return error(env, reason);
+    }
+
+    ErlNifBinary result;
+    Timings timings = {0};
+    ErlNifTime start = timings_now();
+
+    if (enif_alloc_binary(resize_output_size(&args), &result)) {
+        timings_add(&timings, PHASE_ALLOC, start);
+
+        STBIR_RESIZE resize;
+        if (!resize_setup(&resize, args.input.data, args.input_w, args.input_h, result.data, args.output_w, args.output_h, args.num_channels, args.input_type, &args.options)) {
+            enif_release_binary(&result);
+            return error(env, "invalid type or options");
         }
 
-        if (status == NULL) {
+        ResizeProfile profile;
+        start = timings_now();
+        if (!resize_run_profiled(&resize, args.options.threads, &profile)) {
+            enif_release_binary(&result);
             return error(env, "failed to resize");
         }
+        timings_add(&timings, PHASE_RESIZE, start);
 
-        return enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_binary(env, &result));
+        ERL_NIF_TERM ok = enif_make_atom(env, "ok");
+        ERL_NIF_TERM binary = enif_make_binary(env, &result);
+        ERL_NIF_TERM stats = memory_put(env, timings_put(env, &timings, enif_make_new_map(env)));
+        if (profile.available) {
+            return enif_make_tuple4(env, ok, binary, stats, make_resize_profile(env, &profile));
+        }
+        return enif_make_tuple3(env, ok, binary, stats);
     } else {
         return error(env, "out of memory");
     }
 }
 
-static int on_load(ErlNifEnv *env, void **_sth1, ERL_NIF_TERM _sth2) {
-    return 0;
+// Large resizes are run in bands of output rows, one band per thread and
+// per call of resize_slice, so that each call handles about
+// RESIZE_SLICE_BYTES of input and output pixels, around 50ms of work.
+// The samplers are built with one split per thread, whose scratch memory
+// is reused by the bands of every call, see resize_set_split_rows.
+#define RESIZE_SLICE_BYTES (32 * 1024 * 1024)
+
+typedef struct {
+    STBIR_RESIZE resize;
+    ErlNifBinary output;
+    bool has_output;
+    int threads;
+    // Output rows per band, and the first row of the next call
+    int band_rows;
+    int next_row;
+    // Where the crop region starts in the input binary
+    size_t input_offset;
+    Timings timings;
+    MemoryScope scope;
+} ResizeTask;
+
+static ErlNifResourceType *resize_task_type = NULL;
+
+static void resize_task_release(ResizeTask *task) {
+    stbir_free_samplers(&task->resize);
+    if (task->has_output) {
+        enif_release_binary(&task->output);
+        task->has_output = false;
+    }
 }
 
-static int on_reload(ErlNifEnv *_sth0, void **_sth1, ERL_NIF_TERM _sth2) {
-    return 0;
+static void resize_task_dtor(ErlNifEnv *env, void *obj) {
+    resize_task_release((ResizeTask *)obj);
 }
 
-static int on_upgrade(ErlNifEnv *_sth0, void **_sth1, void **_sth2, ERL_NIF_TERM _sth3) {
-    return 0;
+static ERL_NIF_TERM resize_task_finish(ErlNifEnv *env, ResizeTask *task) {
+    stbir_free_samplers(&task->resize);
+    task->has_output = false;
+    ERL_NIF_TERM binary = enif_make_binary(env, &task->output);
+    ERL_NIF_TERM stats = memory_put(env, timings_put(env, &task->timings, enif_make_new_map(env)));
+    return enif_make_tuple3(env, enif_make_atom(env, "ok"), binary, stats);
 }
 
-static ErlNifFunc nif_functions[] = {
-    {"read_file", 2, read_file, ERL_NIF_DIRTY_JOB_IO_BOUND},
-    {"read_binary", 2, read_binary, ERL_NIF_DIRTY_JOB_CPU_BOUND},
-    {"read_gif_binary", 1, read_gif_binary, ERL_NIF_DIRTY_JOB_CPU_BOUND},
-    {"write_file", 6, write_file, ERL_NIF_DIRTY_JOB_IO_BOUND},
-    {"to_binary", 5, to_binary, ERL_NIF_DIRTY_JOB_CPU_BOUND},
-    {"resize", 7, resize, ERL_NIF_DIRTY_JOB_CPU_BOUND}};
-
-ERL_NIF_INIT(Elixir.StbImage.Nif, nif_functions, on_load, on_reload, on_upgrade, NULL);
+// Runs the next band of every thread, then reschedules itself until the
+// last one is done. Stops early once the calling process has exited.
+// Called with the input binary and the task.
+static ERL_NIF_TERM resize_slice(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary input;
+    ResizeTask *task;
+
+    if (!enif_inspect_binary(env, argv[0], &input) || !enif_get_resource(env, argv[1], resize_task_type, (void **)&task)) {
+        return enif_make_badarg(env);
+    }
+
+    memory_scope_resume(&task->scope);
+    ERL_NIF_TERM ret;
+
+    if (!enif_is_current_process_alive(env)) {
+        resize_task_release(task);
+        memory_atomic_add(&slices_stopped, 1);
+        ret = error(env, "process exited");
+    } else {
+        memory_atomic_add(&slices_run, 1);
+        ErlNifTime start = timings_now();
+        int rows = resize_output_rows(&task->resize);
+        int count = 0;
+        for (; count < task->resize.splits && task->next_row < rows; ++count) {
+            int end = rows - task->next_row > task->band_rows ? task->next_row + task->band_rows : rows;
+            resize_set_split_rows(&task->resize, count, task->next_row, end);
+            task->next_row = end;
+        }
+        stbir_set_buffer_ptrs(&task->resize, input.data + task->input_offset, task->resize.input_stride_in_bytes, task->output.data, 0);
+        bool ok = resize_run_splits(&task->resize, 0, count, task->threads);
+        timings_add(&task->timings, PHASE_RESIZE, start);
+
+        if (!ok) {
+            resize_task_release(task);
+            ret = error(env, "failed to resize");
+        } else if (task->next_row < rows) {
+            ret = enif_schedule_nif(env, "resize", ERL_NIF_DIRTY_JOB_CPU_BOUND, resize_slice, argc, argv);
+        } else {
+            ret = resize_task_finish(env, task);
+        }
+    }
+
+    memory_scope_exit(&task->scope);
+    return ret;
+}
+
+// Same as resize, but leaves running the bands to resize_slice. Box
+// downscales are fast enough to run at once.
+static ERL_NIF_TERM resize_start(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ResizeArgs args;
+    const char *reason = get_resize_args(env, argv, &args);
+    if (reason != NULL) {
+        return error(env, reason);
+    }
+
+    ResizeTask *task = enif_alloc_resource(resize_task_type, sizeof(ResizeTask));
+    if (task == NULL) {
+        return error(env, "out of memory");
+    }
+    memset(task, 0, sizeof(ResizeTask));
+    memory_scope_enter(&task->scope);
+
+    ERL_NIF_TERM ret;
+    size_t output_size = resize_output_size(&args);
+    size_t pixel_bytes = (size_t)args.num_channels * resize_type_size(args.input_type);
+    ErlNifTime start = timings_now();
+
+    if (!enif_alloc_binary(output_size, &task->output)) {
+        ret = error(env, "out of memory");
+        goto release;
+    }
+    task->has_output = true;
+    timings_add(&task->timings, PHASE_ALLOC, start);
+
+    if (!resize_setup(&task->resize, NULL, args.input_w, args.input_h, NULL, args.output_w, args.output_h, args.num_channels, args.input_type, &args.options)) {
+        ret = error(env, "invalid type or options");
+        goto release;
+    }
+    task->threads = args.options.threads < 1 ? 1 : args.options.threads;
+    task->input_offset = resize_input_offset(&args.options, args.input_w, pixel_bytes);
+    stbir_set_buffer_ptrs(&task->resize, args.input.data + task->input_offset, task->resize.input_stride_in_bytes, task->output.data, 0);
+
+    start = timings_now();
+    bool ok = true;
+    if (box_resize_try(&task->resize, task->threads, &ok)) {
+        timings_add(&task->timings, PHASE_RESIZE, start);
+        ret = ok ? resize_task_finish(env, task) : error(env, "failed to resize");
+        goto release;
+    }
+
+    int splits = stbir_build_samplers_with_splits(&task->resize, task->threads);
+    if (splits <= 0) {
+        ret = error(env, "failed to resize");
+        goto release;
+    }
+    timings_add(&task->timings, PHASE_RESIZE, start);
+
+    uint64_t slices = (args.input.size + output_size) / RESIZE_SLICE_BYTES;
+    uint64_t bands = (slices < 1 ? 1 : slices) * splits;
+    int rows = resize_output_rows(&task->resize);
+    task->band_rows = bands >= (uint64_t)rows ? 1 : (int)((rows + bands - 1) / bands);
+
+    ERL_NIF_TERM slice_argv[2] = {argv[0], enif_make_resource(env, task)};
+    ret = enif_schedule_nif(env, "resize", ERL_NIF_DIRTY_JOB_CPU_BOUND, resize_slice, 2, slice_argv);
+
+release:
+    memory_scope_exit(&task->scope);
+    enif_release_resource(task);
+    return ret;
+}
+
+static ERL_NIF_TERM pyramid(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary input_pixels;
+    int height, width, num_channels, type, levels;
+    ResizeOptions resize_options;
+
+    if (!enif_inspect_binary(env, argv[0], &input_pixels)) {
+        return error(env, "invalid image");
+    }
+    if (!enif_get_int(env, argv[1], &height) || height <= 0) {
+        return error(env, "invalid input height");
+    }
+    if (!enif_get_int(env, argv[2], &width) || width <= 0) {
+        return error(env, "invalid input width");
+    }
+    if (!enif_get_int(env, argv[3], &num_channels)) {
+        return error(env, "invalid number of channels");
+    }
+    if (!enif_get_int(env, argv[4], &type) || resize_type_size(type) == 0) {
+        return error(env, "invalid type");
+    }
+    if (!enif_get_int(env, argv[5], &levels) || levels <= 0) {
+        return error(env, "invalid number of levels");
+    }
+    if (!enif_is_map(env, argv[6]) || !get_resize_options(env, argv[6], &resize_options)) {
+        return error(env, "invalid options");
+    }
+    // Every level is read back as the input of the next one
+    resize_options.crop = false;
+    resize_options.output_type = -1;
+
+    size_t pixel_bytes = (size_t)num_channels * resize_type_size(type);
+    if (input_pixels.size != (size_t)height * width * pixel_bytes) {
+        return error(env, "invalid image");
+    }
+
+    // All levels go into one binary, each level halving the previous one
+    size_t total = 0;
+    for (int level = 0, h = height, w = width; level < levels; ++level) {
+        h = h > 1 ? h / 2 : 1;
+        w = w > 1 ? w / 2 : 1;
+        total += (size_t)h * w * pixel_bytes;
+    }
+
+    ErlNifBinary result;
+    Timings timings = {0};
+    ErlNifTime start = timings_now();
+    if (!enif_alloc_binary(total, &result)) {
+        return error(env, "out of memory");
+    }
+    timings_add(&timings, PHASE_ALLOC, start);
+    start = timings_now();
+
+    const unsigned char *src = input_pixels.data;
+    unsigned char *dst = result.data;
+    int src_h = height, src_w = width;
+
+    // Each level is resized from the previous one, which is a quarter of
+    // the size of the level before it, so the whole pyramid costs about a
+    // third more than the first level alone
+    for (int level = 0; level < levels; ++level) {
+        int dst_h = src_h > 1 ? src_h / 2 : 1;
+        int dst_w = src_w > 1 ? src_w / 2 : 1;
+
+        STBIR_RESIZE resize;
+        if (!resize_setup(&resize, src, src_w, src_h, dst, dst_w, dst_h, num_channels, type, &resize_options)) {
+            enif_release_binary(&result);
+            return error(env, "invalid type or options");
+        }
+        if (!resize_run(&resize, resize_options.threads)) {
+            enif_release_binary(&result);
+            return error(env, "failed to resize");
+        }
+
+        src = dst;
+        dst += (size_t)dst_h * dst_w * pixel_bytes;
+        src_h = dst_h;
+        src_w = dst_w;
+    }
+    timings_add(&timings, PHASE_RESIZE, start);
+
+    ERL_NIF_TERM stats = memory_put(env, timings_put(env, &timings, enif_make_new_map(env)));
+    return enif_make_tuple3(env, enif_make_atom(env, "ok"), enif_make_binary(env, &result), stats);
+}
+
+typedef struct {
+    // One resize per worker, each with its own samplers
+    STBIR_RESIZE *resizes;
+    int workers;
+    // Threads of each worker, used to split the rows of an image
+    int threads;
+    const unsigned char **inputs;
+    int count;
+    int input_stride;
+    size_t input_offset;
+    unsigned char *output;
+    size_t output_size;
+    char *failed;
+} ResizeManyJob;
+
+// Worker `index` builds its samplers once and resizes every image
+// congruent to `index`. The samplers hold the buffer pointers and the
+// scratch memory of a resize, so they can't be shared by workers.
+static void resize_many_task(void *context, int index) {
+    ResizeManyJob *job = (ResizeManyJob *)context;
+    STBIR_RESIZE *resize = &job->resizes[index];
+
+    if (stbir_build_samplers_with_splits(resize, job->threads) <= 0) {
+        job->failed[index] = 1;
+        return;
+    }
+
+    for (int i = index; i < job->count; i += job->workers) {
+        stbir_set_buffer_ptrs(resize, job->inputs[i] + job->input_offset, job->input_stride, job->output + i * job->output_size, 0);
+        if (!resize_run(resize, job->threads)) {
+            job->failed[index] = 1;
+            break;
+        }
+    }
+
+    stbir_free_samplers(resize);
+}
+
+static ERL_NIF_TERM resize_many(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    unsigned count;
+    int input_h, input_w, num_channels, output_h, output_w, input_type;
+    ResizeOptions resize_options;
+
+    if (!enif_get_list_length(env, argv[0], &count) || count == 0 || count > INT_MAX) {
+        return error(env, "invalid images");
+    }
+    if (!enif_get_int(env, argv[1], &input_h) || input_h <= 0) {
+        return error(env, "invalid input height");
+    }
+    if (!enif_get_int(env, argv[2], &input_w) || input_w <= 0) {
+        return error(env, "invalid input width");
+    }
+    if (!enif_get_int(env, argv[3], &num_channels)) {
+        return error(env, "invalid number of channels");
+    }
+    if (!enif_get_int(env, argv[4], &output_h) || output_h <= 0) {
+        return error(env, "invalid output height");
+    }
+    if (!enif_get_int(env, argv[5], &output_w) || output_w <= 0) {
+        return error(env, "invalid output width");
+    }
+    if (!enif_get_int(env, argv[6], &input_type) || resize_type_size(input_type) == 0) {
+        return error(env, "invalid type");
+    }
+    if (!enif_is_map(env, argv[7]) || !get_resize_options(env, argv[7], &resize_options)) {
+        return error(env, "invalid options");
+    }
+
+    size_t pixel_bytes = (size_t)num_channels * resize_type_size(input_type);
+    int output_bytes = resize_type_size(resize_output_type(input_type, &resize_options));
+    if (output_bytes == 0) {
+        return error(env, "invalid type or options");
+    }
+
+    // Images are spread over the workers first, and the threads left
+    // over split the rows of each image
+    int workers = resize_options.threads < (int)count ? resize_options.threads : (int)count;
+    if (workers < 1) {
+        workers = 1;
+    }
+
+    ResizeManyJob job = {0};
+    job.workers = workers;
+    job.threads = resize_options.threads / workers;
+    job.count = (int)count;
+    job.input_stride = input_w * (int)pixel_bytes;
+    job.input_offset = resize_input_offset(&resize_options, input_w, pixel_bytes);
+    job.output_size = (size_t)output_h * output_w * num_channels * output_bytes;
+    job.inputs = enif_alloc(sizeof(*job.inputs) * count);
+    job.resizes = enif_alloc(sizeof(*job.resizes) * workers);
+    job.failed = enif_alloc(workers);
+
+    ERL_NIF_TERM ret;
+    ErlNifBinary result;
+    bool allocated = false;
+
+    if (job.inputs == NULL || job.resizes == NULL || job.failed == NULL) {
+        ret = error(env, "out of memory");
+        goto done;
+    }
+    memset(job.failed, 0, workers);
+
+    ERL_NIF_TERM list = argv[0], head;
+    for (int i = 0; enif_get_list_cell(env, list, &head, &list); ++i) {
+        ErlNifBinary input;
+        if (!enif_inspect_binary(env, head, &input) || input.size != (size_t)input_h * input_w * pixel_bytes) {
+            ret = error(env, "invalid image");
+            goto done;
+        }
+        job.inputs[i] = input.data;
+    }
+
+    for (int w = 0; w < workers; ++w) {
+        if (!resize_setup(&job.resizes[w], NULL, input_w, input_h, NULL, output_w, output_h, num_channels, input_type, &resize_options)) {
+            ret = error(env, "invalid type or options");
+            goto done;
+        }
+    }
+
+    Timings timings = {0};
+    ErlNifTime start = timings_now();
+    if (!enif_alloc_binary(job.output_size * count, &result)) {
+        ret = error(env, "out of memory");
+        goto done;
+    }
+    allocated = true;
+    job.output = result.data;
+    timings_add(&timings, PHASE_ALLOC, start);
+
+    start = timings_now();
+    parallel_for(workers, workers, resize_many_task, &job);
+    timings_add(&timings, PHASE_RESIZE, start);
+
+    bool ok = true;
+    for (int w = 0; w < workers; ++w) {
+        ok = ok && !job.failed[w];
+    }
+
+    if (ok) {
+        ERL_NIF_TERM stats = memory_put(env, timings_put(env, &timings, enif_make_new_map(env)));
+        ret = enif_make_tuple3(env, enif_make_atom(env, "ok"), enif_make_binary(env, &result), stats);
+        allocated = false;
+    } else {
+        ret = error(env, "failed to resize");
+    }
+
+done:
+    if (allocated) {
+        enif_release_binary(&result);
+    }
+    enif_free(job.inputs);
+    enif_free(job.resizes);
+    enif_free(job.failed);
+    return ret;
+}
+
+static ERL_NIF_TERM convert_alpha(ErlNifEnv *env, const ERL_NIF_TERM argv[], bool premultiply) {
+    ErlNifBinary input_pixels;
+    int num_channels, type;
+
+    if (!enif_inspect_binary(env, argv[0], &input_pixels)) {
+        return error(env, "invalid image");
+    }
+    if (!enif_get_int(env, argv[1], &num_channels) || (num_channels != 2 && num_channels != 4)) {
+        return error(env, "image must have 2 or 4 channels");
+    }
+    if (!enif_get_int(env, argv[2], &type) || resize_type_size(type) == 0) {
+        return error(env, "invalid type");
+    }
+
+    size_t pixel_bytes = (size_t)num_channels * resize_type_size(type);
+    if (input_pixels.size % pixel_bytes != 0) {
+        return error(env, "invalid image");
+    }
+    size_t pixels = input_pixels.size / pixel_bytes;
+
+    ErlNifBinary result;
+    if (!enif_alloc_binary(input_pixels.size, &result)) {
+        return error(env, "out of memory");
+    }
+
+    switch (type) {
+        case STBIR_TYPE_UINT8:
+            (premultiply ? premultiply_u8 : unpremultiply_u8)(input_pixels.data, result.data, pixels, num_channels);
+            break;
+        case STBIR_TYPE_UINT16:
+            (premultiply ? premultiply_u16 : unpremultiply_u16)((const uint16_t *)input_pixels.data, (uint16_t *)result.data, pixels, num_channels);
+            break;
+        case STBIR_TYPE_HALF_FLOAT:
+            (premultiply ? premultiply_f16 : unpremultiply_f16)((const stbir__FP16 *)input_pixels.data, (stbir__FP16 *)result.data, pixels, num_channels);
+            break;
+        default:
+            (premultiply ? premultiply_f32 : unpremultiply_f32)((const float *)input_pixels.data, (float *)result.data, pixels, num_channels);
+            break;
+    }
+
+    return enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_binary(env, &result));
+}
+
+static ERL_NIF_TERM premultiply(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return convert_alpha(env, argv, true);
+}
+
+static ERL_NIF_TERM unpremultiply(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return convert_alpha(env, argv, false);
+}
+
+typedef struct {
+    ErlNifMutex *lock;
+    STBIR_RESIZE resize;
+    int threads;
+    int input_h, input_w, output_h, output_w, num_channels;
+    int input_bytes_per_channel, output_bytes_per_channel;
+    // Where the crop region starts in the input binary
+    size_t input_offset;
+} ResizePlanResource;
+
+static ErlNifResourceType *resize_plan_type = NULL;
+
+static void resize_plan_dtor(ErlNifEnv *env, void *obj) {
+    ResizePlanResource *res = (ResizePlanResource *)obj;
+    stbir_free_samplers(&res->resize);
+    if (res->lock != NULL) {
+        enif_mutex_destroy(res->lock);
+    }
+}
+
+static ERL_NIF_TERM resize_plan_new(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    int input_h, input_w, output_h, output_w, num_channels, input_type;
+    ResizeOptions resize_options;
+
+    if (!enif_get_int(env, argv[0], &input_h)) {
+        return error(env, "invalid input height");
+    }
+    if (!enif_get_int(env, argv[1], &input_w)) {
+        return error(env, "invalid input width");
+    }
+    if (!enif_get_int(env, argv[2], &num_channels)) {
+        return error(env, "invalid number of channels");
+    }
+    if (!enif_get_int(env, argv[3], &output_h)) {
+        return error(env, "invalid output height");
+    }
+    if (!enif_get_int(env, argv[4], &output_w)) {
+        return error(env, "invalid output width");
+    }
+    if (!enif_get_int(env, argv[5], &input_type)) {
+        return error(env, "invalid type");
+    }
+    if (!enif_is_map(env, argv[6]) || !get_resize_options(env, argv[6], &resize_options)) {
+        return error(env, "invalid options");
+    }
+
+    ResizePlanResource *res = enif_alloc_resource(resize_plan_type, sizeof(ResizePlanResource));
+    if (res == NULL) {
+        return error(env, "out of memory");
+    }
+    memset(res, 0, sizeof(ResizePlanResource));
+
+    ERL_NIF_TERM ret;
+    char name[] = "stb_image_resize_plan";
+    res->lock = enif_mutex_create(name);
+    res->threads = resize_options.threads;
+    res->input_h = input_h;
+    res->input_w = input_w;
+    res->output_h = output_h;
+    res->output_w = output_w;
+    res->num_channels = num_channels;
+    res->input_bytes_per_channel = resize_type_size(input_type);
+    res->output_bytes_per_channel = resize_type_size(resize_output_type(input_type, &resize_options));
+    res->input_offset = resize_input_offset(&resize_options, input_w, (size_t)num_channels * res->input_bytes_per_channel);
+
+    if (res->lock == NULL) {
+        ret = error(env, "out of memory");
+    } else if (!resize_setup(&res->resize, NULL, input_w, input_h, NULL, output_w, output_h, num_channels, input_type, &resize_options)) {
+        ret = error(env, "invalid type or options");
+    } else if (stbir_build_samplers_with_splits(&res->resize, resize_options.threads) <= 0) {
+        ret = error(env, "failed to build resize plan");
+    } else {
+        ret = enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_resource(env, res));
+    }
+
+    enif_release_resource(res);
+    return ret;
+}
+
+static ERL_NIF_TERM resize_plan_run(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ResizePlanResource *res;
+    ErlNifBinary input_pixels;
+    ErlNifBinary result;
+
+    if (!enif_get_resource(env, argv[0], resize_plan_type, (void **)&res)) {
+        return error(env, "invalid resize plan");
+    }
+    if (!enif_inspect_binary(env, argv[1], &input_pixels)) {
+        return error(env, "invalid image");
+    }
+
+    size_t pixel_bytes = (size_t)res->num_channels * res->input_bytes_per_channel;
+    if (input_pixels.size != (size_t)res->input_h * res->input_w * pixel_bytes) {
+        return error(env, "image does not match the resize plan");
+    }
+    Timings timings = {0};
+    ErlNifTime start = timings_now();
+    if (!enif_alloc_binary((size_t)res->output_h * res->output_w * res->num_channels * res->output_bytes_per_channel, &result)) {
+        return error(env, "out of memory");
+    }
+    timings_add(&timings, PHASE_ALLOC, start);
+
+    // The samplers hold per-split scratch memory, so runs are serialized
+    enif_mutex_lock(res->lock);
+    start = timings_now();
+    stbir_set_buffer_ptrs(&res->resize, input_pixels.data + res->input_offset, res->input_w * (int)pixel_bytes, result.data, 0);
+    bool ok = resize_run(&res->resize, res->threads);
+    stbir_set_buffer_ptrs(&res->resize, NULL, 0, NULL, 0);
+    timings_add(&timings, PHASE_RESIZE, start);
+    enif_mutex_unlock(res->lock);
+
+    if (!ok) {
+        enif_release_binary(&result);
+        return error(env, "failed to resize");
+    }
+
+    ERL_NIF_TERM stats = memory_put(env, timings_put(env, &timings, enif_make_new_map(env)));
+    return enif_make_tuple3(env, enif_make_atom(env, "ok"), enif_make_binary(env, &result), stats);
+}
+
+typedef struct {
+    ErlNifMutex *lock;
+    PngWriter writer;
+    bool open;
+    FILE *file;
+    ErlNifPid pid;
+    ErlNifEnv *msg_env;
+    // Environment of the NIF call currently pushing rows, used to send chunks
+    ErlNifEnv *caller_env;
+} PngWriterResource;
+
+static ErlNifResourceType *png_writer_type = NULL;
+
+static void png_writer_close_resource(PngWriterResource *res) {
+    if (res->open) {
+        png_writer_free(&res->writer);
+        res->open = false;
+    }
+    if (res->file != NULL) {
+        fclose(res->file);
+        res->file = NULL;
+    }
+}
+
+static void png_writer_dtor(ErlNifEnv *env, void *obj) {
+    PngWriterResource *res = (PngWriterResource *)obj;
+    png_writer_close_resource(res);
+    if (res->msg_env != NULL) {
+        enif_free_env(res->msg_env);
+    }
+    if (res->lock != NULL) {
+        enif_mutex_destroy(res->lock);
+    }
+}
+
+static bool png_file_sink(void *context, const unsigned char *data, size_t size) {
+    PngWriterResource *res = (PngWriterResource *)context;
+    return fwrite(data, 1, size, res->file) == size;
+}
+
+static bool png_process_sink(void *context, const unsigned char *data, size_t size) {
+    PngWriterResource *res = (PngWriterResource *)context;
+    ERL_NIF_TERM chunk;
+    unsigned char *chunk_data = enif_make_new_binary(res->msg_env, size, &chunk);
+    if (chunk_data == NULL) {
+        return false;
+    }
+    memcpy(chunk_data, data, size);
+
+    ERL_NIF_TERM msg = enif_make_tuple3(res->msg_env,
+                                        enif_make_atom(res->msg_env, "stb_image_png"),
+                                        enif_make_resource(res->msg_env, res),
+                                        chunk);
+    bool sent = enif_send(res->caller_env, &res->pid, res->msg_env, msg);
+    enif_clear_env(res->msg_env);
+    return sent;
+}
+
+static ERL_NIF_TERM png_writer_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary path;
+    ErlNifPid pid;
+    int h, w, comp, bit_depth;
+    bool to_file = enif_inspect_binary(env, argv[0], &path);
+
+    if (!to_file && !enif_get_local_pid(env, argv[0], &pid)) {
+        return error(env, "invalid destination");
+    }
+    if (!enif_get_int(env, argv[1], &h) || h <= 0) {
+        return error(env, "invalid height");
+    }
+    if (!enif_get_int(env, argv[2], &w) || w <= 0) {
+        return error(env, "invalid width");
+    }
+    if (!enif_get_int(env, argv[3], &comp) || comp < 1 || comp > 4) {
+        return error(env, "invalid number of channels");
+    }
+    if (!enif_get_int(env, argv[4], &bit_depth) || (bit_depth != 8 && bit_depth != 16)) {
+        return error(env, "invalid bit depth");
+    }
+
+    PngWriterResource *res = enif_alloc_resource(png_writer_type, sizeof(PngWriterResource));
+    if (res == NULL) {
+        return error(env, "out of memory");
+    }
+    memset(res, 0, sizeof(PngWriterResource));
+
+    ERL_NIF_TERM ret;
+    char name[] = "stb_image_png_writer";
+    res->lock = enif_mutex_create(name);
+    if (res->lock == NULL) {
+        ret = error(env, "out of memory");
+        goto release;
+    }
+
+    PngSink sink = png_file_sink;
+    if (to_file) {
+        char *c_path = (char *)enif_alloc(path.size + 1);
+        if (c_path == NULL) {
+            ret = error(env, "out of memory");
+            goto release;
+        }
+        memcpy(c_path, path.data, path.size);
+        c_path[path.size] = '\0';
+        res->file = stbiw__fopen(c_path, "wb");
+        enif_free(c_path);
+
+        if (res->file == NULL) {
+            ret = error(env, "could not open file");
+            goto release;
+        }
+    } else {
+        res->pid = pid;
+        res->msg_env = enif_alloc_env();
+        if (res->msg_env == NULL) {
+            ret = error(env, "out of memory");
+            goto release;
+        }
+        sink = png_process_sink;
+    }
+
+    res->caller_env = env;
+    res->open = png_writer_init(&res->writer, (uint32_t)w, (uint32_t)h, comp, bit_depth, sink, res);
+    res->caller_env = NULL;
+    if (!res->open) {
+        ret = error(env, "failed to write png");
+        goto release;
+    }
+
+    ret = enif_make_tuple2(env, enif_make_atom(env, "ok"), enif_make_resource(env, res));
+
+release:
+    enif_release_resource(res);
+    return ret;
+}
+
+static ERL_NIF_TERM png_writer_write(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    PngWriterResource *res;
+    ErlNifBinary rows;
+
+    if (!enif_get_resource(env, argv[0], png_writer_type, (void **)&res)) {
+        return error(env, "invalid png writer");
+    }
+    if (!enif_inspect_binary(env, argv[1], &rows)) {
+        return error(env, "invalid binary data");
+    }
+
+    ERL_NIF_TERM ret = enif_make_atom(env, "ok");
+    enif_mutex_lock(res->lock);
+
+    if (!res->open) {
+        ret = error(env, "png writer is closed");
+    } else if (rows.size % res->writer.row_bytes != 0) {
+        ret = error(env, "data must contain whole rows");
+    } else if (rows.size / res->writer.row_bytes > res->writer.height - res->writer.rows_written) {
+        ret = error(env, "too many rows");
+    } else {
+        res->caller_env = env;
+        bool ok = png_writer_push_rows(&res->writer, rows.data, (uint32_t)(rows.size / res->writer.row_bytes));
+        res->caller_env = NULL;
+        if (!ok) {
+            png_writer_close_resource(res);
+            ret = error(env, "failed to write png");
+        }
+    }
+
+    enif_mutex_unlock(res->lock);
+    return ret;
+}
+
+static ERL_NIF_TERM png_writer_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    PngWriterResource *res;
+
+    if (!enif_get_resource(env, argv[0], png_writer_type, (void **)&res)) {
+        return error(env, "invalid png writer");
+    }
+
+    ERL_NIF_TERM ret = enif_make_atom(env, "ok");
+    enif_mutex_lock(res->lock);
+
+    if (!res->open) {
+        ret = error(env, "png writer is closed");
+    } else if (res->writer.rows_written != res->writer.height) {
+        png_writer_close_resource(res);
+        ret = error(env, "not all rows were written");
+    } else {
+        res->caller_env = env;
+        bool ok = png_writer_finish(&res->writer);
+        res->caller_env = NULL;
+
+        FILE *file = res->file;
+        res->file = NULL;
+        png_writer_close_resource(res);
+        if (!ok || (file != NULL && fclose(file) != 0)) {
+            ret = error(env, "failed to write png");
+        }
+    }
+
+    enif_mutex_unlock(res->lock);
+    return ret;
+}
+
+static bool open_resource_types(ErlNifEnv *env) {
+    png_writer_type = enif_open_resource_type(env, NULL, "png_writer", png_writer_dtor,
+                                              ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+    resize_plan_type = enif_open_resource_type(env, NULL, "resize_plan", resize_plan_dtor,
+                                               ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+    resize_task_type = enif_open_resource_type(env, NULL, "resize_task", resize_task_dtor,
+                                               ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+    png_task_type = enif_open_resource_type(env, NULL, "png_task", png_task_dtor,
+                                            ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+    jpeg_task_type = enif_open_resource_type(env, NULL, "jpeg_task", jpeg_task_dtor,
+                                              ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER, NULL);
+    return png_writer_type != NULL && resize_plan_type != NULL && resize_task_type != NULL && png_task_type != NULL &&
+           jpeg_task_type != NULL;
+}
+
+static Pool async_pool;
+
+static int on_load(ErlNifEnv *env, void **_sth1, ERL_NIF_TERM _sth2) {
+    return memory_init() && parallel_init() && pool_init(&async_pool) && open_resource_types(env) ? 0 : 1;
+}
+
+static int on_reload(ErlNifEnv *_sth0, void **_sth1, ERL_NIF_TERM _sth2) {
+    return 0;
+}
+
+static int on_upgrade(ErlNifEnv *env, void **_sth1, void **_sth2, ERL_NIF_TERM _sth3) {
+    return memory_init() && parallel_init() && pool_init(&async_pool) && open_resource_types(env) ? 0 : 1;
+}
+
+static void on_unload(ErlNifEnv *_sth0, void *_sth1) {
+    pool_stop(&async_pool);
+    parallel_stop();
+    memory_free_arenas();
+}
+
+MEMORY_SCOPED_NIF(scoped_read_file, read_file)
+MEMORY_SCOPED_NIF(scoped_read_binary, read_binary)
+MEMORY_SCOPED_NIF(scoped_write_file, write_file)
+MEMORY_SCOPED_NIF(scoped_to_binary, to_binary)
+MEMORY_SCOPED_NIF(scoped_resize, resize)
+MEMORY_SCOPED_NIF(scoped_read_gif_binary, read_gif_binary)
+MEMORY_SCOPED_NIF(scoped_pyramid, pyramid)
+MEMORY_SCOPED_NIF(scoped_resize_many, resize_many)
+MEMORY_SCOPED_NIF(scoped_resize_plan_run, resize_plan_run)
+
+// Images up to this many bytes, such as 64x64 RGBA icons, are handled
+// right away on the calling scheduler: switching to a dirty scheduler
+// costs more than decoding, encoding or resizing them.
+#define SMALL_IMAGE_BYTES (16 * 1024)
+
+// Runs `nif` on the calling scheduler when `small`, reporting the time it
+// took against the timeslice, or reschedules it on a dirty CPU scheduler
+static ERL_NIF_TERM run_or_schedule(ErlNifEnv *env, const char *name, bool small, PoolNif nif, int argc, const ERL_NIF_TERM argv[]) {
+    if (!small) {
+        return enif_schedule_nif(env, name, ERL_NIF_DIRTY_JOB_CPU_BOUND, nif, argc, argv);
+    }
+
+    ErlNifTime start = timings_now();
+    ERL_NIF_TERM ret = nif(env, argc, argv);
+    // A timeslice is about a millisecond
+    ErlNifTime percent = (timings_now() - start) / 10000;
+    enif_consume_timeslice(env, percent < 1 ? 1 : percent > 100 ? 100 : (int)percent);
+    return ret;
+}
+
+static bool single_threaded(ErlNifEnv *env, ERL_NIF_TERM options) {
+    int threads = 1;
+    return enif_is_map(env, options) && get_int_option(env, options, "threads", &threads) && threads <= 1;
+}
+
+static ERL_NIF_TERM dispatch_read_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary binary;
+    ImageInfo info;
+    ReadResize read_resize;
+    // At most 4 channels of 4 bytes, whatever is requested
+    bool small = enif_inspect_binary(env, argv[0], &binary) && binary.size <= SMALL_IMAGE_BYTES &&
+                 image_info_from_memory(binary.data, binary.size, &info) &&
+                 (size_t)info.x * info.y * 16 <= SMALL_IMAGE_BYTES &&
+                 get_read_resize(env, argv[3], &read_resize) &&
+                 (!read_resize.enabled || ((size_t)read_resize.height * read_resize.width * 16 <= SMALL_IMAGE_BYTES &&
+                                           read_resize.options.threads <= 1));
+    return run_or_schedule(env, "read_binary", small, scoped_read_binary, argc, argv);
+}
+
+static ERL_NIF_TERM dispatch_to_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary img;
+    bool small = enif_inspect_binary(env, argv[1], &img) && img.size <= SMALL_IMAGE_BYTES &&
+                 single_threaded(env, argv[5]);
+    PoolNif nif = scoped_to_binary;
+    if (!small && enif_is_identical(argv[0], enif_make_atom(env, "png"))) {
+        nif = png_start;
+    } else if (!small && enif_is_identical(argv[0], enif_make_atom(env, "jpg"))) {
+        nif = jpeg_start;
+    }
+    return run_or_schedule(env, "to_binary", small, nif, argc, argv);
+}
+
+static ERL_NIF_TERM dispatch_resize(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary input;
+    int output_h, output_w, channels;
+    bool small = enif_inspect_binary(env, argv[0], &input) && input.size <= SMALL_IMAGE_BYTES &&
+                 enif_get_int(env, argv[3], &channels) && enif_get_int(env, argv[4], &output_h) &&
+                 enif_get_int(env, argv[5], &output_w) && output_h > 0 && output_w > 0 && channels > 0 &&
+                 (size_t)output_h * output_w * channels * 4 <= SMALL_IMAGE_BYTES && single_threaded(env, argv[7]);
+#ifdef STBIR_PROFILE
+    // Profiles are read from the samplers of whole resizes
+    PoolNif large = scoped_resize;
+#else
+    PoolNif large = resize_start;
+#endif
+    return run_or_schedule(env, "resize", small, small ? scoped_resize : large, argc, argv);
+}
+
+static const struct {
+    const char *name;
+    int arity;
+    PoolNif nif;
+} async_nifs[] = {
+    {"read_file", 5, scoped_read_file},
+    {"read_binary", 5, scoped_read_binary},
+    {"read_gif_binary", 1, scoped_read_gif_binary},
+    {"write_file", 7, scoped_write_file},
+    {"to_binary", 6, scoped_to_binary},
+    {"resize", 8, scoped_resize}};
+
+// Runs the NIF named by the atom in argv[0] with the arguments in the
+// argv[1] list on the async pool, started with argv[2] threads and
+// holding up to argv[3] queued jobs. Returns a reference sent back along
+// with the result.
+static ERL_NIF_TERM async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    char name[16];
+    unsigned length;
+    int threads, max_queue;
+    ERL_NIF_TERM args[POOL_MAX_ARGS];
+
+    if (!enif_get_atom(env, argv[0], name, sizeof(name), ERL_NIF_LATIN1)) {
+        return error(env, "invalid function");
+    }
+    if (!enif_get_list_length(env, argv[1], &length) || length > POOL_MAX_ARGS) {
+        return error(env, "invalid arguments");
+    }
+    if (!enif_get_int(env, argv[2], &threads) || threads <= 0) {
+        return error(env, "invalid threads");
+    }
+    if (!enif_get_int(env, argv[3], &max_queue) || max_queue < 0) {
+        return error(env, "invalid max queue");
+    }
+
+    PoolNif nif = NULL;
+    for (size_t i = 0; i < sizeof(async_nifs) / sizeof(async_nifs[0]); ++i) {
+        if (strcmp(name, async_nifs[i].name) == 0 && (unsigned)async_nifs[i].arity == length) {
+            nif = async_nifs[i].nif;
+        }
+    }
+    if (nif == NULL) {
+        return error(env, "invalid function");
+    }
+
+    ERL_NIF_TERM list = argv[1];
+    for (unsigned i = 0; i < length; ++i) {
+        enif_get_list_cell(env, list, &args[i], &list);
+    }
+
+    ERL_NIF_TERM ref = enif_make_ref(env);
+    const char *reason = pool_submit(&async_pool, env, nif, threads, max_queue, (int)length, args, ref);
+    if (reason != NULL) {
+        return error(env, reason);
+    }
+    return enif_make_tuple2(env, enif_make_atom(env, "ok"), ref);
+}
+
+static ERL_NIF_TERM async_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return pool_stats(env, &async_pool);
+}
+
+static ErlNifFunc nif_functions[] = {
+    {"read_file", 5, scoped_read_file, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"read_binary", 5, dispatch_read_binary, 0},
+    {"read_gif_binary", 1, scoped_read_gif_binary, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"write_file", 7, scoped_write_file, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"to_binary", 6, dispatch_to_binary, 0},
+    {"resize", 8, dispatch_resize, 0},
+    {"pyramid", 7, scoped_pyramid, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"resize_many", 8, scoped_resize_many, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"premultiply", 3, premultiply, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"unpremultiply", 3, unpremultiply, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"resize_plan_new", 7, resize_plan_new, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"resize_plan_run", 2, scoped_resize_plan_run, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"png_writer_open", 5, png_writer_open, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"png_writer_write", 2, png_writer_write, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"png_writer_close", 1, png_writer_close, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"memory_stats", 0, memory_stats, 0},
+    {"async", 4, async, 0},
+    {"async_stats", 0, async_stats, 0},
+    {"slice_stats", 0, slice_stats, 0}};
+
+ERL_NIF_INIT(Elixir.StbImage.Nif, nif_functions, on_load, on_reload, on_upgrade, on_unload);
 
 #if defined(__GNUC__)
 #pragma GCC visibility push(default)
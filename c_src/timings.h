@@ -0,0 +1,38 @@
+#pragma once
+
+// Monotonic timings of the phases of a NIF call, returned to Elixir as a
+// map of phase names to nanoseconds and emitted as telemetry events.
+
+#include "erl_nif.h"
+
+typedef enum {
+    PHASE_DECODE,
+    PHASE_ENCODE,
+    PHASE_RESIZE,
+    PHASE_COPY,
+    PHASE_ALLOC,
+    PHASE_COUNT
+} Phase;
+
+typedef struct {
+    ErlNifTime phases[PHASE_COUNT];
+} Timings;
+
+static const char *const phase_names[PHASE_COUNT] = {"decode", "encode", "resize", "copy", "alloc"};
+
+static inline ErlNifTime timings_now(void) {
+    return enif_monotonic_time(ERL_NIF_NSEC);
+}
+
+// Adds the time elapsed since `start` to `phase`
+static inline void timings_add(Timings *timings, Phase phase, ErlNifTime start) {
+    timings->phases[phase] += timings_now() - start;
+}
+
+// Puts the phases into `map`
+static ERL_NIF_TERM timings_put(ErlNifEnv *env, const Timings *timings, ERL_NIF_TERM map) {
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        enif_make_map_put(env, map, enif_make_atom(env, phase_names[i]), enif_make_int64(env, timings->phases[i]), &map);
+    }
+    return map;
+}
@@ -2,7 +2,8 @@ defmodule StbImage do
   @moduledoc """
   Tiny module for image encoding and decoding.
 
-  The following formats are supported and have type u8:
+  The following formats are supported and have type u8 (or u16, see
+  the `:bit_depth` option of `read_file/2`):
 
     * JPEG baseline & progressive (12 bpc/arithmetic not supported, same as stock IJG lib)
     * PNG 1/2/4/8/16-bit-per-channel
@@ -12,11 +13,15 @@ defmodule StbImage do
     * GIF (always reports as 4-channel)
     * PIC (Softimage PIC)
     * PNM (PPM and PGM binary only)
+    * QOI
 
   The following formats are supported and have type f32:
 
     * HDR (radiance rgbE format) (type is f32)
 
+  Images of type u16 can be written as 16-bit PNGs. Images of type f16
+  can be resized and converted to and from tensors, but not encoded.
+
   There are also specific functions for working with GIFs.
 
   ## Nx integration
@@ -25,6 +30,56 @@ defmodule StbImage do
   and it will be automatically converted to tensors. You can
   also explicitly convert to and from tensors using `to_nx/2`
   and `from_nx/1`.
+
+  ## Scheduling
+
+  Large images are handled on dirty CPU schedulers. Resizing them and
+  encoding them as PNG or JPEG is split into slices of about 50ms. The
+  work stops at the next slice once the calling process has exited, for
+  instance after being killed on a timeout. `slice_stats/0` counts the
+  slices run and the operations stopped.
+
+  ## Telemetry
+
+  The following `:telemetry` events are emitted once the operation
+  succeeds:
+
+    * `[:stb_image, :decode, :stop]` - by `read_file/2`,
+      `read_binary/2` and `read_gif_binary/1`. The metadata holds the
+      `:format` of the image (such as `:png`), the number of encoded
+      `:bytes`, and the `:shape` and `:type` of the result. GIFs also
+      have the number of `:frames`.
+
+    * `[:stb_image, :encode, :stop]` - by `write_file/3` and
+      `to_binary/3`, with the `:format`, the encoded `:bytes`, and the
+      `:shape` and `:type` of the image as metadata.
+
+    * `[:stb_image, :resize, :stop]` - by `resize/4` and
+      `StbImage.ResizePlan.resize/2`, with the `:input_shape`,
+      `:output_shape`, `:type`, `:output_type`, `:filter` and `:threads`
+      as metadata.
+
+    * `[:stb_image, :resize_many, :stop]` - by `resize_many/3`, with the
+      same metadata as `:resize` and the `:count` of images.
+
+    * `[:stb_image, :pyramid, :stop]` - by `pyramid/2`, with the
+      `:input_shape`, the number of `:levels`, the `:type`, `:filter`
+      and `:threads` as metadata.
+
+  The measurements, all in `:native` time units, are the `:duration`
+  of the whole call and the time spent natively in each phase:
+  `:decode`, `:encode`, `:resize`, `:copy` (into the returned binary)
+  and `:alloc`. What the duration adds to the phases is mostly time
+  spent waiting for a dirty scheduler. Encoding to a file includes
+  writing it, and resizing QOI images while decoding them with
+  `:resize_to` counts as resizing.
+
+  The `:memory` measurement is the peak number of bytes held by
+  stb during the call, on the calling thread and on the threads
+  requested with `:threads`. See `memory_stats/0` for the totals.
+
+  These events are the only way to get the timings, the functions
+  return the same results whether a handler is attached or not.
   """
 
   @doc """
@@ -34,7 +89,8 @@ defmodule StbImage do
 
     * `:data` - a blob with the image bytes in HWC (heigth-width-channels) order
     * `:shape` - a tuple with the `{height, width, channels}`
-    * `:type` - the type unit in the binary (`{:u, 8}` or `{:f, 32}`)
+    * `:type` - the type unit in the binary (`{:u, 8}`, `{:u, 16}`,
+      `{:f, 16}` or `{:f, 32}`)
 
   The number of channels correlates directly to the color mode.
   1 channel is greyscale, 2 is greyscale+alpha, 3 is RGB, and
@@ -55,8 +111,9 @@ defmodule StbImage do
   ## Options
 
     * `:type` - The type of the data. Defaults to `{:u, 8}`.
-      Must be one of `{:u, 8}` or `{:f, 32}`. The `:u8` and
-      `:f32` convenience atom syntax is also available.
+      Must be one of `{:u, 8}`, `{:u, 16}`, `{:f, 16}` or `{:f, 32}`.
+      The `:u8`, `:u16`, `:f16` and `:f32` convenience atom syntax is
+      also available.
 
   """
   def new(data, {h, w, c} = shape, opts \\ [])
@@ -87,7 +144,7 @@ defmodule StbImage do
     Creates a `StbImage` from a Nx tensor.
 
     The tensor is expected to have the shape `{h, w, c}`
-    and one of the supported types (u8/f32).
+    and one of the supported types (u8/u16/f16/f32).
     """
     def from_nx(tensor) when is_struct(tensor, Nx.Tensor) do
       new(Nx.to_binary(tensor), tensor_shape(Nx.shape(tensor)),
@@ -95,11 +152,14 @@ defmodule StbImage do
       )
     end
 
-    defp tensor_type({:u, 8}), do: {:u, 8}
-    defp tensor_type({:f, 32}), do: {:f, 32}
+    defp tensor_type(type) when type in [{:u, 8}, {:u, 16}, {:f, 16}, {:f, 32}], do: type
 
     defp tensor_type(type),
-      do: raise(ArgumentError, "unsupported tensor type: #{inspect(type)} (expected u8/f32)")
+      do:
+        raise(
+          ArgumentError,
+          "unsupported tensor type: #{inspect(type)} (expected u8/u16/f16/f32)"
+        )
 
     defp tensor_shape({_, _, c} = shape) when c in 1..4,
       do: shape
@@ -215,6 +275,34 @@ defmodule StbImage do
     * `:channels` - The number of desired channels.
       Use `0` for auto-detection. Defaults to 0.
 
+    * `:bit_depth` - Either `8`, which converts 16-bit PNG and PSD
+      images to 8 bits, or `16`, which decodes them as `{:u, 16}` at
+      full precision. Other images are not affected. Defaults to `8`.
+
+    * `:resize_to` - a `{height, width}` to resize the image to as it
+      is read, which is cheaper than `resize/4` afterwards: the decoded
+      image is freed as soon as it is resized and, for QOI, PNG and
+      baseline JPEG images, rows are resized as they are decoded, so the
+      full resolution image is never held in memory. Interlaced PNGs,
+      progressive JPEGs and other formats are decoded in full first.
+      Defaults to `nil`.
+
+    * `:resize_options` - the options of `resize/4` used by
+      `:resize_to`, except for `:crop`. Images are only resized while
+      decoded with a single thread, and QOI images with 0, 3 or 4
+      channels. Defaults to `[]`.
+
+    * `:max_pixels` - return an error, without decoding, when the
+      image has more pixels than this. Defaults to the `:max_pixels`
+      application environment, which is `nil` for no limit.
+
+    * `:max_bytes` - return an error, without decoding, when decoding
+      the image is estimated to need more bytes than this. The estimate
+      is taken from the image header and covers the decoded pixels,
+      the intermediate buffers of the format and the returned binary.
+      Defaults to the `:max_bytes` application environment, which is
+      `nil` for no limit.
+
   ## Example
 
       {:ok, img} = StbImage.read_file("/path/to/image")
@@ -226,17 +314,24 @@ defmodule StbImage do
       {h, w, c} = img.shape
       img = img.data
 
+      # Thumbnail a large scan
+      {:ok, thumbnail} = StbImage.read_file("/path/to/scan.qoi", resize_to: {256, 256})
+
+      # Refuse images over 50 megapixels, which can also be set for all
+      # calls with `config :stb_image, max_pixels: 50_000_000`
+      {:error, _} = StbImage.read_file("/path/to/huge.png", max_pixels: 50_000_000)
+
   """
   def read_file(path, opts \\ []) when is_path(path) and is_list(opts) do
-    channels = opts[:channels] || 0
-
-    case StbImage.Nif.read_file(path_to_binary(path), channels) do
-      {:ok, img, shape, bytes} ->
-        {:ok, %StbImage{data: img, shape: shape, type: bytes_to_type(bytes)}}
+    path |> read_file_call(opts) |> call_nif()
+  end
 
-      {:error, reason} ->
-        {:error, List.to_string(reason)}
-    end
+  # Each operation is split into its NIF call, as {name, args}, and a
+  # function handling the NIF result, so it can also run through
+  # StbImage.Async
+  @doc false
+  def read_file_call(path, opts) do
+    read_call(:read_file, path_to_binary(path), opts)
   end
 
   @doc """
@@ -257,6 +352,34 @@ defmodule StbImage do
     * `:channels` - The number of desired channels.
       Use `0` for auto-detection. Defaults to 0.
 
+    * `:bit_depth` - Either `8`, which converts 16-bit PNG and PSD
+      images to 8 bits, or `16`, which decodes them as `{:u, 16}` at
+      full precision. Other images are not affected. Defaults to `8`.
+
+    * `:resize_to` - a `{height, width}` to resize the image to as it
+      is read, which is cheaper than `resize/4` afterwards: the decoded
+      image is freed as soon as it is resized and, for QOI, PNG and
+      baseline JPEG images, rows are resized as they are decoded, so the
+      full resolution image is never held in memory. Interlaced PNGs,
+      progressive JPEGs and other formats are decoded in full first.
+      Defaults to `nil`.
+
+    * `:resize_options` - the options of `resize/4` used by
+      `:resize_to`, except for `:crop`. Images are only resized while
+      decoded with a single thread, and QOI images with 0, 3 or 4
+      channels. Defaults to `[]`.
+
+    * `:max_pixels` - return an error, without decoding, when the
+      image has more pixels than this. Defaults to the `:max_pixels`
+      application environment, which is `nil` for no limit.
+
+    * `:max_bytes` - return an error, without decoding, when decoding
+      the image is estimated to need more bytes than this. The estimate
+      is taken from the image header and covers the decoded pixels,
+      the intermediate buffers of the format and the returned binary.
+      Defaults to the `:max_bytes` application environment, which is
+      `nil` for no limit.
+
   ## Example
 
       {:ok, buffer} = File.read("/path/to/image")
@@ -271,14 +394,85 @@ defmodule StbImage do
 
   """
   def read_binary(buffer, opts \\ []) when is_binary(buffer) and is_list(opts) do
+    buffer |> read_binary_call(opts) |> call_nif()
+  end
+
+  @doc false
+  def read_binary_call(buffer, opts), do: read_call(:read_binary, buffer, opts)
+
+  defp read_call(nif, source, opts) do
     channels = opts[:channels] || 0
 
-    case StbImage.Nif.read_binary(buffer, channels) do
-      {:ok, img, shape, bytes} ->
-        {:ok, %StbImage{data: img, shape: shape, type: bytes_to_type(bytes)}}
+    bit_depth = bit_depth_option(opts)
+    resize_to = resize_to_option(opts)
+    limits = read_limits(opts)
 
-      {:error, reason} ->
-        {:error, List.to_string(reason)}
+    start_time = System.monotonic_time()
+
+    {{nif, [source, channels, bit_depth, resize_to, limits]},
+     fn
+       {:ok, img, shape, bytes, stats} ->
+         type = read_type(bytes, resize_to, opts)
+         emit_stop(:decode, start_time, stats, %{shape: shape, type: type})
+         {:ok, %StbImage{data: img, shape: shape, type: type}}
+
+       {:error, reason} ->
+         {:error, List.to_string(reason)}
+     end}
+  end
+
+  defp call_nif({{name, args}, handle}), do: handle.(apply(StbImage.Nif, name, args))
+
+  defp bit_depth_option(opts) do
+    case Keyword.get(opts, :bit_depth, 8) do
+      bit_depth when bit_depth in [8, 16] ->
+        bit_depth
+
+      other ->
+        raise ArgumentError, "expected :bit_depth to be 8 or 16, got: #{inspect(other)}"
+    end
+  end
+
+  defp resize_to_option(opts) do
+    case Keyword.get(opts, :resize_to) do
+      nil ->
+        nil
+
+      {h, w} when is_dimension(h) and is_dimension(w) ->
+        resize_opts = Keyword.get(opts, :resize_options, [])
+
+        if Keyword.has_key?(resize_opts, :crop) do
+          raise ArgumentError, ":crop is not supported in :resize_options"
+        end
+
+        {h, w, resize_options(resize_opts, {h, w})}
+
+      other ->
+        raise ArgumentError,
+              "expected :resize_to to be a {height, width} tuple, got: #{inspect(other)}"
+    end
+  end
+
+  defp read_limits(opts) do
+    for key <- [:max_pixels, :max_bytes],
+        limit = Keyword.get_lazy(opts, key, fn -> Application.fetch_env!(:stb_image, key) end),
+        limit != nil,
+        into: %{} do
+      if is_integer(limit) and limit > 0 do
+        {key, limit}
+      else
+        raise ArgumentError,
+              "expected #{inspect(key)} to be a positive integer or nil, got: #{inspect(limit)}"
+      end
+    end
+  end
+
+  defp read_type(bytes, nil, _opts), do: bytes_to_type(bytes)
+
+  defp read_type(bytes, _resize_to, opts) do
+    case Keyword.fetch(Keyword.get(opts, :resize_options, []), :output_type) do
+      {:ok, type} -> type(type, :output_type)
+      :error -> bytes_to_type(bytes)
     end
   end
 
@@ -320,14 +514,27 @@ defmodule StbImage do
 
   """
   def read_gif_binary(binary) when is_binary(binary) do
-    with {:ok, frames, shape, delays} <- StbImage.Nif.read_gif_binary(binary) do
-      stb_frames = for frame <- frames, do: %StbImage{data: frame, shape: shape, type: {:u, 8}}
+    binary |> read_gif_binary_call() |> call_nif()
+  end
 
-      {:ok, stb_frames, delays}
-    end
+  @doc false
+  def read_gif_binary_call(binary) do
+    start_time = System.monotonic_time()
+
+    {{:read_gif_binary, [binary]},
+     fn
+       {:ok, frames, shape, delays, stats} ->
+         metadata = %{shape: shape, type: {:u, 8}, frames: length(frames)}
+         emit_stop(:decode, start_time, stats, metadata)
+         stb_frames = for frame <- frames, do: %StbImage{data: frame, shape: shape, type: {:u, 8}}
+         {:ok, stb_frames, delays}
+
+       error ->
+         error
+     end}
   end
 
-  @encoding_formats ~w(jpg png bmp tga hdr)a
+  @encoding_formats ~w(jpg png bmp tga hdr qoi)a
   @encoding_formats_string Enum.map_join(@encoding_formats, ", ", &inspect/1)
 
   @doc """
@@ -347,16 +554,29 @@ defmodule StbImage do
 
     * `:format` - one of the supported image formats
 
+  It also accepts the encoding options listed in `to_binary/3`.
   """
-  def write_file(%StbImage{data: data, shape: shape, type: type}, path, opts \\ []) do
+  def write_file(%StbImage{} = image, path, opts \\ []) do
+    image |> write_file_call(path, opts) |> call_nif()
+  end
+
+  @doc false
+  def write_file_call(%StbImage{data: data, shape: shape, type: type}, path, opts) do
     {height, width, channels} = shape
     format = opts[:format] || format_from_path!(path)
     assert_write_type_and_format!(type, format)
-
-    case StbImage.Nif.write_file(path_to_binary(path), format, data, height, width, channels) do
-      :ok -> :ok
-      {:error, reason} -> {:error, List.to_string(reason)}
-    end
+    options = format |> encode_options(opts) |> put_bit_depth(type)
+    start_time = System.monotonic_time()
+
+    {{:write_file, [path_to_binary(path), format, data, height, width, channels, options]},
+     fn
+       {:ok, stats} ->
+         emit_stop(:encode, start_time, stats, %{format: format, shape: shape, type: type})
+         :ok
+
+       {:error, reason} ->
+         {:error, List.to_string(reason)}
+     end}
   end
 
   @doc """
@@ -374,47 +594,553 @@ defmodule StbImage do
 
   The supported formats are #{@encoding_formats_string}.
 
+  Images of type `{:u, 16}` can be encoded as `:png`, keeping all 16
+  bits per channel. Other formats require `{:u, 8}` images, except for
+  `:hdr`, which requires `{:f, 32}` images.
+
+  ## Options
+
+  The following options apply to `:jpg` only:
+
+    * `:quality` - an integer between 1 and 100. Lower values give
+      smaller files at the cost of fidelity. Defaults to 100.
+
+    * `:subsampling` - the chroma subsampling, one of `:yuv444`
+      (full resolution colour) or `:yuv420` (colour at half the
+      resolution in both directions, noticeably smaller files).
+      Defaults to `:auto`, which picks `:yuv420` when `:quality`
+      is 90 or lower and `:yuv444` otherwise.
+
+    * `:restart_interval` - emit a restart marker every given number
+      of MCU rows (8 or 16 pixel rows, depending on `:subsampling`).
+      Restart-aware decoders can decode such segments in parallel.
+      Defaults to `0`, which disables restart markers.
+
+    * `:threads` - the number of native threads used to entropy code
+      the image. When greater than 1, restart markers are emitted even
+      if `:restart_interval` is not given, so that each thread gets its
+      own segments. Values over 64 count as 64. Defaults to `1`.
+
+    * `:optimize_huffman` - when `true`, gathers symbol statistics in a
+      first pass over the image and writes Huffman tables tailored to it
+      instead of the standard ones. Files are typically 5-10% smaller
+      for the same quality, at the cost of a second pass over the
+      image. Defaults to `false`.
+
   ## Example
 
       img = StbImage.new(raw_img, {h, w, channels})
       binary = StbImage.to_binary(img, :png)
+      binary = StbImage.to_binary(img, :jpg, quality: 80)
 
   """
-  def to_binary(%StbImage{data: data, shape: shape, type: type}, format) do
+  def to_binary(%StbImage{} = image, format, opts \\ []) do
+    image |> to_binary_call(format, opts) |> call_nif()
+  end
+
+  @doc false
+  def to_binary_call(%StbImage{data: data, shape: shape, type: type}, format, opts) do
     assert_write_type_and_format!(type, format)
     {height, width, channels} = shape
+    options = format |> encode_options(opts) |> put_bit_depth(type)
 
-    case StbImage.Nif.to_binary(format, data, height, width, channels) do
-      {:ok, binary} -> binary
-      {:error, reason} -> raise ArgumentError, "#{reason}"
-    end
+    start_time = System.monotonic_time()
+
+    {{:to_binary, [format, data, height, width, channels, options]},
+     fn
+       {:ok, binary, stats} ->
+         metadata = %{format: format, shape: shape, type: type, bytes: byte_size(binary)}
+         emit_stop(:encode, start_time, stats, metadata)
+         binary
+
+       {:error, reason} ->
+         raise ArgumentError, "#{reason}"
+     end}
   end
 
+  # Values of stbir_datatype, stbir_filter and stbir_edge
+  @resize_types %{{:u, 8} => 0, {:u, 16} => 3, {:f, 32} => 4, {:f, 16} => 5}
+
+  @resize_filters %{
+    default: 0,
+    box: 1,
+    triangle: 2,
+    cubic_bspline: 3,
+    catmull_rom: 4,
+    mitchell: 5,
+    point: 6
+  }
+
+  @resize_edges %{clamp: 0, reflect: 1, wrap: 2, zero: 3}
+
   @doc """
   Resizes the image into the given `output_h` and `output_w`.
 
+  ## Options
+
+    * `:threads` - the number of native threads used to resize the
+      image. The filter coefficients are computed once and the output
+      rows are split across the threads. Values over 64 count as 64.
+      Defaults to `1`.
+
+    * `:filter` - the resampling filter, one of:
+
+        * `:default` - `:catmull_rom` when upsampling and `:mitchell`
+          when downsampling
+        * `:point` - nearest neighbour, which never mixes pixel values
+          and is suited to masks and label maps
+        * `:box` - averages the covered input pixels. Downscaling by
+          exact integer factors (such as 4000x3000 to 1000x750) uses
+          dedicated averaging kernels that are up to twice as fast
+        * `:triangle` - bilinear interpolation when upsampling
+        * `:cubic_bspline` - a smooth, slightly blurry cubic
+        * `:catmull_rom` - an interpolating, sharper cubic
+        * `:mitchell` - a cubic balancing blur and ringing
+
+      `:point` and `:box` are roughly twice as fast as the cubic
+      filters, with `:triangle` in between. Run `mix run bench/resize.exs`
+      to measure them on your machine. Defaults to `:default`.
+
+    * `:edge` - how pixels outside of the image are sampled, one of
+      `:clamp`, `:reflect`, `:wrap` or `:zero`. Defaults to `:clamp`.
+
+    * `:premultiplied` - whether the color channels of 2 and 4-channel
+      images are already multiplied by alpha (the last channel). By
+      default, alpha is assumed to be straight, and the color is
+      premultiplied before filtering and divided back afterwards so
+      transparent pixels do not bleed into their neighbours. Pass `true`
+      for premultiplied images, see `premultiply/1`, to skip both passes.
+      Defaults to `false`.
+
+    * `:output_type` - the type of the resized image, one of `:u8`,
+      `:u16`, `:f16` or `:f32` (or their tuple forms). The conversion
+      happens as the resized pixels are written, so converting costs no
+      extra pass or buffer. Integer types are normalized, so 255 in a
+      `{:u, 8}` image becomes 1.0 in `{:f, 32}` and 65535 in `{:u, 16}`.
+      Defaults to the type of the image.
+
+    * `:crop` - a `{y, x, h, w}` region of the image to resize instead
+      of the whole image. The region is read in place, so cropping costs
+      nothing, and it may start and end between pixels, in which case
+      the filter samples the surrounding pixels of the image. Defaults
+      to the whole image.
+
   ## Example
 
       img = StbImage.new(raw_img, {h, w, channels})
       StbImage.resize(raw_img, div(h, 2), div(w, 2))
+      StbImage.resize(raw_img, div(h, 2), div(w, 2), threads: 4)
+
+      # Center crop to a square and resize it
+      side = min(h, w)
+      crop = {div(h - side, 2), div(w - side, 2), side, side}
+      StbImage.resize(raw_img, 224, 224, crop: crop)
+
+      # Resize and convert to floats for a model in one pass
+      StbImage.resize(raw_img, 224, 224, output_type: :f32)
+
+  ## Profiling
+
+  When the NIF is compiled from source with the `STB_IMAGE_PROFILE=1`
+  environment variable, every resize done by stb_image_resize2 emits a
+  `[:stb_image, :resize, :profile]` telemetry event breaking its time
+  down into stages. The measurements are CPU timestamp counter ticks
+  (not time units), summed over threads:
+
+    * `:build` - computing the filter coefficients
+    * `:decode` - converting input rows to floats
+    * `:alpha_weight` and `:alpha_unweight` - premultiplying and
+      unpremultiplying alpha around the filters
+    * `:horizontal` and `:vertical` - filtering along each axis
+    * `:encode` - converting output rows to the output type
+    * `:looping` - everything else
+    * `:total` - the whole resize (of the first thread only)
+
+  The metadata holds the `:input_shape`, `:output_shape`, `:type`,
+  `:output_type`, `:filter` and `:threads`. Downscales using the box
+  kernels described above are not profiled. Profiling adds a small
+  overhead to every resize and is not supported on all platforms, such
+  as RISC-V.
 
   """
-  def resize(
+  def resize(%StbImage{} = image, output_h, output_w, opts \\ [])
+      when is_dimension(output_h) and is_dimension(output_w) do
+    image |> resize_call(output_h, output_w, opts) |> call_nif()
+  end
+
+  @doc false
+  def resize_call(
         %StbImage{data: data, shape: {height, width, channels}, type: type},
         output_h,
-        output_w
-      )
-      when is_dimension(output_h) and is_dimension(output_w) do
-    case StbImage.Nif.resize(data, height, width, channels, output_h, output_w, bytes(type)) do
-      {:ok, output_pixels} ->
-        %StbImage{data: output_pixels, shape: {output_h, output_w, channels}, type: type}
+        output_w,
+        opts
+      ) do
+    options = resize_options(opts, {height, width})
+    output_type = type(Keyword.get(opts, :output_type, type), :output_type)
+
+    metadata = %{
+      input_shape: {height, width, channels},
+      output_shape: {output_h, output_w, channels},
+      type: type,
+      output_type: output_type,
+      filter: Keyword.get(opts, :filter, :default),
+      threads: options.threads
+    }
+
+    start_time = System.monotonic_time()
+    args = [data, height, width, channels, output_h, output_w, resize_type(type), options]
+
+    {{:resize, args},
+     fn result ->
+       output_pixels =
+         case result do
+           {:ok, output_pixels, stats} ->
+             emit_stop(:resize, start_time, stats, metadata)
+             output_pixels
+
+           {:ok, output_pixels, stats, profile} ->
+             emit_stop(:resize, start_time, stats, metadata)
+             :telemetry.execute([:stb_image, :resize, :profile], profile, metadata)
+             output_pixels
+
+           {:error, reason} ->
+             raise ArgumentError, "#{reason}"
+         end
+
+       %StbImage{data: output_pixels, shape: {output_h, output_w, channels}, type: output_type}
+     end}
+  end
+
+  @doc """
+  Multiplies the color channels of the image by its alpha channel.
+
+  The image must have 2 (gray and alpha) or 4 (RGBA) channels, of any
+  type. Integer channels are rounded to nearest. Keeping images
+  premultiplied lets `resize/4` skip the alpha weighting passes
+  with `premultiplied: true`, which roughly halves the cost of resizing
+  RGBA images.
+
+  ## Example
+
+      img
+      |> StbImage.premultiply()
+      |> StbImage.resize(h, w, premultiplied: true)
+      |> StbImage.unpremultiply()
 
-      {:error, reason} ->
-        raise ArgumentError, "#{reason}"
+  """
+  def premultiply(%StbImage{} = img), do: convert_alpha(img, &StbImage.Nif.premultiply/3)
+
+  @doc """
+  Divides the color channels of a premultiplied image by its alpha
+  channel, the inverse of `premultiply/1`.
+
+  Fully transparent pixels become black.
+  """
+  def unpremultiply(%StbImage{} = img), do: convert_alpha(img, &StbImage.Nif.unpremultiply/3)
+
+  defp convert_alpha(%StbImage{data: data, shape: {_, _, channels}, type: type} = img, fun)
+       when channels in [2, 4] do
+    case fun.(data, channels, resize_type(type)) do
+      {:ok, data} -> %{img | data: data}
+      {:error, reason} -> raise ArgumentError, "#{reason}"
     end
   end
 
-  defp assert_write_type_and_format!(type, format) when format in [:png, :jpg, :bmp, :tga] do
+  defp convert_alpha(%StbImage{shape: shape}, _fun) do
+    raise ArgumentError, "expected an image with 2 or 4 channels, got shape: #{inspect(shape)}"
+  end
+
+  @doc """
+  Resizes a batch of images of the same shape and type into `output_h`
+  and `output_w`.
+
+  This suits batches such as video or GIF frames. The filter
+  coefficients are computed once per native thread instead of once per
+  image. The images are spread across the threads, and all results are
+  written into one binary.
+
+  Returns a list with one image per input image. With `packed: true`,
+  returns `{binary, {count, output_h, output_w, channels}}` instead, where
+  `binary` holds the resized images back to back. In both cases the
+  images share the same underlying binary.
+
+  ## Options
+
+    * `:packed` - whether to return a single binary. Defaults to `false`.
+
+    * `:threads` - the number of native threads. Each thread resizes
+      whole images, and threads beyond the number of images split the
+      rows of each image. Values over 64 count as 64. Defaults to `1`.
+
+  It also accepts the other options listed in `resize/4`.
+
+  ## Example
+
+      {:ok, frames, _delays} = StbImage.read_gif_file("animation.gif")
+      thumbnails = StbImage.resize_many(frames, {64, 64}, threads: 4)
+
+  """
+  def resize_many(images, {output_h, output_w}, opts \\ [])
+      when is_list(images) and is_dimension(output_h) and is_dimension(output_w) do
+    case images do
+      [] ->
+        raise ArgumentError, "expected a non-empty list of images"
+
+      [%StbImage{shape: {height, width, channels} = shape, type: type} | _] ->
+        data =
+          for image <- images do
+            case image do
+              %StbImage{data: data, shape: ^shape, type: ^type} ->
+                data
+
+              other ->
+                raise ArgumentError,
+                      "expected all images to have shape #{inspect(shape)} and type " <>
+                        "#{inspect(type)}, got: #{inspect(other)}"
+            end
+          end
+
+        options = resize_options(opts, {height, width})
+        output_type = type(Keyword.get(opts, :output_type, type), :output_type)
+
+        metadata = %{
+          count: length(images),
+          input_shape: shape,
+          output_shape: {output_h, output_w, channels},
+          type: type,
+          output_type: output_type,
+          filter: Keyword.get(opts, :filter, :default),
+          threads: options.threads
+        }
+
+        start_time = System.monotonic_time()
+
+        binary =
+          case StbImage.Nif.resize_many(
+                 data,
+                 height,
+                 width,
+                 channels,
+                 output_h,
+                 output_w,
+                 resize_type(type),
+                 options
+               ) do
+            {:ok, binary, stats} ->
+              emit_stop(:resize_many, start_time, stats, metadata)
+              binary
+
+            {:error, reason} ->
+              raise ArgumentError, "#{reason}"
+          end
+
+        if Keyword.get(opts, :packed, false) do
+          {binary, {length(images), output_h, output_w, channels}}
+        else
+          size = output_h * output_w * channels * bytes(output_type)
+
+          for i <- 0..(length(images) - 1) do
+            %StbImage{
+              data: binary_part(binary, i * size, size),
+              shape: {output_h, output_w, channels},
+              type: output_type
+            }
+          end
+        end
+    end
+  end
+
+  @doc """
+  Builds an image pyramid, such as mipmaps or tile levels, in one call.
+
+  Every level halves the height and width of the previous one (rounding
+  down, and never below 1) and is resized from the previous level rather
+  than from the original image, so each level reads a quarter of the
+  pixels of the one before it. The first level is half the size of the
+  given image, which is not included.
+
+  Returns a list with one image per level, largest first. With
+  `packed: true`, returns `{binary, levels}` instead, where `binary`
+  holds all levels back to back and `levels` is a list of
+  `{offset, shape}` tuples locating each level in it. In both cases the
+  levels share the same underlying binary.
+
+  ## Options
+
+    * `:levels` - the number of levels. Defaults to halving until both
+      dimensions are 1.
+
+    * `:packed` - whether to return a single binary with offsets.
+      Defaults to `false`.
+
+    * `:filter` - defaults to `:box`, which uses the integer-ratio box
+      kernels on even dimensions.
+
+    * `:threads` - the levels are computed one after the other, since
+      each level depends on the previous one, and the rows of every
+      level are split across the threads. Values over 64 count as 64.
+      Defaults to `1`.
+
+  It also accepts the `:edge` option listed in `resize/4`.
+
+  ## Example
+
+      img = StbImage.read_file!("tile.png")
+      [l1, l2, l3] = StbImage.pyramid(img, levels: 3)
+      {binary, [{0, shape} | _]} = StbImage.pyramid(img, packed: true, threads: 4)
+
+  """
+  def pyramid(%StbImage{data: data, shape: {height, width, channels}, type: type}, opts \\ []) do
+    shapes = pyramid_shapes(height, width, channels, levels_option(opts, height, width))
+    packed = Keyword.get(opts, :packed, false)
+
+    options =
+      opts
+      |> Keyword.take([:threads, :filter, :edge])
+      |> Keyword.put_new(:filter, :box)
+      |> resize_options({height, width})
+
+    metadata = %{
+      input_shape: {height, width, channels},
+      levels: length(shapes),
+      type: type,
+      filter: Keyword.get(opts, :filter, :box),
+      threads: options.threads
+    }
+
+    start_time = System.monotonic_time()
+
+    binary =
+      case shapes do
+        [] ->
+          <<>>
+
+        _ ->
+          case StbImage.Nif.pyramid(
+                 data,
+                 height,
+                 width,
+                 channels,
+                 resize_type(type),
+                 length(shapes),
+                 options
+               ) do
+            {:ok, binary, stats} ->
+              emit_stop(:pyramid, start_time, stats, metadata)
+              binary
+
+            {:error, reason} ->
+              raise ArgumentError, "#{reason}"
+          end
+      end
+
+    {levels, _} =
+      Enum.map_reduce(shapes, 0, fn {h, w, c} = shape, offset ->
+        {{offset, shape}, offset + h * w * c * bytes(type)}
+      end)
+
+    if packed do
+      {binary, levels}
+    else
+      for {offset, {h, w, c} = shape} <- levels do
+        size = h * w * c * bytes(type)
+        %StbImage{data: binary_part(binary, offset, size), shape: shape, type: type}
+      end
+    end
+  end
+
+  defp levels_option(opts, height, width) do
+    case Keyword.fetch(opts, :levels) do
+      {:ok, levels} when is_integer(levels) and levels > 0 ->
+        levels
+
+      {:ok, other} ->
+        raise ArgumentError, "expected :levels to be a positive integer, got: #{inspect(other)}"
+
+      :error ->
+        max_levels(max(height, width), 0)
+    end
+  end
+
+  defp max_levels(1, levels), do: levels
+  defp max_levels(size, levels), do: max_levels(div(size, 2), levels + 1)
+
+  defp pyramid_shapes(_height, _width, _channels, 0), do: []
+
+  defp pyramid_shapes(height, width, channels, levels) do
+    h = max(div(height, 2), 1)
+    w = max(div(width, 2), 1)
+    [{h, w, channels} | pyramid_shapes(h, w, channels, levels - 1)]
+  end
+
+  @doc """
+  Returns the native memory allocated by stb since the library was loaded.
+
+  The counters are kept separately for `:decode`, `:encode` and `:resize`,
+  each a map with:
+
+    * `:current` - the bytes held right now
+    * `:peak` - the most bytes held at once
+    * `:allocs`, `:reallocs` and `:frees` - the number of calls
+    * `:realloc_bytes` - the bytes requested by reallocs, which
+      grow when buffers are resized over and over
+    * `:arena_allocs` - the allocs and reallocs served from the
+      calling thread's scratch arena instead of the heap
+
+  Only the allocations made by stb and by the PNG writer are counted,
+  not the binaries returned to Elixir nor the buffers of the JPEG and
+  QOI encoders of this library.
+
+  Each scheduler and `StbImage.Async` thread keeps a scratch arena for
+  the temporary buffers of the decoders, reused from one call to the
+  next and sized after the last one, up to 8 MiB per thread and 32 MiB
+  in total. Buffers over 256 KiB, such as the decoded pixels, always
+  come from the heap. `:arenas` is the bytes reserved by all of them.
+
+  ## Examples
+
+      StbImage.memory_stats().decode.peak
+
+  """
+  def memory_stats, do: StbImage.Nif.memory_stats()
+
+  @doc """
+  Returns counters of the work split into slices since the library was
+  loaded, see the "Scheduling" section of the module docs.
+
+    * `:slices` - the slices run
+    * `:stopped` - the operations stopped because the calling process
+      had exited
+
+  ## Examples
+
+      StbImage.slice_stats().stopped
+
+  """
+  def slice_stats, do: StbImage.Nif.slice_stats()
+
+  # The phases timed by the NIFs, in nanoseconds, which are converted to
+  # native units like the duration of the whole call
+  @phases [:decode, :encode, :resize, :copy, :alloc]
+
+  @doc false
+  def emit_stop(operation, start_time, stats, metadata) do
+    duration = System.monotonic_time() - start_time
+    {phases, info} = Map.split(stats, @phases)
+    {memory, info} = Map.pop!(info, :memory)
+
+    measurements =
+      for {phase, nanoseconds} <- phases, into: %{duration: duration, memory: memory} do
+        {phase, System.convert_time_unit(nanoseconds, :nanosecond, :native)}
+      end
+
+    :telemetry.execute([:stb_image, operation, :stop], measurements, Map.merge(info, metadata))
+  end
+
+  defp assert_write_type_and_format!({:u, 16}, :png), do: :ok
+
+  defp assert_write_type_and_format!(type, format)
+       when format in [:png, :jpg, :bmp, :tga, :qoi] do
     if type != {:u, 8} do
       raise ArgumentError, "incompatible type (#{inspect(type)}) for #{inspect(format)}"
     end
@@ -432,6 +1158,134 @@ defmodule StbImage do
             "the format must be one of #{inspect(@encoding_formats)}"
   end
 
+  defp encode_options(:jpg, opts) do
+    quality = Keyword.get(opts, :quality, 100)
+
+    unless is_integer(quality) and quality in 1..100 do
+      raise ArgumentError,
+            "expected :quality to be an integer between 1 and 100, got: #{inspect(quality)}"
+    end
+
+    subsampling =
+      case Keyword.get(opts, :subsampling, :auto) do
+        :auto ->
+          0
+
+        :yuv444 ->
+          1
+
+        :yuv420 ->
+          2
+
+        other ->
+          raise ArgumentError,
+                "expected :subsampling to be :auto, :yuv444 or :yuv420, got: #{inspect(other)}"
+      end
+
+    restart_interval = Keyword.get(opts, :restart_interval, 0)
+
+    unless is_integer(restart_interval) and restart_interval >= 0 do
+      raise ArgumentError,
+            "expected :restart_interval to be a non-negative integer, got: #{inspect(restart_interval)}"
+    end
+
+    optimize_huffman =
+      case Keyword.get(opts, :optimize_huffman, false) do
+        true -> 1
+        false -> 0
+        other ->
+          raise ArgumentError,
+                "expected :optimize_huffman to be a boolean, got: #{inspect(other)}"
+      end
+
+    %{
+      quality: quality,
+      subsampling: subsampling,
+      restart_interval: restart_interval,
+      threads: threads_option(opts),
+      optimize_huffman: optimize_huffman
+    }
+  end
+
+  defp encode_options(_format, _opts), do: %{}
+
+  defp put_bit_depth(options, {:u, 16}), do: Map.put(options, :bit_depth, 16)
+  defp put_bit_depth(options, _type), do: options
+
+  @doc false
+  def resize_options(opts, {height, width}) do
+    options = %{
+      threads: threads_option(opts),
+      filter: enum_option(opts, :filter, :default, @resize_filters),
+      edge: enum_option(opts, :edge, :clamp, @resize_edges),
+      premultiplied: premultiplied_option(opts)
+    }
+
+    options =
+      case Keyword.fetch(opts, :output_type) do
+        {:ok, type} -> Map.put(options, :output_type, resize_type(type(type, :output_type)))
+        :error -> options
+      end
+
+    case Keyword.fetch(opts, :crop) do
+      {:ok, {y, x, h, w} = crop}
+      when is_number(y) and is_number(x) and is_number(h) and is_number(w) and y >= 0 and
+             x >= 0 and h > 0 and w > 0 and y + h <= height and x + w <= width ->
+        Map.put(options, :crop, crop)
+
+      {:ok, other} ->
+        raise ArgumentError,
+              "expected :crop to be a {y, x, h, w} region within the " <>
+                "#{height}x#{width} image, got: #{inspect(other)}"
+
+      :error ->
+        options
+    end
+  end
+
+  @doc false
+  def resize_type(type), do: Map.fetch!(@resize_types, type(type))
+
+  defp premultiplied_option(opts) do
+    case Keyword.get(opts, :premultiplied, false) do
+      false ->
+        0
+
+      true ->
+        1
+
+      other ->
+        raise ArgumentError, "expected :premultiplied to be a boolean, got: #{inspect(other)}"
+    end
+  end
+
+  defp enum_option(opts, key, default, values) do
+    value = Keyword.get(opts, key, default)
+
+    case values do
+      %{^value => int} ->
+        int
+
+      %{} ->
+        raise ArgumentError,
+              "expected #{inspect(key)} to be one of #{inspect(Map.keys(values))}, " <>
+                "got: #{inspect(value)}"
+    end
+  end
+
+  # Matches PARALLEL_MAX_THREADS, the helper threads started natively
+  @max_threads 64
+
+  defp threads_option(opts) do
+    case Keyword.get(opts, :threads, 1) do
+      threads when is_integer(threads) and threads > 0 ->
+        min(threads, @max_threads)
+
+      other ->
+        raise ArgumentError, "expected :threads to be a positive integer, got: #{inspect(other)}"
+    end
+  end
+
   defp format_from_path!(path) do
     case Path.extname(path) do
       ".jpg" ->
@@ -452,6 +1306,9 @@ defmodule StbImage do
       ".hdr" ->
         :hdr
 
+      ".qoi" ->
+        :qoi
+
       ext ->
         raise "could not determine a supported encoding format for file #{inspect(path)} with extension #{inspect(ext)}, " <>
                 "please specify a supported :format option explicitly"
@@ -461,13 +1318,25 @@ defmodule StbImage do
   defp path_to_binary(path) when is_list(path), do: List.to_string(path)
   defp path_to_binary(path) when is_binary(path), do: path
 
-  defp type(:u8), do: {:u, 8}
-  defp type(:f32), do: {:f, 32}
-  defp type({:u, 8}), do: {:u, 8}
-  defp type({:f, 32}), do: {:f, 32}
+  defp type(type, key \\ :type)
+  defp type(:u8, _key), do: {:u, 8}
+  defp type(:u16, _key), do: {:u, 16}
+  defp type(:f16, _key), do: {:f, 16}
+  defp type(:f32, _key), do: {:f, 32}
+  defp type({:u, 8}, _key), do: {:u, 8}
+  defp type({:u, 16}, _key), do: {:u, 16}
+  defp type({:f, 16}, _key), do: {:f, 16}
+  defp type({:f, 32}, _key), do: {:f, 32}
+
+  defp type(other, key) do
+    raise ArgumentError,
+          "expected #{inspect(key)} to be one of :u8, :u16, :f16, :f32 or their tuple form, " <>
+            "got: #{inspect(other)}"
+  end
 
   defp bytes({_, s}), do: div(s, 8)
 
   defp bytes_to_type(1), do: {:u, 8}
+  defp bytes_to_type(2), do: {:u, 16}
   defp bytes_to_type(4), do: {:f, 32}
 end
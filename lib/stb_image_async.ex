@@ -0,0 +1,137 @@
+defmodule StbImage.Async do
+  @moduledoc """
+  Runs `StbImage` operations on a pool of native threads.
+
+  Apart from tiny images, such as icons, which `read_binary/2`,
+  `to_binary/3` and `resize/4` handle right away on the calling
+  scheduler, the functions in `StbImage` run on dirty schedulers and hold
+  them until the image is decoded, encoded or resized. Under bursts of
+  work this starves other dirty NIFs in the VM. The functions in this
+  module queue the work on a pool of native threads instead and return
+  right away.
+
+  Once the work is done, `{ref, reply}` is sent to the calling process,
+  where `ref` is the `:ref` of the returned task. `result/2` turns the
+  reply into what the matching `StbImage` function returns, or raises
+  like it, and `await/2` does both.
+
+  ## Configuration
+
+      config :stb_image, async_threads: 8, async_max_queue: 1000
+
+    * `:async_threads` - the number of threads, read when the pool is
+      started by the first job. Defaults to `nil`, which uses
+      `System.schedulers_online/0`.
+
+    * `:async_max_queue` - the most jobs waiting for a thread. Jobs
+      submitted while the queue is full are rejected with
+      `{:error, "queue full"}`, and `stats/0` shows how full it is.
+      Defaults to `1000`.
+
+  ## Example
+
+      {:ok, task} = StbImage.Async.read_binary(buffer)
+      {:ok, img} = StbImage.Async.await(task)
+
+      # Or, in a GenServer
+      def handle_info({ref, reply}, %{task: %{ref: ref} = task} = state) do
+        {:ok, img} = StbImage.Async.result(task, reply)
+        ...
+      end
+
+  """
+
+  @doc """
+  The `StbImage.Async` struct.
+
+    * `:ref` - the reference the reply is sent with
+    * `:handle` - the function turning the reply into a result
+
+  """
+  defstruct [:ref, :handle]
+
+  @doc """
+  Queues `StbImage.read_file/2`.
+  """
+  def read_file(path, opts \\ []) when (is_binary(path) or is_list(path)) and is_list(opts) do
+    path |> StbImage.read_file_call(opts) |> submit()
+  end
+
+  @doc """
+  Queues `StbImage.read_binary/2`.
+  """
+  def read_binary(buffer, opts \\ []) when is_binary(buffer) and is_list(opts) do
+    buffer |> StbImage.read_binary_call(opts) |> submit()
+  end
+
+  @doc """
+  Queues `StbImage.read_gif_binary/1`.
+  """
+  def read_gif_binary(binary) when is_binary(binary) do
+    binary |> StbImage.read_gif_binary_call() |> submit()
+  end
+
+  @doc """
+  Queues `StbImage.write_file/3`.
+  """
+  def write_file(%StbImage{} = image, path, opts \\ []) do
+    image |> StbImage.write_file_call(path, opts) |> submit()
+  end
+
+  @doc """
+  Queues `StbImage.to_binary/3`.
+  """
+  def to_binary(%StbImage{} = image, format, opts \\ []) do
+    image |> StbImage.to_binary_call(format, opts) |> submit()
+  end
+
+  @doc """
+  Queues `StbImage.resize/4`.
+  """
+  def resize(%StbImage{} = image, output_h, output_w, opts \\ [])
+      when is_integer(output_h) and output_h > 0 and is_integer(output_w) and output_w > 0 do
+    image |> StbImage.resize_call(output_h, output_w, opts) |> submit()
+  end
+
+  defp submit({{name, args}, handle}) do
+    threads = Application.fetch_env!(:stb_image, :async_threads) || System.schedulers_online()
+    max_queue = Application.fetch_env!(:stb_image, :async_max_queue)
+
+    case StbImage.Nif.async(name, args, threads, max_queue) do
+      {:ok, ref} -> {:ok, %__MODULE__{ref: ref, handle: handle}}
+      {:error, reason} -> {:error, List.to_string(reason)}
+    end
+  end
+
+  @doc """
+  Waits for the reply of `task` and returns its result.
+
+  Exits if no reply arrives within `timeout` milliseconds. The work
+  still runs to completion and its reply is sent later.
+  """
+  def await(%__MODULE__{ref: ref} = task, timeout \\ 5000) do
+    receive do
+      {^ref, reply} -> result(task, reply)
+    after
+      timeout -> exit({:timeout, {__MODULE__, :await, [task, timeout]}})
+    end
+  end
+
+  @doc """
+  Turns the `reply` sent for `task` into its result.
+  """
+  def result(%__MODULE__{handle: handle}, reply), do: handle.(reply)
+
+  @doc """
+  Returns the state of the pool.
+
+    * `:threads` - the number of threads, `0` until the first job
+    * `:max_queue` - the configured queue depth
+    * `:queued` - the jobs waiting for a thread
+    * `:running` - the jobs being run
+    * `:completed` - the jobs run since the library was loaded
+    * `:rejected` - the jobs rejected because the queue was full
+
+  """
+  def stats, do: StbImage.Nif.async_stats()
+end
@@ -12,19 +12,19 @@ defmodule StbImage.Nif do
     end
   end
 
-  def read_file(_path, _desired_channels),
+  def read_file(_path, _desired_channels, _bit_depth, _resize_to, _limits),
     do: :erlang.nif_error(:not_loaded)
 
-  def read_binary(_buffer, _desired_channels),
+  def read_binary(_buffer, _desired_channels, _bit_depth, _resize_to, _limits),
     do: :erlang.nif_error(:not_loaded)
 
   def read_gif_binary(_gif_path),
     do: :erlang.nif_error(:not_loaded)
 
-  def write_file(_path, _format, _data, _height, _width, _channels),
+  def write_file(_path, _format, _data, _height, _width, _channels, _options),
     do: :erlang.nif_error(:not_loaded)
 
-  def to_binary(_format, _data, _height, _width, _channels),
+  def to_binary(_format, _data, _height, _width, _channels, _options),
     do: :erlang.nif_error(:not_loaded)
 
   def resize(
@@ -34,7 +34,64 @@ defmodule StbImage.Nif do
         _num_channels,
         _output_h,
         _output_w,
-        _type
+        _type,
+        _options
       ),
       do: :erlang.nif_error(:not_loaded)
+
+  def resize_many(
+        _input_pixels,
+        _input_height,
+        _input_width,
+        _num_channels,
+        _output_h,
+        _output_w,
+        _type,
+        _options
+      ),
+      do: :erlang.nif_error(:not_loaded)
+
+  def pyramid(_input_pixels, _height, _width, _num_channels, _type, _levels, _options),
+    do: :erlang.nif_error(:not_loaded)
+
+  def premultiply(_input_pixels, _num_channels, _type),
+    do: :erlang.nif_error(:not_loaded)
+
+  def unpremultiply(_input_pixels, _num_channels, _type),
+    do: :erlang.nif_error(:not_loaded)
+
+  def png_writer_open(_destination, _height, _width, _channels, _bit_depth),
+    do: :erlang.nif_error(:not_loaded)
+
+  def png_writer_write(_writer, _rows),
+    do: :erlang.nif_error(:not_loaded)
+
+  def png_writer_close(_writer),
+    do: :erlang.nif_error(:not_loaded)
+
+  def resize_plan_new(
+        _input_height,
+        _input_width,
+        _num_channels,
+        _output_h,
+        _output_w,
+        _type,
+        _options
+      ),
+      do: :erlang.nif_error(:not_loaded)
+
+  def resize_plan_run(_plan, _input_pixels),
+    do: :erlang.nif_error(:not_loaded)
+
+  def memory_stats,
+    do: :erlang.nif_error(:not_loaded)
+
+  def async(_name, _args, _threads, _max_queue),
+    do: :erlang.nif_error(:not_loaded)
+
+  def async_stats,
+    do: :erlang.nif_error(:not_loaded)
+
+  def slice_stats,
+    do: :erlang.nif_error(:not_loaded)
 end
@@ -0,0 +1,123 @@
+defmodule StbImage.PngWriter do
+  @moduledoc """
+  Incremental PNG encoder for images that are too large to encode in one go.
+
+  `StbImage.write_file/3` and `StbImage.to_binary/3` need the whole image
+  as a single binary and keep further full-size copies of it while
+  encoding. A writer instead receives the image a band of rows at a time,
+  compresses the rows as they arrive and writes the result out in chunks,
+  so memory use does not depend on the image height.
+
+  The output is either written to a file or sent to a process. In the
+  latter case, the process receives messages of the form
+  `{:stb_image_png, ref, chunk}`, where `ref` is the `:ref` field of the
+  writer, and the PNG file is the concatenation of all chunks, in order.
+  All chunks have been sent once `close/1` returns.
+
+  ## Example
+
+      {:ok, writer} = StbImage.PngWriter.open("mosaic.png", {height, width, 3})
+
+      for band <- bands do
+        :ok = StbImage.PngWriter.write_rows(writer, band)
+      end
+
+      :ok = StbImage.PngWriter.close(writer)
+
+  """
+
+  @doc """
+  The `StbImage.PngWriter` struct.
+
+    * `:ref` - the underlying native writer
+    * `:shape` - the `{height, width, channels}` of the image being written
+    * `:type` - the type of the image being written
+
+  """
+  defstruct [:ref, :shape, type: {:u, 8}]
+
+  defguardp is_dimension(d) when is_integer(d) and d > 0
+
+  @doc """
+  Opens a writer for an image of the given `{height, width, channels}`.
+
+  `destination` is either a file path or a pid to send the encoded
+  chunks to.
+
+  Returns `{:ok, writer}` on success and `{:error, reason}` otherwise.
+
+  ## Options
+
+    * `:type` - either `{:u, 8}` or `{:u, 16}`, for a 16-bit PNG. Rows
+      of 16-bit images are given in native byte order, like the data of
+      `StbImage` structs. Defaults to `{:u, 8}`.
+
+  """
+  def open(destination, {height, width, channels} = shape, opts \\ [])
+      when is_dimension(height) and is_dimension(width) and channels in 1..4 do
+    destination =
+      cond do
+        is_pid(destination) -> destination
+        is_binary(destination) -> destination
+        is_list(destination) -> List.to_string(destination)
+        true -> raise ArgumentError, "expected a path or a pid, got: #{inspect(destination)}"
+      end
+
+    {type, bit_depth} =
+      case Keyword.get(opts, :type, :u8) do
+        type when type in [:u8, {:u, 8}] -> {{:u, 8}, 8}
+        type when type in [:u16, {:u, 16}] -> {{:u, 16}, 16}
+        other -> raise ArgumentError, "expected :type to be :u8 or :u16, got: #{inspect(other)}"
+      end
+
+    case StbImage.Nif.png_writer_open(destination, height, width, channels, bit_depth) do
+      {:ok, ref} -> {:ok, %__MODULE__{ref: ref, shape: shape, type: type}}
+      {:error, reason} -> {:error, List.to_string(reason)}
+    end
+  end
+
+  @doc """
+  Encodes the next rows of the image.
+
+  `rows` is either a binary with one or more whole rows, in HWC order,
+  or an `StbImage` with the type, width and channels of the image being
+  written.
+
+  Returns `:ok` on success and `{:error, reason}` otherwise. A writer
+  that failed cannot be used any further.
+  """
+  def write_rows(%__MODULE__{} = writer, %StbImage{type: type, shape: shape, data: data}) do
+    {_, width, channels} = writer.shape
+    expected_type = writer.type
+
+    case shape do
+      {_, ^width, ^channels} when type == expected_type ->
+        write_rows(writer, data)
+
+      _ ->
+        raise ArgumentError,
+              "expected a #{inspect(expected_type)} image with width #{width} and " <>
+                "#{channels} channels, got type #{inspect(type)} and shape #{inspect(shape)}"
+    end
+  end
+
+  def write_rows(%__MODULE__{ref: ref}, rows) when is_binary(rows) do
+    case StbImage.Nif.png_writer_write(ref, rows) do
+      :ok -> :ok
+      {:error, reason} -> {:error, List.to_string(reason)}
+    end
+  end
+
+  @doc """
+  Finishes the image.
+
+  All rows must have been written. Returns `:ok` on success and
+  `{:error, reason}` otherwise.
+  """
+  def close(%__MODULE__{ref: ref}) do
+    case StbImage.Nif.png_writer_close(ref) do
+      :ok -> :ok
+      {:error, reason} -> {:error, List.to_string(reason)}
+    end
+  end
+end
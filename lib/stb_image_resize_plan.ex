@@ -0,0 +1,112 @@
+defmodule StbImage.ResizePlan do
+  @moduledoc """
+  A precomputed resize between fixed input and output dimensions.
+
+  `StbImage.resize/4` computes the filter coefficients for every call.
+  When many images of the same shape and type are resized to the same
+  dimensions, a plan computes them once and reuses them for every image.
+
+  A plan may be shared between processes, but calls using the same plan
+  run one at a time.
+
+  ## Example
+
+      plan = StbImage.ResizePlan.new({1080, 1920, 3}, {135, 240})
+
+      thumbnails = Enum.map(frames, &StbImage.ResizePlan.resize(plan, &1))
+
+  """
+
+  @doc """
+  The `StbImage.ResizePlan` struct.
+
+    * `:ref` - the underlying native plan
+    * `:input_shape` - the `{height, width, channels}` of input images
+    * `:output_shape` - the `{height, width, channels}` of output images
+    * `:type` - the type of input images
+    * `:output_type` - the type of output images
+    * `:filter` - the filter, as given to `new/3`
+    * `:threads` - the number of native threads
+
+  """
+  defstruct [:ref, :input_shape, :output_shape, :type, :output_type, :filter, :threads]
+
+  defguardp is_dimension(d) when is_integer(d) and d > 0
+
+  @doc """
+  Creates a plan that resizes images of `input_shape` into `output_h`
+  and `output_w`.
+
+  ## Options
+
+    * `:type` - the type of the input images, one of `{:u, 8}`,
+      `{:u, 16}`, `{:f, 16}` or `{:f, 32}`. Defaults to `{:u, 8}`.
+
+  It also accepts the options listed in `StbImage.resize/4`.
+  """
+  def new({height, width, channels} = input_shape, {output_h, output_w}, opts \\ [])
+      when is_dimension(height) and is_dimension(width) and channels in 1..4 and
+             is_dimension(output_h) and is_dimension(output_w) do
+    type = type(opts[:type] || :u8)
+    output_type = type(opts[:output_type] || type)
+    options = StbImage.resize_options(opts, {height, width})
+
+    case StbImage.Nif.resize_plan_new(
+           height,
+           width,
+           channels,
+           output_h,
+           output_w,
+           StbImage.resize_type(type),
+           options
+         ) do
+      {:ok, ref} ->
+        %__MODULE__{
+          ref: ref,
+          input_shape: input_shape,
+          output_shape: {output_h, output_w, channels},
+          type: type,
+          output_type: output_type,
+          filter: Keyword.get(opts, :filter, :default),
+          threads: options.threads
+        }
+
+      {:error, reason} ->
+        raise ArgumentError, "#{reason}"
+    end
+  end
+
+  @doc """
+  Resizes `image` with the given `plan`.
+
+  The image must have the input shape and type of the plan.
+  """
+  def resize(%__MODULE__{} = plan, %StbImage{data: data, shape: shape, type: type}) do
+    if shape != plan.input_shape or type != plan.type do
+      raise ArgumentError,
+            "expected an image of shape #{inspect(plan.input_shape)} and type " <>
+              "#{inspect(plan.type)}, got: #{inspect(shape)} and #{inspect(type)}"
+    end
+
+    start_time = System.monotonic_time()
+
+    case StbImage.Nif.resize_plan_run(plan.ref, data) do
+      {:ok, output_pixels, stats} ->
+        metadata = Map.take(plan, [:input_shape, :output_shape, :type, :output_type, :filter, :threads])
+        StbImage.emit_stop(:resize, start_time, stats, metadata)
+        %StbImage{data: output_pixels, shape: plan.output_shape, type: plan.output_type}
+
+      {:error, reason} ->
+        raise ArgumentError, "#{reason}"
+    end
+  end
+
+  defp type(:u8), do: {:u, 8}
+  defp type(:u16), do: {:u, 16}
+  defp type(:f16), do: {:f, 16}
+  defp type(:f32), do: {:f, 32}
+  defp type({:u, 8}), do: {:u, 8}
+  defp type({:u, 16}), do: {:u, 16}
+  defp type({:f, 16}), do: {:f, 16}
+  defp type({:f, 32}), do: {:f, 32}
+end
@@ -28,7 +28,11 @@ defmodule StbImage.MixProject do
       env: [
         kino_render_encoding: :png,
         kino_render_max_size: {8192, 8192},
-        kino_render_tab_order: [:image, :raw]
+        kino_render_tab_order: [:image, :raw],
+        max_pixels: nil,
+        max_bytes: nil,
+        async_threads: nil,
+        async_max_queue: 1000
       ],
       extra_applications: [:logger]
     ]
@@ -39,6 +43,8 @@ defmodule StbImage.MixProject do
       # compilation
       {:cc_precompiler, "~> 0.1"},
       {:elixir_make, "~> 0.8"},
+      # runtime
+      {:telemetry, "~> 0.4 or ~> 1.0"},
       # optional
       {:nx, "~> 0.4", optional: true},
       {:kino, "~> 0.7", optional: true},
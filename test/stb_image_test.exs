@@ -10,6 +10,45 @@ defmodule StbImageTest do
     |> StbImage.from_nx()
   end
 
+  defp gradient do
+    data = for y <- 0..63, x <- 0..63, into: <<>>, do: <<x * 4, y * 4, rem(x * y, 256)>>
+    StbImage.new(data, {64, 64, 3})
+  end
+
+  defp write_bands(writer, %StbImage{data: data, shape: {_, width, channels}}, rows) do
+    band_size = rows * width * channels
+
+    for <<band::binary-size(band_size) <- data>> do
+      assert StbImage.PngWriter.write_rows(writer, band) == :ok
+    end
+  end
+
+  defp receive_chunks(ref, acc) do
+    receive do
+      {:stb_image_png, ^ref, chunk} -> receive_chunks(ref, [acc | chunk])
+    after
+      0 -> IO.iodata_to_binary(acc)
+    end
+  end
+
+  defp eventually(fun, tries \\ 100) do
+    cond do
+      fun.() -> true
+      tries == 0 -> false
+      true ->
+        Process.sleep(50)
+        eventually(fun, tries - 1)
+    end
+  end
+
+  # Polls more often than eventually/2, to catch work in progress
+  defp wait_until(fun) do
+    unless fun.() do
+      Process.sleep(1)
+      wait_until(fun)
+    end
+  end
+
   test "decode png from file" do
     img = StbImage.read_file!(Path.join(__DIR__, "test.png"))
     assert img.type == {:u, 8}
@@ -128,7 +167,7 @@ defmodule StbImageTest do
              <<255, 255, 255, 255, 0, 0, 0, 255, 255, 255, 255, 255, 200, 200, 200, 255>>
   end
 
-  for ext <- ~w(bmp png tga jpg hdr)a do
+  for ext <- ~w(bmp png tga jpg hdr qoi)a do
     @ext ext
 
     test "decode #{@ext} from file matches decode from binary" do
@@ -157,6 +196,120 @@ defmodule StbImageTest do
     end
   end
 
+  test "decode qoi matches png" do
+    png = StbImage.read_file!(Path.join(__DIR__, "test.png"))
+    qoi = StbImage.read_file!(Path.join(__DIR__, "test.qoi"))
+    assert qoi == png
+
+    for channels <- 1..4 do
+      assert StbImage.read_file!(Path.join(__DIR__, "test.qoi"), channels: channels) ==
+               StbImage.read_file!(Path.join(__DIR__, "test.png"), channels: channels)
+    end
+
+    rgb = StbImage.read_file!(Path.join(__DIR__, "test.jpg"))
+    assert rgb |> StbImage.to_binary(:qoi) |> StbImage.read_binary!() == rgb
+
+    assert_raise ArgumentError, "qoi only supports 3 or 4 channels", fn ->
+      StbImage.to_binary(StbImage.new(<<0, 0>>, {1, 2, 1}), :qoi)
+    end
+  end
+
+  describe "jpg encoding" do
+    test "lower quality gives smaller files" do
+      high = StbImage.to_binary(gradient(), :jpg)
+      low = StbImage.to_binary(gradient(), :jpg, quality: 50)
+      assert byte_size(low) < byte_size(high)
+
+      assert StbImage.read_binary!(low).shape == {64, 64, 3}
+    end
+
+    test "subsampling" do
+      full = StbImage.to_binary(gradient(), :jpg, subsampling: :yuv444)
+      half = StbImage.to_binary(gradient(), :jpg, subsampling: :yuv420)
+      assert byte_size(half) < byte_size(full)
+
+      assert StbImage.read_binary!(full).shape == {64, 64, 3}
+      assert StbImage.read_binary!(half).shape == {64, 64, 3}
+    end
+
+    test "restart markers and threads" do
+      img = gradient()
+      expected = img |> StbImage.to_binary(:jpg) |> StbImage.read_binary!()
+
+      for opts <- [[restart_interval: 1], [restart_interval: 3], [threads: 4]] do
+        encoded = StbImage.to_binary(img, :jpg, opts)
+        assert :binary.match(encoded, <<0xFF, 0xDD>>) != :nomatch
+        assert StbImage.read_binary!(encoded) == expected
+      end
+    end
+
+    test "optimized huffman tables" do
+      img = gradient()
+      standard = StbImage.to_binary(img, :jpg, quality: 75)
+      optimized = StbImage.to_binary(img, :jpg, quality: 75, optimize_huffman: true)
+
+      assert byte_size(optimized) < byte_size(standard)
+      assert StbImage.read_binary!(optimized) == StbImage.read_binary!(standard)
+
+      expected = StbImage.read_binary!(StbImage.to_binary(img, :jpg))
+      with_restarts = StbImage.to_binary(img, :jpg, optimize_huffman: true, threads: 2)
+      assert StbImage.read_binary!(with_restarts) == expected
+    end
+
+    test "invalid options" do
+      img = StbImage.read_file!(Path.join(__DIR__, "test.jpg"))
+
+      assert_raise ArgumentError, ~r/:quality/, fn ->
+        StbImage.to_binary(img, :jpg, quality: 0)
+      end
+
+      assert_raise ArgumentError, ~r/:subsampling/, fn ->
+        StbImage.to_binary(img, :jpg, subsampling: :yuv422)
+      end
+    end
+  end
+
+  describe "png writer" do
+    test "writes to a file" do
+      img = gradient()
+      save_at = "tmp/png_writer_test.png"
+
+      try do
+        File.mkdir_p!("tmp")
+        {:ok, writer} = StbImage.PngWriter.open(save_at, img.shape)
+        write_bands(writer, img, 16)
+        assert StbImage.PngWriter.close(writer) == :ok
+        assert StbImage.read_file(save_at) == {:ok, img}
+      after
+        File.rm!(save_at)
+      end
+    end
+
+    test "sends chunks to a process" do
+      img = StbImage.read_file!(Path.join(__DIR__, "test.png"))
+      {:ok, %{ref: ref} = writer} = StbImage.PngWriter.open(self(), img.shape)
+      assert StbImage.PngWriter.write_rows(writer, img) == :ok
+      assert StbImage.PngWriter.close(writer) == :ok
+
+      binary = receive_chunks(ref, [])
+      assert StbImage.read_binary(binary) == {:ok, img}
+    end
+
+    test "errors" do
+      img = gradient()
+      {:ok, writer} = StbImage.PngWriter.open(self(), img.shape)
+
+      assert StbImage.PngWriter.write_rows(writer, <<0>>) ==
+               {:error, "data must contain whole rows"}
+
+      assert StbImage.PngWriter.write_rows(writer, img.data <> img.data) ==
+               {:error, "too many rows"}
+
+      assert StbImage.PngWriter.close(writer) == {:error, "not all rows were written"}
+      assert StbImage.PngWriter.write_rows(writer, img) == {:error, "png writer is closed"}
+    end
+  end
+
   test "resize png" do
     img = StbImage.read_file!(Path.join(__DIR__, "test.png"))
     resized_img = StbImage.resize(img, 4, 6)
@@ -178,6 +331,635 @@ defmodule StbImageTest do
     assert resized_img.type == img.type
   end
 
+  test "resize with threads" do
+    img = gradient()
+
+    for {h, w} <- [{16, 16}, {48, 40}, {128, 96}], threads <- [4, 1000] do
+      assert StbImage.resize(img, h, w, threads: threads) == StbImage.resize(img, h, w)
+    end
+
+    assert_raise ArgumentError, ~r/:threads/, fn ->
+      StbImage.resize(img, 16, 16, threads: 0)
+    end
+  end
+
+  test "resize plan" do
+    img = gradient()
+    plan = StbImage.ResizePlan.new(img.shape, {24, 40})
+    assert StbImage.ResizePlan.resize(plan, img) == StbImage.resize(img, 24, 40)
+
+    inverted = StbImage.new(for(<<b <- img.data>>, into: <<>>, do: <<255 - b>>), img.shape)
+    assert StbImage.ResizePlan.resize(plan, inverted) == StbImage.resize(inverted, 24, 40)
+
+    threaded = StbImage.ResizePlan.new(img.shape, {24, 40}, threads: 2)
+    assert StbImage.ResizePlan.resize(threaded, img) == StbImage.resize(img, 24, 40)
+
+    assert_raise ArgumentError, ~r/expected an image of shape/, fn ->
+      StbImage.ResizePlan.resize(plan, StbImage.read_file!(Path.join(__DIR__, "test.jpg")))
+    end
+  end
+
+  test "resize filters and edges" do
+    img = gradient()
+
+    for filter <- [:default, :point, :box, :triangle, :cubic_bspline, :catmull_rom, :mitchell],
+        edge <- [:clamp, :reflect, :wrap, :zero] do
+      assert StbImage.resize(img, 20, 24, filter: filter, edge: edge).shape == {20, 24, 3}
+    end
+
+    assert StbImage.resize(img, 32, 32, filter: :default) == StbImage.resize(img, 32, 32)
+
+    stripes = for _ <- 1..16, x <- 1..16, into: <<>>, do: <<rem(x, 2) * 255>>
+    mask = StbImage.new(stripes, {16, 16, 1})
+    %StbImage{data: data} = StbImage.resize(mask, 40, 40, filter: :point)
+    assert Enum.sort(for <<b <- data>>, uniq: true, do: b) == [0, 255]
+
+    assert_raise ArgumentError, ~r/:filter/, fn ->
+      StbImage.resize(img, 8, 8, filter: :lanczos)
+    end
+
+    assert_raise ArgumentError, ~r/:edge/, fn ->
+      StbImage.resize(img, 8, 8, edge: :mirror)
+    end
+  end
+
+  test "resize by integer factors with box filter" do
+    img = gradient()
+    %StbImage{data: data, shape: {32, 32, 3}} = StbImage.resize(img, 32, 32, filter: :box)
+
+    # Each output pixel is the rounded average of a 2x2 block
+    <<r, g, _b, _::binary>> = binary_part(data, (5 * 32 + 7) * 3, 3 * 3)
+    assert_in_delta r, (14 + 15) * 4 / 2, 1
+    assert_in_delta g, (10 + 11) * 4 / 2, 1
+
+    assert StbImage.resize(img, 16, 8, filter: :box, threads: 3) ==
+             StbImage.resize(img, 16, 8, filter: :box)
+
+    # Transparent pixels do not bleed into the colour
+    pixels = :binary.copy(<<200, 100, 50, 0, 10, 20, 30, 255>>, 32 * 32)
+    rgba = StbImage.new(pixels, {32, 64, 4})
+    assert <<10, 20, 30, 128, _::binary>> = StbImage.resize(rgba, 16, 32, filter: :box).data
+  end
+
+  test "resize with crop" do
+    img = gradient()
+    %StbImage{data: data} = img
+
+    rows = for y <- 10..39, into: <<>>, do: binary_part(data, (y * 64 + 4) * 3, 20 * 3)
+    cropped = StbImage.new(rows, {30, 20, 3})
+
+    for filter <- [:default, :box, :point] do
+      assert StbImage.resize(img, 15, 10, crop: {10, 4, 30, 20}, filter: filter) ==
+               StbImage.resize(cropped, 15, 10, filter: filter)
+    end
+
+    plan = StbImage.ResizePlan.new({64, 64, 3}, {15, 10}, crop: {10, 4, 30, 20})
+    assert StbImage.ResizePlan.resize(plan, img) == StbImage.resize(cropped, 15, 10)
+
+    assert StbImage.resize(img, 16, 16, crop: {10.5, 4.25, 29.5, 20}).shape == {16, 16, 3}
+
+    assert_raise ArgumentError, ~r/:crop/, fn ->
+      StbImage.resize(img, 8, 8, crop: {40, 0, 30, 10})
+    end
+  end
+
+  test "pyramid" do
+    img = gradient()
+    levels = StbImage.pyramid(img)
+    assert Enum.map(levels, & &1.shape) == for(s <- [32, 16, 8, 4, 2, 1], do: {s, s, 3})
+
+    [l1, l2 | _] = levels
+    assert l1 == StbImage.resize(img, 32, 32, filter: :box)
+    assert l2 == StbImage.resize(l1, 16, 16, filter: :box)
+
+    {binary, offsets} = StbImage.pyramid(img, packed: true, levels: 2, threads: 2)
+    assert offsets == [{0, {32, 32, 3}}, {32 * 32 * 3, {16, 16, 3}}]
+    assert binary == l1.data <> l2.data
+
+    odd = StbImage.new(:binary.copy(<<1, 2, 3>>, 5 * 3), {5, 3, 3})
+    assert Enum.map(StbImage.pyramid(odd), & &1.shape) == [{2, 1, 3}, {1, 1, 3}]
+
+    assert_raise ArgumentError, ~r/:levels/, fn -> StbImage.pyramid(img, levels: 0) end
+  end
+
+  @tag :profile
+  test "resize profile events" do
+    ref = make_ref()
+    parent = self()
+
+    :telemetry.attach(
+      ref,
+      [:stb_image, :resize, :profile],
+      fn _event, measurements, metadata, _ -> send(parent, {ref, measurements, metadata}) end,
+      nil
+    )
+
+    try do
+      StbImage.resize(gradient(), 20, 30, filter: :triangle)
+
+      assert_received {^ref, measurements, %{output_shape: {20, 30, 3}, filter: :triangle}}
+      assert measurements.total > 0
+      assert Map.has_key?(measurements, :vertical)
+    after
+      :telemetry.detach(ref)
+    end
+  end
+
+  test "telemetry events" do
+    ref = make_ref()
+    parent = self()
+    operations = [:decode, :encode, :resize, :resize_many, :pyramid]
+    events = for operation <- operations, do: [:stb_image, operation, :stop]
+
+    :telemetry.attach_many(
+      ref,
+      events,
+      fn event, measurements, metadata, _ ->
+        send(parent, {ref, event, measurements, metadata})
+      end,
+      nil
+    )
+
+    try do
+      path = Path.join(__DIR__, "test.png")
+      img = StbImage.read_file!(path)
+      assert_received {^ref, [:stb_image, :decode, :stop], measurements, metadata}
+      assert measurements.duration >= measurements.decode
+      assert %{format: :png, shape: shape, type: {:u, 8}} = metadata
+      assert shape == img.shape
+      assert metadata.bytes == File.stat!(path).size
+
+      binary = StbImage.to_binary(img, :jpg)
+      assert_received {^ref, [:stb_image, :encode, :stop], measurements, metadata}
+      assert Map.keys(measurements) -- [:duration, :memory] ==
+               [:alloc, :copy, :decode, :encode, :resize]
+      assert %{format: :jpg, shape: ^shape} = metadata
+      assert metadata.bytes == byte_size(binary)
+
+      StbImage.resize(img, 10, 20)
+      assert_received {^ref, [:stb_image, :resize, :stop], measurements, metadata}
+      assert measurements.memory > 0
+      assert metadata.output_shape == {10, 20, elem(shape, 2)}
+
+      plan = StbImage.ResizePlan.new(shape, {10, 20}, filter: :triangle)
+      StbImage.ResizePlan.resize(plan, img)
+      assert_received {^ref, [:stb_image, :resize, :stop], measurements, metadata}
+      assert measurements.resize > 0
+      assert %{output_shape: {10, 20, _}, filter: :triangle, threads: 1} = metadata
+
+      StbImage.resize_many([img, img], {10, 20})
+      assert_received {^ref, [:stb_image, :resize_many, :stop], measurements, metadata}
+      assert measurements.resize > 0
+      assert %{count: 2, input_shape: ^shape, output_shape: {10, 20, _}} = metadata
+
+      StbImage.pyramid(img, levels: 2)
+      assert_received {^ref, [:stb_image, :pyramid, :stop], measurements, metadata}
+      assert measurements.resize > 0
+      assert %{input_shape: ^shape, levels: 2, filter: :box} = metadata
+
+      {:ok, frames, _} = StbImage.read_gif_file(Path.join(__DIR__, "test.gif"))
+      assert_received {^ref, [:stb_image, :decode, :stop], measurements, metadata}
+      assert measurements.decode > 0
+      assert %{format: :gif, type: {:u, 8}} = metadata
+      assert metadata.frames == length(frames)
+    after
+      :telemetry.detach(ref)
+    end
+  end
+
+  test "read with max_pixels and max_bytes" do
+    # The header of a 10000x10000 RGBA PNG, which is rejected before
+    # any pixel data is needed
+    chunk = fn type, data ->
+      <<byte_size(data)::32, type::binary, data::binary, :erlang.crc32(type <> data)::32>>
+    end
+
+    png =
+      <<0x89, "PNG\r\n", 0x1A, "\n">> <>
+        chunk.("IHDR", <<10000::32, 10000::32, 8, 6, 0, 0, 0>>) <> chunk.("IDAT", "")
+
+    assert StbImage.read_binary(png, max_pixels: 1_000_000) ==
+             {:error, "image exceeds max_pixels"}
+
+    assert StbImage.read_binary(png, max_bytes: 100_000_000) ==
+             {:error, "decoding the image would exceed max_bytes"}
+
+    path = Path.join(__DIR__, "test.png")
+    assert {:ok, _} = StbImage.read_file(path, max_pixels: 1_000_000, max_bytes: 10_000_000)
+    assert {:error, "image exceeds max_pixels"} = StbImage.read_file(path, max_pixels: 1)
+
+    assert_raise ArgumentError, ~r/expected :max_bytes/, fn ->
+      StbImage.read_binary(png, max_bytes: -1)
+    end
+  end
+
+  describe "over 2GiB" do
+    @describetag :large
+
+    test "read_binary with trailing data" do
+      png = File.read!(Path.join(__DIR__, "test.png"))
+      padded = png <> :binary.copy(<<0>>, 2 ** 31)
+      assert StbImage.read_binary!(padded) == StbImage.read_binary!(png)
+    end
+
+    test "read, resize and encode" do
+      # A 24000x24000 RGBA QOI image made of runs of its initial pixel
+      pixels = 24_000 * 24_000
+
+      qoi =
+        <<"qoif", 24_000::32, 24_000::32, 4, 0>> <>
+          :binary.copy(<<0xFD>>, div(pixels, 62)) <>
+          <<0xC0 + rem(pixels, 62) - 1, 0::56, 1>>
+
+      img = StbImage.read_binary!(qoi)
+      assert img.shape == {24_000, 24_000, 4}
+      assert byte_size(img.data) > 2 ** 31
+
+      assert StbImage.resize(img, 24, 24).data == :binary.copy(<<0, 0, 0, 255>>, 24 * 24)
+      assert StbImage.read_binary!(StbImage.to_binary(img, :qoi)) == img
+
+      assert_raise ArgumentError, "image too large for format", fn ->
+        StbImage.to_binary(img, :bmp)
+      end
+    end
+
+    test "write_file" do
+      # Random RGB pixels take 4 bytes each in QOI, about 2.3GB in total
+      img = StbImage.new(:crypto.strong_rand_bytes(24_000 * 24_000 * 3), {24_000, 24_000, 3})
+      save_at = "tmp/large_test.qoi"
+
+      try do
+        File.mkdir_p!("tmp")
+        :ok = StbImage.write_file!(img, save_at)
+        assert File.stat!(save_at).size > 2 ** 31
+        assert StbImage.read_file!(save_at) == img
+      after
+        File.rm(save_at)
+      end
+    end
+  end
+
+  test "async" do
+    path = Path.join(__DIR__, "test.png")
+    {:ok, task} = StbImage.Async.read_file(path)
+    assert {:ok, img} = StbImage.Async.await(task)
+    assert img == StbImage.read_file!(path)
+
+    {:ok, task} = StbImage.Async.resize(img, 4, 6)
+    assert StbImage.Async.await(task) == StbImage.resize(img, 4, 6)
+
+    {:ok, %{ref: ref} = task} = StbImage.Async.to_binary(img, :png)
+    assert_receive {^ref, reply}
+    assert StbImage.Async.result(task, reply) == StbImage.to_binary(img, :png)
+
+    gif = File.read!(Path.join(__DIR__, "test.gif"))
+    {:ok, task} = StbImage.Async.read_gif_binary(gif)
+    assert StbImage.Async.await(task) == StbImage.read_gif_binary(gif)
+
+    {:ok, task} = StbImage.Async.read_binary("not an image")
+    assert StbImage.Async.await(task) == {:error, "cannot decode image"}
+
+    assert %{threads: threads, queued: _, completed: completed} = StbImage.Async.stats()
+    assert threads > 0
+    assert completed >= 4
+  end
+
+  test "large resizes and encodes" do
+    # Run in three and two slices, unlike on the async pool
+    img = StbImage.new(:crypto.strong_rand_bytes(5000 * 5000 * 4), {5000, 5000, 4})
+    {:ok, task} = StbImage.Async.resize(img, 1000, 1500)
+    assert StbImage.Async.await(task, 30_000) == StbImage.resize(img, 1000, 1500)
+
+    img = StbImage.new(:crypto.strong_rand_bytes(1200 * 1200 * 3), {1200, 1200, 3})
+    ref = make_ref()
+    parent = self()
+
+    :telemetry.attach(
+      ref,
+      [:stb_image, :encode, :stop],
+      fn _, measurements, metadata, _ -> send(parent, {ref, measurements, metadata}) end,
+      nil
+    )
+
+    binary =
+      try do
+        binary = StbImage.to_binary(img, :png)
+        assert_received {^ref, %{memory: memory}, %{format: :png, shape: {1200, 1200, 3}}}
+        assert memory > 0
+        binary
+      after
+        :telemetry.detach(ref)
+      end
+
+    # The async pool encodes in a single call with stb_image_write
+    {:ok, task} = StbImage.Async.to_binary(img, :png)
+    assert StbImage.read_binary!(StbImage.Async.await(task, 30_000)) == StbImage.read_binary!(binary)
+
+    for opts <- [[], [restart_interval: 2, threads: 2, optimize_huffman: true]] do
+      {:ok, task} = StbImage.Async.to_binary(img, :jpg, opts)
+      assert StbImage.Async.await(task, 30_000) == StbImage.to_binary(img, :jpg, opts)
+    end
+  end
+
+  test "images around the inline size limit" do
+    # Up to 16 KiB runs on the calling scheduler. Anything more is
+    # rescheduled, and PNG and JPEG encodes and resizes are then sliced
+    image = fn height, width, channels ->
+      data = for y <- 1..height, x <- 1..width, c <- 1..channels, into: <<>>, do: <<rem(x * y + c, 256)>>
+      StbImage.new(data, {height, width, channels})
+    end
+
+    slices = fn fun ->
+      %{slices: slices} = StbImage.slice_stats()
+      result = fun.()
+      {result, StbImage.slice_stats().slices - slices}
+    end
+
+    async = fn {:ok, task} -> StbImage.Async.await(task) end
+
+    # Decodes count 16 bytes per pixel, and resizes 4 bytes per channel
+    for {height, width} <- [{32, 32}, {32, 33}] do
+      binary = StbImage.to_binary(image.(height, width, 4), :png)
+      assert {:ok, %StbImage{shape: {^height, ^width, 4}}} = direct = StbImage.read_binary(binary)
+      assert async.(StbImage.Async.read_binary(binary)) == direct
+    end
+
+    for {{height, width}, expected_slices} <- [{{64, 64}, 0}, {{64, 65}, 1}] do
+      img = image.(height, width, 4)
+
+      {png, ^expected_slices} = slices.(fn -> StbImage.to_binary(img, :png) end)
+      assert StbImage.read_binary!(async.(StbImage.Async.to_binary(img, :png))) == StbImage.read_binary!(png)
+
+      {jpg, ^expected_slices} = slices.(fn -> StbImage.to_binary(img, :jpg) end)
+      assert async.(StbImage.Async.to_binary(img, :jpg)) == jpg
+
+      {bmp, 0} = slices.(fn -> StbImage.to_binary(img, :bmp) end)
+      assert async.(StbImage.Async.to_binary(img, :bmp)) == bmp
+    end
+
+    img = image.(64, 64, 1)
+
+    for {{height, width}, expected_slices} <- [{{64, 64}, 0}, {{64, 65}, 1}] do
+      {direct, ^expected_slices} = slices.(fn -> StbImage.resize(img, height, width) end)
+      assert direct.shape == {height, width, 1}
+      assert async.(StbImage.Async.resize(img, height, width)) == direct
+    end
+  end
+
+  test "large resizes stop once the caller exits" do
+    img = StbImage.new(:crypto.strong_rand_bytes(2000 * 2000 * 4), {2000, 2000, 4})
+    before = StbImage.memory_stats().resize.current
+
+    # 8 slices when run to the end
+    %{slices: slices} = StbImage.slice_stats()
+    StbImage.resize(img, 8000, 8000)
+    full = StbImage.slice_stats().slices - slices
+    assert full >= 8
+
+    %{slices: slices, stopped: stopped} = StbImage.slice_stats()
+    {pid, ref} = spawn_monitor(fn -> StbImage.resize(img, 8000, 8000) end)
+    wait_until(fn -> StbImage.slice_stats().slices > slices end)
+    Process.exit(pid, :kill)
+    assert_receive {:DOWN, ^ref, :process, ^pid, :killed}
+
+    assert eventually(fn -> StbImage.slice_stats().stopped == stopped + 1 end)
+    assert StbImage.slice_stats().slices - slices < full
+    assert eventually(fn -> StbImage.memory_stats().resize.current <= before end)
+  end
+
+  test "memory_stats" do
+    img = StbImage.read_file!(Path.join(__DIR__, "test.png"))
+    StbImage.resize(img, 10, 20)
+    StbImage.to_binary(img, :png)
+    stats = StbImage.memory_stats()
+
+    for kind <- [:decode, :encode, :resize] do
+      assert %{current: _, peak: peak, allocs: allocs, frees: frees} = stats[kind]
+      assert peak >= 0
+      assert allocs >= frees
+    end
+
+    assert stats.decode.allocs > 0
+    assert stats.encode.allocs > 0
+    assert stats.resize.peak > 0
+    assert is_integer(stats.arenas)
+  end
+
+  test "decoder arenas" do
+    # Enough decodes for some thread to run twice and reuse its arena
+    threads =
+      :erlang.system_info(:schedulers) + :erlang.system_info(:dirty_cpu_schedulers) +
+        :erlang.system_info(:dirty_io_schedulers)
+
+    path = Path.join(__DIR__, "test.png")
+    expected = StbImage.read_file!(path)
+    before = StbImage.memory_stats().decode
+
+    for _ <- 0..threads do
+      assert StbImage.read_file!(path) == expected
+    end
+
+    stats = StbImage.memory_stats()
+    assert stats.decode.arena_allocs > before.arena_allocs
+    assert stats.arenas > 0
+  end
+
+  test "resize_many" do
+    frames = for i <- 0..4, do: StbImage.resize(gradient(), 48, 48, crop: {i, i, 60, 60})
+    expected = Enum.map(frames, &StbImage.resize(&1, 20, 12))
+
+    for threads <- [1, 2, 8] do
+      assert StbImage.resize_many(frames, {20, 12}, threads: threads) == expected
+    end
+
+    {binary, shape} = StbImage.resize_many(frames, {20, 12}, packed: true, output_type: :f32)
+    assert shape == {5, 20, 12, 3}
+    assert binary == Enum.map_join(frames, &StbImage.resize(&1, 20, 12, output_type: :f32).data)
+
+    assert_raise ArgumentError, ~r/expected all images/, fn ->
+      StbImage.resize_many([gradient(), hd(expected)], {8, 8})
+    end
+  end
+
+  test "premultiply and unpremultiply" do
+    img = StbImage.new(<<200, 100, 50, 128, 10, 20, 30, 0, 255, 255, 255, 255>>, {1, 3, 4})
+    premultiplied = StbImage.premultiply(img)
+    assert premultiplied.data == <<100, 50, 25, 128, 0, 0, 0, 0, 255, 255, 255, 255>>
+
+    assert StbImage.unpremultiply(premultiplied).data ==
+             <<199, 100, 50, 128, 0, 0, 0, 0, 255, 255, 255, 255>>
+
+    float = StbImage.new(<<0.5::float-32-native, 0.5::float-32-native>>, {1, 1, 2}, type: :f32)
+
+    assert StbImage.premultiply(float).data ==
+             <<0.25::float-32-native, 0.5::float-32-native>>
+
+    assert StbImage.unpremultiply(StbImage.premultiply(float)) == float
+
+    data = <<65535::16-native, 32768::16-native, 0::16-native, 32768::16-native>>
+    u16 = StbImage.new(data, {1, 1, 4}, type: :u16)
+
+    assert StbImage.premultiply(u16).data ==
+             <<32768::16-native, 16384::16-native, 0::16-native, 32768::16-native>>
+
+    assert StbImage.unpremultiply(StbImage.premultiply(u16)) == u16
+
+    half = StbImage.new(<<0.5::float-16-native, 0.5::float-16-native>>, {1, 1, 2}, type: :f16)
+    assert StbImage.premultiply(half).data == <<0.25::float-16-native, 0.5::float-16-native>>
+    assert StbImage.unpremultiply(StbImage.premultiply(half)) == half
+
+    assert_raise ArgumentError, ~r/2 or 4 channels/, fn -> StbImage.premultiply(gradient()) end
+  end
+
+  test "resize premultiplied" do
+    pixels = :binary.copy(<<200, 100, 50, 0, 10, 20, 30, 255>>, 32 * 32)
+    img = StbImage.new(pixels, {32, 64, 4})
+
+    resized =
+      img
+      |> StbImage.premultiply()
+      |> StbImage.resize(16, 32, premultiplied: true, filter: :box)
+      |> StbImage.unpremultiply()
+
+    assert resized.shape == {16, 32, 4}
+    assert <<10, 20, 30, 128, _::binary>> = resized.data
+
+    assert_raise ArgumentError, fn -> StbImage.resize(gradient(), 8, 8, premultiplied: true) end
+  end
+
+  test "resize with output type" do
+    img = StbImage.new(:binary.copy(<<0, 51, 255>>, 16), {4, 4, 3})
+
+    f32 = StbImage.resize(img, 2, 2, output_type: :f32)
+    assert f32.type == {:f, 32}
+    assert <<r::float-32-native, g::float-32-native, b::float-32-native, _::binary>> = f32.data
+    assert_in_delta r, 0.0, 1.0e-6
+    assert_in_delta g, 0.2, 1.0e-6
+    assert_in_delta b, 1.0, 1.0e-6
+
+    u16 = StbImage.resize(img, 2, 2, output_type: {:u, 16})
+    assert u16.type == {:u, 16}
+    assert <<0::16-native, 13107::16-native, 65535::16-native, _::binary>> = u16.data
+
+    f16 = StbImage.resize(img, 2, 2, output_type: :f16, filter: :box)
+    assert f16.type == {:f, 16}
+    assert byte_size(f16.data) == 2 * 2 * 3 * 2
+
+    assert StbImage.resize(img, 2, 2, output_type: :u8) == StbImage.resize(img, 2, 2)
+    assert StbImage.resize(f32, 4, 4, output_type: :u8).type == {:u, 8}
+
+    plan = StbImage.ResizePlan.new({4, 4, 3}, {2, 2}, output_type: :f32)
+    assert StbImage.ResizePlan.resize(plan, img) == f32
+
+    assert_raise ArgumentError, ~r/expected :output_type to be one of/, fn ->
+      StbImage.resize(img, 2, 2, output_type: :bogus)
+    end
+
+    assert_raise ArgumentError, ~r/expected :output_type to be one of/, fn ->
+      StbImage.resize_many([img], {2, 2}, output_type: :bogus)
+    end
+  end
+
+  test "16-bit png" do
+    data =
+      for y <- 0..15, x <- 0..15, into: <<>> do
+        <<x * 4096 + y::16-native, 65535 - y::16-native>>
+      end
+    img = StbImage.new(data, {16, 16, 2}, type: :u16)
+
+    png = StbImage.to_binary(img, :png)
+    assert StbImage.read_binary!(png, bit_depth: 16) == img
+
+    eight = StbImage.read_binary!(png)
+    assert eight.type == {:u, 8}
+    assert <<0, 255, 0, 255, 16, 255, _::binary>> = eight.data
+
+    try do
+      File.mkdir_p!("tmp")
+      :ok = StbImage.write_file!(img, "tmp/save_test_16.png")
+      assert StbImage.read_file!("tmp/save_test_16.png", bit_depth: 16) == img
+
+      {:ok, writer} = StbImage.PngWriter.open("tmp/save_test_16.png", {16, 16, 2}, type: :u16)
+      write_bands(writer, img, 4)
+      assert StbImage.PngWriter.close(writer) == :ok
+      assert StbImage.read_file!("tmp/save_test_16.png", bit_depth: 16) == img
+    after
+      File.rm!("tmp/save_test_16.png")
+    end
+
+    assert StbImage.resize(img, 8, 8).type == {:u, 16}
+    assert StbImage.resize(img, 8, 8, output_type: :f16).type == {:f, 16}
+
+    assert_raise ArgumentError, ~r/incompatible type/, fn -> StbImage.to_binary(img, :jpg) end
+  end
+
+  test "read with resize_to" do
+    for ext <- ~w(png qoi jpg) do
+      path = Path.join(__DIR__, "test.#{ext}")
+      img = StbImage.read_file!(path)
+      {h, w, _} = img.shape
+
+      for opts <- [[], [filter: :triangle], [edge: :reflect], [output_type: :f32]] do
+        expected = StbImage.resize(img, div(h, 3), div(w, 2), opts)
+        read_opts = [resize_to: {div(h, 3), div(w, 2)}, resize_options: opts]
+
+        assert StbImage.read_file!(path, read_opts) == expected
+        assert StbImage.read_binary!(File.read!(path), read_opts) == expected
+      end
+
+      expected = path |> StbImage.read_file!(channels: 1) |> StbImage.resize(h * 2, w)
+      assert StbImage.read_file!(path, channels: 1, resize_to: {h * 2, w}) == expected
+    end
+
+    assert_raise ArgumentError, ~r/:resize_to/, fn ->
+      StbImage.read_file(Path.join(__DIR__, "test.png"), resize_to: 10)
+    end
+
+    assert_raise ArgumentError, ~r/:crop/, fn ->
+      StbImage.read_file(Path.join(__DIR__, "test.png"),
+        resize_to: {10, 10},
+        resize_options: [crop: {0, 0, 5, 5}]
+      )
+    end
+  end
+
+  test "read with resize_to streams PNG and JPEG rows" do
+    data =
+      for y <- 0..999, x <- 0..999, into: <<>> do
+        <<rem(x, 256), rem(y, 256), rem(x + y, 256)>>
+      end
+
+    img = StbImage.new(data, {1000, 1000, 3})
+    ref = make_ref()
+    parent = self()
+
+    :telemetry.attach(
+      ref,
+      [:stb_image, :decode, :stop],
+      fn _, measurements, _, _ -> send(parent, {ref, measurements}) end,
+      nil
+    )
+
+    try do
+      for format <- [:png, :jpg] do
+        binary = StbImage.to_binary(img, format)
+        full = StbImage.read_binary!(binary)
+        assert_received {^ref, %{memory: full_memory}}
+        assert full_memory >= byte_size(data)
+
+        # Wrapping edges go back to the first rows, which decodes them again
+        for opts <- [[], [edge: :wrap], [filter: :point], [filter: :box]] do
+          read_opts = [resize_to: {100, 100}, resize_options: opts]
+          assert StbImage.read_binary!(binary, read_opts) == StbImage.resize(full, 100, 100, opts)
+          assert_received {^ref, %{memory: memory}}
+          assert memory < byte_size(data) / 2
+        end
+      end
+    after
+      :telemetry.detach(ref)
+    end
+  end
+
   test "read/write file with UTF-8 characters in filename" do
     try do
       File.cp(Path.join(__DIR__, "test.png"), Path.join(__DIR__, "テスト.png"))
@@ -1 +1,5 @@
-ExUnit.start()
+# Tests tagged :large allocate images over 2GiB, run them with
+# `mix test --include large`. Tests tagged :profile need the NIF built
+# with STB_IMAGE_PROFILE=1, which also includes them.
+exclude = if System.get_env("STB_IMAGE_PROFILE") == "1", do: [:large], else: [:large, :profile]
+ExUnit.start(exclude: exclude)